@@ -6,6 +6,7 @@
 
 #include <zephyr/kernel.h>
 #include <zephyr/sys/fdtable.h>
+#include <limits.h>
 
 #include "devfs.h"
 
@@ -49,7 +50,10 @@ int devfs_open(struct devfs_file_t *file, const char *path, int flags)
     }
     DEVFS_ASSERT(file->inode);
 
-    file->flags = flags;
+    file->flags  = flags;
+    file->stream = false;
+    file->advice = 0;
+    file->ioprio = 0;
 
     if (file->inode->dev_ops->open) {
         retval = file->inode->dev_ops->open(file);
@@ -101,16 +105,71 @@ int devfs_write(struct devfs_file_t *file, const void *buff, size_t size)
     return file->inode->dev_ops->write(file, buff, size);
 }
 
-int devfs_lseek(struct devfs_file_t *file, off_t off, int whence)
+/* Seek and return the new position in *pos, which may be past INT_MAX */
+int devfs_lseek64(struct devfs_file_t *file, devfs_off_t off, int whence, devfs_off_t *pos)
 {
+    int retval = 0;
+
     DEVFS_ASSERT(file);
     DEVFS_ASSERT(file->inode);
 
+    if (file->inode->dev_ops->lseek64) {
+        retval = file->inode->dev_ops->lseek64(file, off, whence);
+        if ((retval == 0) && pos) {
+            *pos = file->offset;
+        }
+
+        return retval;
+    }
+
     if (!file->inode->dev_ops->lseek) {
         return -ENOTSUP;
     }
 
-    return file->inode->dev_ops->lseek(file, off, whence);
+    /* The lseek op returns the position as an int, so it seeks up to INT_MAX */
+    if ((off < 0) ? (off < (devfs_off_t)INT_MIN) : (off > (devfs_off_t)INT_MAX)) {
+        return -EOVERFLOW;
+    }
+
+    retval = file->inode->dev_ops->lseek(file, (off_t)off, whence);
+    if (retval < 0) {
+        return retval;
+    }
+
+    if (pos) {
+        *pos = retval;
+    }
+
+    return 0;
+}
+
+int devfs_lseek(struct devfs_file_t *file, off_t off, int whence)
+{
+    devfs_off_t oldpos = 0;
+    devfs_off_t newpos = 0;
+    int retval = 0;
+
+    DEVFS_ASSERT(file);
+    DEVFS_ASSERT(file->inode);
+
+    if (file->inode->dev_ops->lseek) {
+        return file->inode->dev_ops->lseek(file, off, whence);
+    }
+
+    oldpos = file->offset;
+
+    retval = devfs_lseek64(file, off, whence, &newpos);
+    if (retval < 0) {
+        return retval;
+    }
+
+    /* The position must fit the return value, as for lseek() */
+    if (newpos > INT_MAX) {
+        file->offset = oldpos;
+        return -EOVERFLOW;
+    }
+
+    return (int)newpos;
 }
 
 int devfs_ioctl(struct devfs_file_t *file, unsigned int cmd, unsigned long arg)
@@ -130,6 +189,34 @@ int devfs_ioctl(struct devfs_file_t *file, unsigned int cmd, unsigned long arg)
     return file->inode->dev_ops->ioctl(file, cmd, arg);
 }
 
+/*
+ * Copy size bytes from the position of in to the position of out and
+ * advance both, without passing the data through the caller, as
+ * copy_file_range(). Returns the bytes copied, short at the end of either
+ * file; both must be devices of the same type.
+ */
+int devfs_copy(struct devfs_file_t *in, struct devfs_file_t *out, size_t size)
+{
+    DEVFS_ASSERT(in);
+    DEVFS_ASSERT(out);
+    DEVFS_ASSERT(in->inode);
+    DEVFS_ASSERT(out->inode);
+
+    if (!(in->flags & DEVFS_O_READ) || !(out->flags & DEVFS_O_WRITE)) {
+        return -EACCES;
+    }
+
+    if (in->inode->dev_ops != out->inode->dev_ops) {
+        return -EXDEV;
+    }
+
+    if (!out->inode->dev_ops->copy) {
+        return -ENOTSUP;
+    }
+
+    return out->inode->dev_ops->copy(in, out, size);
+}
+
 int devfs_close(struct devfs_file_t *file)
 {
     DEVFS_ASSERT(file);
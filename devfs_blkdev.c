@@ -9,248 +9,3593 @@
 #include "devfs_os.h"
 DEVFS_LOG_MODULE_REG(devfs_blkdev);
 
-#define INVALID_BLOCK   0xFFFFFFFF
+#define INVALID_BLOCK   ((blkdev_sector_t)-1)
+
+struct devfs_blkdev_t;
+
+struct devfs_blkdev_cache_t {
+    struct list_head lru;           /* Link in the pool free list or LRU list */
+    struct list_head node;          /* Link in the owner's cache list */
+    struct devfs_blkdev_t *owner;   /* NULL while the page is free */
+
+    blkdev_sector_t block;
+    uint32_t dirtymap;              /* One bit per dirty chunk of the sector */
+    uint32_t dirtytime;             /* devfs_uptime_ms() when the page turned dirty */
+    bool pinned;                    /* BIOC_PIN: off the LRU list, never evicted */
+    bool owned;                     /* A device's own page, never in the pool */
+    uint8_t *data;
+};
+
+/* An MTDIOC_ERASE_ASYNC request waiting for the worker */
+struct devfs_blkdev_erase_t {
+    struct list_head node;
+    void (*done)(int result, void *arg);
+    void *arg;
+    uint32_t next;          /* Next range to erase */
+    uint32_t erased;        /* Erase blocks of that range already erased */
+    uint32_t nranges;
+    int result;             /* Passed to done once the request is finished */
+    struct mtddev_erase_t ranges[];
+};
+
+struct devfs_blkdev_segment_t;
+
+/* A read or write waiting for its turn on the device */
+struct devfs_blkdev_waiter_t {
+    struct list_head node;
+    devfs_sem_t sem;        /* Given with the turn */
+    uint32_t rank;          /* 0 is served first */
+    uint32_t since;         /* devfs_uptime_ms() when it started waiting */
+    devfs_thread_t thread;  /* The waiting thread and its own priority */
+    int prio;
+};
+
+/*
+ * Turns of a stack of block devices. The bottom device keeps them;
+ * partitions and FTLs registered on it with config->lower share them, so
+ * reads and writes anywhere on the stack arbitrate by class.
+ */
+struct devfs_blkdev_turn_t {
+    devfs_mutex_t lock;         /* Guards the fields below, never held with a device mutex */
+    bool busy;                  /* A read or write holds the turn */
+    devfs_thread_t holder;      /* The thread holding it */
+    int holderprio;             /* Its own priority, given back when it passes the turn on */
+    bool boosted;               /* It runs at the priority of a waiter */
+    struct list_head waiters;   /* Reads and writes waiting for the turn, oldest first */
+};
 
 struct devfs_blkdev_t {
     const struct devfs_blkdev_ops *ops;
-    uint32_t sectorsize;
-    uint32_t nsectors;
-
-    uint32_t block;
-    union {
-        bool dirty;
-        uint32_t align_with_4_bytes;
-    };
-    uint8_t  cache[0]; /* Align with 4 bytes */
+    struct devfs_inode_t *inode;
+    uint32_t sectorsize;    /* Logical sector size seen by the block layer */
+    blkdev_sector_t nsectors;
+    uint32_t alignment;
+    uint32_t ratio;         /* Driver sectors per logical sector */
+    uint32_t chunkratio;    /* Driver sectors per dirty tracking chunk */
+    uint32_t chunksize;
+    struct devfs_blkdev_cache_t *ownpage;   /* Sectors larger than a pool page are cached here, NULL otherwise */
+
+    /* Erase state of MTD devices, erased is NULL for other devices */
+    uint32_t *erased;       /* One bit per erase block known to be blank */
+    uint32_t eraseratio;    /* Driver sectors per erase block */
+    uint32_t neraseblocks;
+    uint8_t erasevalue;
+
+    /* Erases run on the worker thread */
+    devfs_work_t erasework;
+    struct list_head erases;    /* Queued erase requests, oldest first */
+    struct list_head erasedone; /* Finished requests whose callback hasn't run yet */
+    int erase_error;            /* First queued erase failure not yet reported */
+    uint32_t preerase_start;    /* Pre-erase region, empty when start == end */
+    uint32_t preerase_end;
+    uint32_t preerase_next;     /* First erase block of the region not erased yet */
+    uint32_t preerase_limit;    /* The worker erases up to here */
+    uint32_t preerase_ahead;
+
+    uint32_t stacked;           /* Drivers stacked on the device, each holding a reference */
+    uint32_t maxxfer;           /* Whole sectors a read or write moves per lock hold, 0 for no limit */
+    /* Reads and writes take turns by I/O priority, see devfs_blkdev_ioprio_enter() */
+    struct devfs_blkdev_turn_t turns;   /* Used when the device is the bottom of its stack */
+    struct devfs_blkdev_turn_t *turn;   /* Its own turns or those of the device it is stacked on */
+    bool compare;               /* Only program data that differs from the device */
+    uint32_t *streamed;         /* Erase blocks the stream writer has reached, NULL without one */
+
+    /* Whole-device RAM copy of shadowed devices, shadow is NULL until the first open */
+    bool shadowed;              /* Registered with config->shadow */
+    uint8_t *shadow;
+    uint32_t *shadowdirty;      /* One bit per sector not written back yet */
+    uint32_t nshadowdirty;
+    uint32_t shadowtime;        /* devfs_uptime_ms() when the oldest of them turned dirty */
+    uint32_t shadowsize;        /* Bytes allocated for the shadow and its bitmap */
+
+    /* Write-back queue, merge is NULL for devices without one */
+    uint8_t *merge;             /* Gathers adjacent write-backs into one driver call */
+    struct devfs_blkdev_cache_t **sorted;       /* Dirty pages by sector, one slot per pool page */
+    struct devfs_blkdev_segment_t *segments;    /* Runs of dirty chunks being merged, as many */
+    uint32_t mergesectors;      /* Driver sectors merge holds */
+    uint32_t deadline;          /* Milliseconds a dirty page may wait, 0 for no limit */
+    blkdev_sector_t head;       /* Driver sector after the last write-back */
+
+    devfs_mutex_t mutex;
+    struct list_head caches;
+    uint32_t reclaimers;        /* Other devices' allocations waiting on this one, under the pool mutex */
+    devfs_sem_t *unregistered;  /* Given to unregister when the last of them is done */
+
+    struct blkdev_stats_t stats;
+};
+
+/*
+ * All block devices share one budgeted pool of cache pages. Pages are DMA
+ * aligned and padded to whole cache lines, so drivers can always transfer
+ * straight into them; they double as bounce buffers. A device takes
+ * pages on demand and gives them back when it is closed for the last time;
+ * when the pool is empty the least recently used page of any device is
+ * written back and reused.
+ *
+ * Pinned pages are taken off the LRU list, so they are never chosen for
+ * reuse, and stay with their device when it is closed. At most half of the
+ * pool can be pinned.
+ *
+ * Lock order: a device mutex may be held while taking the pool mutex, never
+ * the reverse. The mutex of another device is only try-locked while holding
+ * our own; if that fails we drop ours before blocking on it, so two devices
+ * stealing from each other cannot deadlock.
+ */
+struct devfs_blkdev_pool_t {
+    bool inited;
+    devfs_mutex_t mutex;
+    struct list_head free;
+    struct list_head lru;
+    uint32_t npinned;
+    uint8_t *pages;
+    struct devfs_blkdev_cache_t caches[DEVFS_BLKDEV_CACHE_PAGES];
 };
 
-static int devfs_blkdev_bch_flush_cache(struct devfs_inode_t *inode)
+static struct devfs_blkdev_pool_t _cache_pool;
+static struct devfs_blkdev_pool_t *cache_pool = &_cache_pool;
+
+#define CACHE_PAGE_STRIDE   DEVFS_DMA_ROUND_UP(DEVFS_BLKDEV_CACHE_PAGE_SIZE)
+
+static int devfs_blkdev_pool_init(void)
 {
-    struct devfs_blkdev_t *blkdev = inode->dev_data;
-    int retval = 0;
+    if (cache_pool->inited == true) {
+        return 0;
+    }
 
-    DEVFS_ASSERT(blkdev);
-    DEVFS_ASSERT(blkdev->ops);
+    cache_pool->pages = devfs_malloc_aligned(DEVFS_DMA_ALIGN, DEVFS_BLKDEV_CACHE_PAGES * CACHE_PAGE_STRIDE);
+    if (cache_pool->pages == NULL) {
+        DEVFS_ERROR("cache pool malloc fail");
+        return -ENOMEM;
+    }
 
-    if ((blkdev->dirty == true) &&
-        (blkdev->block != INVALID_BLOCK)) {
-        if (blkdev->ops->write) {
-            retval = blkdev->ops->write(inode, blkdev->cache, blkdev->block, 1);
-            if (retval < 0) {
-                return retval;
-            }
+    devfs_mutex_init(&cache_pool->mutex);
+
+    INIT_LIST_HEAD(&cache_pool->free);
+    INIT_LIST_HEAD(&cache_pool->lru);
+
+    for (int i = 0; i < DEVFS_BLKDEV_CACHE_PAGES; i++) {
+        struct devfs_blkdev_cache_t *cache = &cache_pool->caches[i];
+
+        INIT_LIST_HEAD(&cache->node);
+        cache->owner = NULL;
+        cache->block = INVALID_BLOCK;
+        cache->dirtymap = 0;
+        cache->pinned = false;
+        cache->owned = false;
+        cache->data  = &cache_pool->pages[i * CACHE_PAGE_STRIDE];
+
+        list_add_tail(&cache->lru, &cache_pool->free);
+    }
+
+    cache_pool->inited = true;
+
+    return 0;
+}
+
+static inline bool devfs_blkdev_erased_test(struct devfs_blkdev_t *blkdev, uint32_t eraseblock)
+{
+    /* Stacked drivers program the device behind our back */
+    if ((blkdev->erased == NULL) || (blkdev->stacked > 0) || (eraseblock >= blkdev->neraseblocks)) {
+        return false;
+    }
+
+    return (blkdev->erased[eraseblock / 32] & (1UL << (eraseblock % 32))) != 0;
+}
+
+static void devfs_blkdev_erased_mark(struct devfs_blkdev_t *blkdev, uint32_t seraseblock, uint32_t neraseblocks, bool erased)
+{
+    if (blkdev->erased == NULL) {
+        return;
+    }
 
-            blkdev->dirty = false;
+    for (uint32_t i = seraseblock; (i < seraseblock + neraseblocks) && (i < blkdev->neraseblocks); i++) {
+        if (erased) {
+            blkdev->erased[i / 32] |= (1UL << (i % 32));
         } else {
-            DEVFS_ERROR("blkdev write ops is NULL");
+            blkdev->erased[i / 32] &= ~(1UL << (i % 32));
         }
     }
+}
 
-    return 0;
+/*
+ * Length of the run of driver sectors from ssector whose erase blocks all
+ * share the erase state of the first one, at most nsectors.
+ */
+static uint32_t devfs_blkdev_erased_run(struct devfs_blkdev_t *blkdev, blkdev_sector_t ssector, uint32_t nsectors, bool *erased)
+{
+    uint32_t eraseblock = 0;
+    blkdev_sector_t end = 0;
+
+    *erased = false;
+
+    if (blkdev->erased == NULL) {
+        return nsectors;
+    }
+
+    eraseblock = (uint32_t)(ssector / blkdev->eraseratio);
+    *erased = devfs_blkdev_erased_test(blkdev, eraseblock);
+
+    do {
+        eraseblock++;
+        end = (blkdev_sector_t)eraseblock * blkdev->eraseratio;
+    } while ((end - ssector < nsectors) &&
+             (devfs_blkdev_erased_test(blkdev, eraseblock) == *erased));
+
+    return (end - ssector < nsectors) ? (end - ssector) : nsectors;
 }
 
-static int devfs_blkdev_bch_read_cache(struct devfs_inode_t *inode, size_t block)
+/*
+ * Driver calls in the driver's own sector units. Reads of erase blocks
+ * known to be blank are filled in without touching the device; writes make
+ * the erase blocks they hit unknown again.
+ */
+static int devfs_blkdev_ops_read(struct devfs_blkdev_t *blkdev, void *buffer, blkdev_sector_t ssector, uint32_t nsectors)
 {
-    struct devfs_blkdev_t *blkdev = inode->dev_data;
+    uint32_t blocksize = blkdev->sectorsize / blkdev->ratio;
+    uint8_t *dst = buffer;
+    unsigned int start = 0;
+    uint32_t count = 0;
+    bool erased = false;
     int retval = 0;
 
-    DEVFS_ASSERT(blkdev);
-    DEVFS_ASSERT(blkdev->ops);
+    while (nsectors > 0) {
+        count = devfs_blkdev_erased_run(blkdev, ssector, nsectors, &erased);
 
-    if (blkdev->block != block) {
-        retval = devfs_blkdev_bch_flush_cache(inode);
-        if (retval < 0) {
-            return retval;
-        }
+        if (erased) {
+            memset(dst, blkdev->erasevalue, count * blocksize);
+            blkdev->stats.erased_rdbytes += count * blocksize;
+        } else {
+            start = devfs_cycles();
 
-        blkdev->block = INVALID_BLOCK;
+            retval = blkdev->ops->read(blkdev->inode, dst, ssector, count);
 
-        retval = blkdev->ops->read(inode, blkdev->cache, block, 1);
-        if (retval < 0) {
-            return retval;
+            blkdev->stats.driver_reads++;
+            blkdev->stats.driver_time_us += devfs_cycles_to_us(devfs_cycles() - start);
+
+            if (retval < 0) {
+                return retval;
+            }
         }
 
-        blkdev->block = block;
+        dst      += count * blocksize;
+        ssector  += count;
+        nsectors -= count;
     }
 
     return 0;
 }
 
-static int devfs_blkdev_bch_read(struct devfs_inode_t *inode, uint8_t *buffer, off_t offset, size_t length)
+static int devfs_blkdev_ops_write(struct devfs_blkdev_t *blkdev, const void *buffer, blkdev_sector_t ssector, uint32_t nsectors)
 {
-    struct devfs_blkdev_t *blkdev = inode->dev_data;
-    uint32_t block = 0;
-    uint32_t nsectors = 0;
-    uint32_t blkoff = 0;
-    uint32_t rdbytes = 0;
-    uint32_t nbytes = 0;
+    unsigned int start = 0;
     int retval = 0;
 
-    DEVFS_ASSERT(blkdev);
-    DEVFS_ASSERT(blkdev->ops);
-
-    block = (offset / blkdev->sectorsize);
-    blkoff = (offset - block * blkdev->sectorsize);
+    if (blkdev->erased && (nsectors > 0)) {
+        uint32_t first = (uint32_t)(ssector / blkdev->eraseratio);
+        uint32_t last  = (uint32_t)((ssector + nsectors - 1) / blkdev->eraseratio);
 
-    if (block >= blkdev->nsectors) {
-        /* Return end-of-file */
-        return 0;
+        devfs_blkdev_erased_mark(blkdev, first, last - first + 1, false);
     }
 
-    if (blkoff > 0) {
-        retval = devfs_blkdev_bch_read_cache(inode, block);
-        if (retval < 0) {
-            return retval;
-        }
+    start = devfs_cycles();
 
-        if ((blkoff + length) > blkdev->sectorsize) {
-            nbytes = blkdev->sectorsize - blkoff;
-        } else {
-            nbytes = length;
-        }
+    retval = blkdev->ops->write(blkdev->inode, buffer, ssector, nsectors);
 
-        memcpy(buffer, &blkdev->cache[blkoff], nbytes);
+    blkdev->stats.driver_writes++;
+    blkdev->stats.driver_time_us += devfs_cycles_to_us(devfs_cycles() - start);
 
-        block++;
+    return retval;
+}
 
-        if (block >= blkdev->nsectors) {
-            return nbytes;
+/* Driver calls in logical sector units */
+static int devfs_blkdev_driver_read(struct devfs_blkdev_t *blkdev, void *buffer, blkdev_sector_t block, uint32_t nsectors)
+{
+    return devfs_blkdev_ops_read(blkdev, buffer, block * blkdev->ratio, nsectors * blkdev->ratio);
+}
+
+static int devfs_blkdev_driver_write(struct devfs_blkdev_t *blkdev, const void *buffer, blkdev_sector_t block, uint32_t nsectors)
+{
+    return devfs_blkdev_ops_write(blkdev, buffer, block * blkdev->ratio, nsectors * blkdev->ratio);
+}
+
+static struct devfs_blkdev_cache_t *devfs_blkdev_cache_lookup(struct devfs_blkdev_t *blkdev, blkdev_sector_t block)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+
+    list_for_each_entry(cache, &blkdev->caches, node) {
+        if (cache->block == block) {
+            return cache;
         }
+    }
 
-        rdbytes = nbytes;
-        buffer += nbytes;
-        length -= nbytes;
+    return NULL;
+}
+
+static void devfs_blkdev_cache_touch(struct devfs_blkdev_cache_t *cache)
+{
+    if (cache->pinned) {
+        return;
     }
 
-    if (length >= blkdev->sectorsize) {
-        nsectors = length / blkdev->sectorsize;
+    devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
 
-        if (nsectors > (blkdev->nsectors - block)) {
-            nsectors = (blkdev->nsectors - block);
-        }
+    list_move_tail(&cache->lru, &cache_pool->lru);
 
-        retval = blkdev->ops->read(inode, buffer, block, nsectors);
-        if (retval < 0) {
-            return retval;
-        }
+    devfs_mutex_unlock(&cache_pool->mutex);
+}
 
-        block   += nsectors;
-        nbytes   = nsectors * blkdev->sectorsize;
-        rdbytes += nbytes;
+/* Make a page the next to be reused, for data read once */
+static void devfs_blkdev_cache_cool(struct devfs_blkdev_cache_t *cache)
+{
+    if (cache->pinned) {
+        return;
+    }
 
-        if (block >= blkdev->nsectors) {
-            return rdbytes;
-        }
+    devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
 
-        buffer += nbytes;
-        length -= nbytes;
+    list_move(&cache->lru, &cache_pool->lru);
+
+    devfs_mutex_unlock(&cache_pool->mutex);
+}
+
+/*
+ * Hand a page over to blkdev. Ownership only changes under the pool mutex,
+ * so a page on the LRU list always has an owner whose mutex guards it.
+ */
+static void devfs_blkdev_cache_attach(struct devfs_blkdev_t *blkdev, struct devfs_blkdev_cache_t *cache, blkdev_sector_t block)
+{
+    devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
+
+    cache->owner = blkdev;
+    cache->block = block;
+    cache->dirtymap = 0;
+
+    list_move_tail(&cache->lru, &cache_pool->lru);
+
+    devfs_mutex_unlock(&cache_pool->mutex);
+
+    list_add(&cache->node, &blkdev->caches);
+}
+
+/* Remove a page from its owner and give it back to the pool without writing it */
+static void devfs_blkdev_cache_put(struct devfs_blkdev_cache_t *cache)
+{
+    if (cache->owned) {
+        /* It stays with its device, holding nothing */
+        cache->block = INVALID_BLOCK;
+        cache->dirtymap = 0;
+        return;
     }
 
-    if (length > 0) {
-        retval = devfs_blkdev_bch_read_cache(inode, block);
-        if (retval < 0) {
-            return retval;
-        }
+    list_del_init(&cache->node);
 
-        memcpy(buffer, blkdev->cache, length);
+    devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
 
-        rdbytes += length;
+    if (cache->pinned) {
+        cache->pinned = false;
+        cache_pool->npinned--;
     }
 
-    return rdbytes;
+    cache->owner = NULL;
+    cache->block = INVALID_BLOCK;
+    cache->dirtymap = 0;
+
+    list_move(&cache->lru, &cache_pool->free);
+
+    devfs_mutex_unlock(&cache_pool->mutex);
 }
 
-static int devfs_blkdev_bch_write(struct devfs_inode_t *inode, const uint8_t *buffer, off_t offset, size_t length)
+static void devfs_blkdev_cache_dirty(struct devfs_blkdev_t *blkdev, struct devfs_blkdev_cache_t *cache, uint32_t offset, uint32_t length)
 {
-    struct devfs_blkdev_t *blkdev = inode->dev_data;
-    uint32_t block = 0;
-    uint32_t nsectors = 0;
-    uint32_t blkoff = 0;
-    uint32_t wrbytes = 0;
-    uint32_t nbytes = 0;
-    int retval = 0;
+    uint32_t first = offset / blkdev->chunksize;
+    uint32_t last  = (offset + length - 1) / blkdev->chunksize;
 
-    DEVFS_ASSERT(blkdev);
-    DEVFS_ASSERT(blkdev->ops);
+    if (cache->dirtymap == 0) {
+        cache->dirtytime = devfs_uptime_ms();
+    }
 
-    block = (offset / blkdev->sectorsize);
-    blkoff = (offset - block * blkdev->sectorsize);
+    for (uint32_t i = first; i <= last; i++) {
+        cache->dirtymap |= (1UL << i);
+    }
+}
 
-    if (block >= blkdev->nsectors) {
-        return -EFBIG;
+/*
+ * Copy written data into a cached sector. In compare mode only chunks whose
+ * data changes are marked dirty, so rewriting what the sector already holds
+ * programs nothing.
+ */
+static void devfs_blkdev_cache_update(struct devfs_blkdev_t *blkdev, struct devfs_blkdev_cache_t *cache,
+                                      const uint8_t *buffer, uint32_t offset, uint32_t length)
+{
+    uint32_t nbytes = 0;
+
+    if (!blkdev->compare) {
+        memcpy(&cache->data[offset], buffer, length);
+        devfs_blkdev_cache_dirty(blkdev, cache, offset, length);
+        return;
     }
 
-    if (blkoff > 0) {
-        retval = devfs_blkdev_bch_read_cache(inode, block);
-        if (retval < 0) {
-            return retval;
-        }
+    while (length > 0) {
+        nbytes = MIN(length, blkdev->chunksize - offset % blkdev->chunksize);
 
-        if ((blkoff + length) > blkdev->sectorsize) {
-            nbytes = blkdev->sectorsize - blkoff;
+        if (memcmp(&cache->data[offset], buffer, nbytes) == 0) {
+            blkdev->stats.compare_skipped_bytes += nbytes;
         } else {
-            nbytes = length;
+            memcpy(&cache->data[offset], buffer, nbytes);
+            devfs_blkdev_cache_dirty(blkdev, cache, offset, nbytes);
+            blkdev->stats.compare_changed_bytes += nbytes;
         }
 
-        memcpy(&blkdev->cache[blkoff], buffer, nbytes);
-        blkdev->dirty = true;
+        buffer += nbytes;
+        offset += nbytes;
+        length -= nbytes;
+    }
+}
+
+static int devfs_blkdev_queue_dispatch(struct devfs_blkdev_t *blkdev, struct devfs_blkdev_cache_t *around);
 
-        block++;
+static int devfs_blkdev_cache_writeback(struct devfs_blkdev_cache_t *cache)
+{
+    struct devfs_blkdev_t *blkdev = cache->owner;
+    int retval = 0;
 
-        if (block >= blkdev->nsectors) {
-            return nbytes;
-        }
+    DEVFS_ASSERT(blkdev);
 
-        wrbytes = nbytes;
-        buffer += nbytes;
-        length -= nbytes;
+    if (blkdev->merge && (cache->dirtymap != 0) && (cache->block != INVALID_BLOCK)) {
+        /* Take the dirty neighbours of the page along */
+        return devfs_blkdev_queue_dispatch(blkdev, cache);
     }
 
-    if (length >= blkdev->sectorsize) {
-        nsectors = length / blkdev->sectorsize;
+    DEVFS_ASSERT(blkdev->ops);
 
-        if (nsectors > (blkdev->nsectors - block)) {
-            nsectors = (blkdev->nsectors - block);
-        }
+    if ((cache->dirtymap != 0) &&
+        (cache->block != INVALID_BLOCK)) {
+        if (blkdev->ops->write) {
+            /* Program each run of dirty chunks, skipping the clean ones */
+            uint32_t nchunks = (blkdev->ratio + blkdev->chunkratio - 1) / blkdev->chunkratio;
+            blkdev_sector_t ssector = cache->block * blkdev->ratio;
+            uint32_t first = 0;
+            uint32_t last = 0;
+            uint32_t nsectors = 0;
+            uint32_t written = 0;
 
-        retval = devfs_blkdev_bch_flush_cache(inode);
-        if (retval < 0) {
-            return retval;
-        }
+            while (first < nchunks) {
+                if (!(cache->dirtymap & (1UL << first))) {
+                    first++;
+                    continue;
+                }
 
-        retval = blkdev->ops->write(inode, buffer, block, nsectors);
-        if (retval < 0) {
-            return retval;
+                last = first;
+                while ((last + 1 < nchunks) && (cache->dirtymap & (1UL << (last + 1)))) {
+                    last++;
+                }
+
+                nsectors = (last + 1 - first) * blkdev->chunkratio;
+                if (first * blkdev->chunkratio + nsectors > blkdev->ratio) {
+                    nsectors = blkdev->ratio - first * blkdev->chunkratio;
+                }
+
+                retval = devfs_blkdev_ops_write(blkdev, &cache->data[first * blkdev->chunksize],
+                                                ssector + first * blkdev->chunkratio, nsectors);
+                if (retval < 0) {
+                    return retval;
+                }
+
+                for (; first <= last; first++) {
+                    cache->dirtymap &= ~(1UL << first);
+                }
+
+                written += nsectors * (blkdev->sectorsize / blkdev->ratio);
+            }
+
+            blkdev->stats.cache_flushes++;
+            blkdev->stats.flush_bytes += written;
+            blkdev->stats.flush_saved_bytes += blkdev->sectorsize - written;
+        } else {
+            DEVFS_ERROR("blkdev write ops is NULL");
         }
+    }
 
-        block   += nsectors;
-        nbytes   = nsectors * blkdev->sectorsize;
-        wrbytes += nbytes;
+    return 0;
+}
 
-        if (block >= blkdev->nsectors) {
-            return wrbytes;
+/* Give the least recently used page of a busy device back to the free list */
+static int devfs_blkdev_cache_reclaim(struct devfs_blkdev_t *owner)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    struct devfs_blkdev_cache_t *victim = NULL;
+    int retval = 0;
+
+    devfs_mutex_lock(&owner->mutex, DEVFS_FOREVER);
+    devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
+
+    list_for_each_entry(cache, &cache_pool->lru, lru) {
+        if (cache->owner == owner) {
+            victim = cache;
+            break;
         }
+    }
 
-        buffer += nbytes;
-        length -= nbytes;
+    devfs_mutex_unlock(&cache_pool->mutex);
+
+    if (victim) {
+        retval = devfs_blkdev_cache_writeback(victim);
+        if (retval == 0) {
+            owner->stats.cache_evictions++;
+            devfs_blkdev_cache_put(victim);
+        }
     }
 
-    if (length > 0) {
-        retval = devfs_blkdev_bch_read_cache(inode, block);
+    devfs_mutex_unlock(&owner->mutex);
+
+    return retval;
+}
+
+/*
+ * Take a page for blkdev, whose mutex is held by the caller. The page is
+ * attached with an invalid block and must be filled or put back. Returns
+ * -EAGAIN if the mutex had to be dropped to wait for another device; the
+ * caller must then look the sector up again.
+ */
+static int devfs_blkdev_cache_alloc(struct devfs_blkdev_t *blkdev, struct devfs_blkdev_cache_t **cache)
+{
+    struct devfs_blkdev_cache_t *victim = NULL;
+    struct devfs_blkdev_cache_t *p = NULL;
+    struct devfs_blkdev_t *owner = NULL;
+    int retval = 0;
+
+    if (blkdev->ownpage) {
+        /* The one page of the device, whatever it held is written back first */
+        retval = devfs_blkdev_cache_writeback(blkdev->ownpage);
         if (retval < 0) {
             return retval;
         }
 
-        memcpy(blkdev->cache, buffer, length);
-        blkdev->dirty = true;
+        devfs_blkdev_cache_put(blkdev->ownpage);
 
-        wrbytes += length;
+        *cache = blkdev->ownpage;
+        return 0;
+    }
+
+    devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
+
+    if (!list_empty(&cache_pool->free)) {
+        victim = list_first_entry(&cache_pool->free, struct devfs_blkdev_cache_t, lru);
+
+        victim->owner = blkdev;
+        victim->block = INVALID_BLOCK;
+        victim->dirtymap = 0;
+
+        list_move_tail(&victim->lru, &cache_pool->lru);
+
+        devfs_mutex_unlock(&cache_pool->mutex);
+
+        list_add(&victim->node, &blkdev->caches);
+
+        *cache = victim;
+        return 0;
+    }
+
+    if (list_empty(&cache_pool->lru)) {
+        devfs_mutex_unlock(&cache_pool->mutex);
+        return -ENOMEM;
+    }
+
+    list_for_each_entry(p, &cache_pool->lru, lru) {
+        if ((p->owner == blkdev) ||
+            (devfs_mutex_lock(&p->owner->mutex, 0) == 0)) {
+            victim = p;
+            break;
+        }
+    }
+
+    if (victim == NULL) {
+        /* Every page belongs to a busy device, wait for the oldest one */
+        owner = list_first_entry(&cache_pool->lru, struct devfs_blkdev_cache_t, lru)->owner;
+
+        /* Keeps unregister from freeing owner until the reclaim is done */
+        owner->reclaimers++;
+
+        devfs_mutex_unlock(&cache_pool->mutex);
+        devfs_mutex_unlock(&blkdev->mutex);
+
+        retval = devfs_blkdev_cache_reclaim(owner);
+
+        devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
+
+        owner->reclaimers--;
+        if ((owner->reclaimers == 0) && owner->unregistered) {
+            devfs_sem_give(owner->unregistered);
+        }
+
+        devfs_mutex_unlock(&cache_pool->mutex);
+
+        devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+
+        return (retval < 0) ? retval : -EAGAIN;
+    }
+
+    devfs_mutex_unlock(&cache_pool->mutex);
+
+    owner  = victim->owner;
+    retval = devfs_blkdev_cache_writeback(victim);
+    if (retval == 0) {
+        if (victim->block != INVALID_BLOCK) {
+            owner->stats.cache_evictions++;
+        }
+
+        list_del_init(&victim->node);
+        devfs_blkdev_cache_attach(blkdev, victim, INVALID_BLOCK);
+    }
+
+    if (owner != blkdev) {
+        devfs_mutex_unlock(&owner->mutex);
+    }
+
+    if (retval < 0) {
+        return retval;
+    }
+
+    *cache = victim;
+    return 0;
+}
+
+/*
+ * Write-back queue. The dirty pages of a device are its pending write
+ * requests; several threads writing to the device all add to them, and
+ * writes to the same sector have already been combined in its page. When
+ * pages have to be written back the dispatcher sorts them by sector and
+ * sweeps upwards from where the last write-back ended, wrapping around
+ * once. Runs of dirty chunks that continue each other, across page
+ * boundaries too, are copied into the merge buffer and programmed with a
+ * single driver call. A page evicted or written back on its own takes the
+ * dirty pages next to it along. Pages dirty for longer than the deadline
+ * are written back at the next read or write of the device, so a sector
+ * outside the sweep still reaches the media in bounded time.
+ */
+struct devfs_blkdev_segment_t {
+    struct devfs_blkdev_cache_t *cache;
+    uint32_t first;     /* Dirty chunks first to last of the page */
+    uint32_t last;
+};
+
+static inline blkdev_sector_t devfs_blkdev_segment_start(struct devfs_blkdev_t *blkdev, const struct devfs_blkdev_segment_t *segment)
+{
+    return segment->cache->block * blkdev->ratio + segment->first * blkdev->chunkratio;
+}
+
+static inline uint32_t devfs_blkdev_segment_sectors(struct devfs_blkdev_t *blkdev, const struct devfs_blkdev_segment_t *segment)
+{
+    return MIN((segment->last + 1) * blkdev->chunkratio, blkdev->ratio) - segment->first * blkdev->chunkratio;
+}
+
+/* Program segments that continue each other with one driver call */
+static int devfs_blkdev_queue_issue(struct devfs_blkdev_t *blkdev, struct devfs_blkdev_segment_t *segments, uint32_t nsegments)
+{
+    uint32_t blocksize = blkdev->sectorsize / blkdev->ratio;
+    blkdev_sector_t ssector = devfs_blkdev_segment_start(blkdev, &segments[0]);
+    uint32_t nsectors = 0;
+    uint32_t count = 0;
+    const uint8_t *buffer = NULL;
+    int retval = 0;
+
+    if (nsegments == 1) {
+        nsectors = devfs_blkdev_segment_sectors(blkdev, &segments[0]);
+        buffer = &segments[0].cache->data[segments[0].first * blkdev->chunksize];
+    } else {
+        for (uint32_t i = 0; i < nsegments; i++) {
+            count = devfs_blkdev_segment_sectors(blkdev, &segments[i]);
+
+            memcpy(&blkdev->merge[nsectors * blocksize],
+                   &segments[i].cache->data[segments[i].first * blkdev->chunksize], count * blocksize);
+
+            nsectors += count;
+        }
+
+        buffer = blkdev->merge;
+        blkdev->stats.queue_merges += nsegments - 1;
+    }
+
+    retval = devfs_blkdev_ops_write(blkdev, buffer, ssector, nsectors);
+    if (retval < 0) {
+        return retval;
+    }
+
+    for (uint32_t i = 0; i < nsegments; i++) {
+        for (uint32_t chunk = segments[i].first; chunk <= segments[i].last; chunk++) {
+            segments[i].cache->dirtymap &= ~(1UL << chunk);
+        }
+    }
+
+    blkdev->stats.flush_bytes += nsectors * blocksize;
+    blkdev->head = ssector + nsectors;
+
+    return 0;
+}
+
+/*
+ * Write back the dirty pages of blkdev, or only around and the dirty pages
+ * of the sectors next to it, in elevator order.
+ */
+static int devfs_blkdev_queue_dispatch(struct devfs_blkdev_t *blkdev, struct devfs_blkdev_cache_t *around)
+{
+    struct devfs_blkdev_cache_t **pages = blkdev->sorted;
+    struct devfs_blkdev_segment_t *segments = blkdev->segments;
+    struct devfs_blkdev_cache_t *cache = NULL;
+    uint32_t nchunks = (blkdev->ratio + blkdev->chunkratio - 1) / blkdev->chunkratio;
+    uint32_t npages = 0;
+    uint32_t nsegments = 0;
+    uint32_t nsectors = 0;
+    uint32_t dirty = 0;
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    uint32_t start = 0;
+    int retval = 0;
+
+    /* Sort the dirty pages by sector */
+    list_for_each_entry(cache, &blkdev->caches, node) {
+        uint32_t i = npages;
+
+        if ((cache->dirtymap == 0) || (cache->block == INVALID_BLOCK)) {
+            continue;
+        }
+
+        for (; (i > 0) && (pages[i - 1]->block > cache->block); i--) {
+            pages[i] = pages[i - 1];
+        }
+
+        pages[i] = cache;
+        npages++;
+    }
+
+    hi = npages;
+
+    if (around) {
+        for (lo = 0; (lo < npages) && (pages[lo] != around); lo++) {
+        }
+
+        DEVFS_ASSERT(lo < npages);
+
+        hi = lo + 1;
+
+        while ((lo > 0) && (pages[lo - 1]->block + 1 == pages[lo]->block)) {
+            lo--;
+        }
+
+        while ((hi < npages) && (pages[hi - 1]->block + 1 == pages[hi]->block)) {
+            hi++;
+        }
+
+        start = lo;
+    } else {
+        while ((start < npages) && (pages[start]->block * blkdev->ratio < blkdev->head)) {
+            start++;
+        }
+
+        if (start == npages) {
+            start = 0;
+        }
+    }
+
+    for (uint32_t k = 0; k < hi - lo; k++) {
+        cache = pages[lo + (start - lo + k) % (hi - lo)];
+        dirty = 0;
+
+        for (uint32_t first = 0, last = 0; first < nchunks; first = last + 1) {
+            struct devfs_blkdev_segment_t segment = { cache, first, first };
+
+            if (!(cache->dirtymap & (1UL << first))) {
+                last = first;
+                continue;
+            }
+
+            for (last = first; (last + 1 < nchunks) && (cache->dirtymap & (1UL << (last + 1))); last++) {
+            }
+
+            segment.last = last;
+            dirty += devfs_blkdev_segment_sectors(blkdev, &segment);
+
+            if ((nsegments > 0) &&
+                (devfs_blkdev_segment_start(blkdev, &segments[0]) + nsectors == devfs_blkdev_segment_start(blkdev, &segment)) &&
+                (nsectors + devfs_blkdev_segment_sectors(blkdev, &segment) <= blkdev->mergesectors) &&
+                (nsegments < DEVFS_BLKDEV_CACHE_PAGES)) {
+                segments[nsegments++] = segment;
+                nsectors += devfs_blkdev_segment_sectors(blkdev, &segment);
+                continue;
+            }
+
+            if (nsegments > 0) {
+                retval = devfs_blkdev_queue_issue(blkdev, segments, nsegments);
+                if (retval < 0) {
+                    return retval;
+                }
+            }
+
+            segments[0] = segment;
+            nsegments = 1;
+            nsectors = devfs_blkdev_segment_sectors(blkdev, &segment);
+        }
+
+        blkdev->stats.cache_flushes++;
+        blkdev->stats.flush_saved_bytes += blkdev->sectorsize - dirty * (blkdev->sectorsize / blkdev->ratio);
+    }
+
+    if (nsegments > 0) {
+        retval = devfs_blkdev_queue_issue(blkdev, segments, nsegments);
+    }
+
+    return retval;
+}
+
+/*
+ * Shadowed devices, registered with config->shadow, are read whole into one
+ * DMA aligned buffer at their first open and served from it until they are
+ * unregistered; no cache page is used for them. Reads are a memcpy. Writes
+ * only change the shadow and mark the sectors whose data differs, written
+ * back on flush, close, the deadline or unregister, one driver call per run
+ * of adjacent dirty sectors. Drivers stacked on the device bypass the
+ * shadow as they bypass the cache.
+ */
+static int devfs_blkdev_xfer_write(struct devfs_blkdev_t *blkdev, const uint8_t *buffer, blkdev_sector_t block, uint32_t nsectors,
+                                   bool discard);
+
+static inline bool devfs_blkdev_shadow_test(struct devfs_blkdev_t *blkdev, blkdev_sector_t block)
+{
+    return (blkdev->shadowdirty[block / 32] & (1UL << (block % 32))) != 0;
+}
+
+static void devfs_blkdev_shadow_mark(struct devfs_blkdev_t *blkdev, blkdev_sector_t block, bool dirty)
+{
+    if (devfs_blkdev_shadow_test(blkdev, block) == dirty) {
+        return;
+    }
+
+    if (dirty) {
+        if (blkdev->nshadowdirty == 0) {
+            blkdev->shadowtime = devfs_uptime_ms();
+        }
+
+        blkdev->shadowdirty[block / 32] |= (1UL << (block % 32));
+        blkdev->nshadowdirty++;
+    } else {
+        blkdev->shadowdirty[block / 32] &= ~(1UL << (block % 32));
+        blkdev->nshadowdirty--;
+    }
+}
+
+/* Write back the dirty shadow sectors of [block, end) */
+static int devfs_blkdev_shadow_flush(struct devfs_blkdev_t *blkdev, blkdev_sector_t block, blkdev_sector_t end)
+{
+    blkdev_sector_t run = 0;
+    int retval = 0;
+
+    while ((blkdev->nshadowdirty > 0) && (block < end)) {
+        if (((block % 32) == 0) && (blkdev->shadowdirty[block / 32] == 0)) {
+            block += 32;
+            continue;
+        }
+
+        if (!devfs_blkdev_shadow_test(blkdev, block)) {
+            block++;
+            continue;
+        }
+
+        for (run = block + 1; (run < end) && devfs_blkdev_shadow_test(blkdev, run); run++) {
+        }
+
+        retval = devfs_blkdev_xfer_write(blkdev, &blkdev->shadow[block * blkdev->sectorsize], block, (uint32_t)(run - block), false);
+        if (retval < 0) {
+            return retval;
+        }
+
+        blkdev->stats.cache_flushes += (uint32_t)(run - block);
+        blkdev->stats.flush_bytes += (run - block) * blkdev->sectorsize;
+
+        for (; block < run; block++) {
+            devfs_blkdev_shadow_mark(blkdev, block, false);
+        }
+    }
+
+    return 0;
+}
+
+/* Called with blkdev locked: write back pages that waited past the deadline */
+static int devfs_blkdev_queue_expire(struct devfs_blkdev_t *blkdev)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    uint32_t now = 0;
+    int retval = 0;
+
+    if (blkdev->deadline == 0) {
+        return 0;
+    }
+
+    now = devfs_uptime_ms();
+
+    if (blkdev->shadow) {
+        if ((blkdev->nshadowdirty > 0) && (now - blkdev->shadowtime >= blkdev->deadline)) {
+            retval = devfs_blkdev_shadow_flush(blkdev, 0, blkdev->nsectors);
+            if (retval == 0) {
+                blkdev->stats.queue_expired++;
+            }
+        }
+
+        return retval;
+    }
+
+    if (blkdev->merge == NULL) {
+        return 0;
+    }
+
+    list_for_each_entry(cache, &blkdev->caches, node) {
+        if ((cache->dirtymap == 0) || (cache->block == INVALID_BLOCK) ||
+            (now - cache->dirtytime < blkdev->deadline)) {
+            continue;
+        }
+
+        retval = devfs_blkdev_queue_dispatch(blkdev, cache);
+        if (retval < 0) {
+            return retval;
+        }
+
+        blkdev->stats.queue_expired++;
+    }
+
+    return 0;
+}
+
+static int devfs_blkdev_bch_flush_cache(struct devfs_blkdev_t *blkdev)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    int retval = 0;
+
+    if (blkdev->shadow) {
+        retval = devfs_blkdev_shadow_flush(blkdev, 0, blkdev->nsectors);
+        if (retval < 0) {
+            return retval;
+        }
+    }
+
+    if (blkdev->merge) {
+        return devfs_blkdev_queue_dispatch(blkdev, NULL);
+    }
+
+    list_for_each_entry(cache, &blkdev->caches, node) {
+        retval = devfs_blkdev_cache_writeback(cache);
+        if (retval < 0) {
+            return retval;
+        }
+    }
+
+    return 0;
+}
+
+/* Flush and return every page of blkdev but the pinned ones to the pool */
+static int devfs_blkdev_bch_release_cache(struct devfs_blkdev_t *blkdev)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    struct devfs_blkdev_cache_t *n = NULL;
+    int retval = 0;
+
+    retval = devfs_blkdev_bch_flush_cache(blkdev);
+    if (retval < 0) {
+        return retval;
+    }
+
+    list_for_each_entry_safe(cache, n, &blkdev->caches, node) {
+        if (!cache->pinned) {
+            devfs_blkdev_cache_put(cache);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Drop cached copies of sectors overwritten directly. Pinned pages and the
+ * shadow stay and take the new data. With data NULL, after a failed write
+ * or erase, pages with dirty chunks keep them for a later write-back and
+ * clean pinned pages read the device again.
+ */
+static void devfs_blkdev_bch_discard_cache(struct devfs_blkdev_t *blkdev, blkdev_sector_t block, uint32_t nsectors,
+                                           const uint8_t *data)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    struct devfs_blkdev_cache_t *n = NULL;
+
+    if (blkdev->shadow) {
+        if (data) {
+            memcpy(&blkdev->shadow[block * blkdev->sectorsize], data, nsectors * blkdev->sectorsize);
+        } else if (devfs_blkdev_driver_read(blkdev, &blkdev->shadow[block * blkdev->sectorsize], block, nsectors) < 0) {
+            DEVFS_WARN("shadow of sectors[%llu, +%u) may be stale", (unsigned long long)block, nsectors);
+        }
+
+        for (uint32_t i = 0; i < nsectors; i++) {
+            devfs_blkdev_shadow_mark(blkdev, block + i, false);
+        }
+
+        return;
+    }
+
+    list_for_each_entry_safe(cache, n, &blkdev->caches, node) {
+        if ((cache->block < block) ||
+            (cache->block - block >= nsectors)) {
+            continue;
+        }
+
+        if (cache->pinned && data) {
+            memcpy(cache->data, &data[(cache->block - block) * blkdev->sectorsize], blkdev->sectorsize);
+            cache->dirtymap = 0;
+        } else if ((data == NULL) && (cache->dirtymap != 0)) {
+            continue;
+        } else if (cache->pinned && (devfs_blkdev_driver_read(blkdev, cache->data, cache->block, 1) >= 0)) {
+            continue;
+        } else {
+            devfs_blkdev_cache_put(cache);
+        }
+    }
+}
+
+/* Patch sectors read directly from the device with newer cached data */
+static void devfs_blkdev_bch_overlay_cache(struct devfs_blkdev_t *blkdev, uint8_t *buffer, blkdev_sector_t block, uint32_t nsectors)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+
+    list_for_each_entry(cache, &blkdev->caches, node) {
+        if ((cache->dirtymap != 0) &&
+            (cache->block >= block) &&
+            (cache->block - block < nsectors)) {
+            memcpy(&buffer[(cache->block - block) * blkdev->sectorsize], cache->data, blkdev->sectorsize);
+        }
+    }
+}
+
+/* The shadow side of devfs_blkdev_bch_erase_cache() */
+static int devfs_blkdev_shadow_erase(struct devfs_blkdev_t *blkdev, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    uint32_t dsize = blkdev->sectorsize / blkdev->ratio;
+    blkdev_sector_t esector = MIN(ssector + nsectors, blkdev->nsectors * blkdev->ratio);
+    blkdev_sector_t first = ssector / blkdev->ratio;
+    blkdev_sector_t last = (esector + blkdev->ratio - 1) / blkdev->ratio;
+    int retval = 0;
+
+    if (ssector >= esector) {
+        return 0;
+    }
+
+    if (ssector % blkdev->ratio) {
+        retval = devfs_blkdev_shadow_flush(blkdev, first, first + 1);
+    }
+    if ((retval == 0) && (esector % blkdev->ratio)) {
+        retval = devfs_blkdev_shadow_flush(blkdev, last - 1, last);
+    }
+    if (retval < 0) {
+        return retval;
+    }
+
+    for (blkdev_sector_t block = first; block < last; block++) {
+        devfs_blkdev_shadow_mark(blkdev, block, false);
+    }
+
+    memset(&blkdev->shadow[ssector * dsize], blkdev->erasevalue, (esector - ssector) * dsize);
+
+    return 0;
+}
+
+/*
+ * Drop cached sectors overlapping driver sectors about to be erased. Pages
+ * only partly inside the range are written back first so their other data
+ * survives. Pinned pages and the shadow stay, holding the erased value
+ * where erased.
+ */
+static int devfs_blkdev_bch_erase_cache(struct devfs_blkdev_t *blkdev, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    struct devfs_blkdev_cache_t *n = NULL;
+    blkdev_sector_t first = 0;
+    blkdev_sector_t last = 0;
+    int retval = 0;
+
+    if (blkdev->shadow) {
+        return devfs_blkdev_shadow_erase(blkdev, ssector, nsectors);
+    }
+
+    list_for_each_entry_safe(cache, n, &blkdev->caches, node) {
+        if (cache->block == INVALID_BLOCK) {
+            continue;
+        }
+
+        first = cache->block * blkdev->ratio;
+        last  = first + blkdev->ratio;
+
+        if ((last <= ssector) || (first >= ssector + nsectors)) {
+            continue;
+        }
+
+        if ((first < ssector) || (last > ssector + nsectors)) {
+            retval = devfs_blkdev_cache_writeback(cache);
+            if (retval < 0) {
+                return retval;
+            }
+        }
+
+        if (cache->pinned) {
+            first = MAX(first, ssector);
+            last  = MIN(last, ssector + nsectors);
+
+            memset(&cache->data[(first - cache->block * blkdev->ratio) * (blkdev->sectorsize / blkdev->ratio)],
+                   blkdev->erasevalue, (last - first) * (blkdev->sectorsize / blkdev->ratio));
+            cache->dirtymap = 0;
+            continue;
+        }
+
+        devfs_blkdev_cache_put(cache);
+    }
+
+    return 0;
+}
+
+static int devfs_blkdev_bch_read_cache(struct devfs_blkdev_t *blkdev, blkdev_sector_t block, struct devfs_blkdev_cache_t **cache)
+{
+    int retval = 0;
+
+    DEVFS_ASSERT(blkdev);
+    DEVFS_ASSERT(blkdev->ops);
+
+    do {
+        *cache = devfs_blkdev_cache_lookup(blkdev, block);
+        if (*cache) {
+            blkdev->stats.cache_hits++;
+            devfs_blkdev_cache_touch(*cache);
+            return 0;
+        }
+
+        retval = devfs_blkdev_cache_alloc(blkdev, cache);
+    } while (retval == -EAGAIN);
+
+    if (retval < 0) {
+        return retval;
+    }
+
+    blkdev->stats.cache_misses++;
+
+    retval = devfs_blkdev_driver_read(blkdev, (*cache)->data, block, 1);
+    if (retval < 0) {
+        devfs_blkdev_cache_put(*cache);
+        return retval;
+    }
+
+    (*cache)->block = block;
+
+    return 0;
+}
+
+static inline bool devfs_blkdev_xfer_aligned(struct devfs_blkdev_t *blkdev, const void *buffer)
+{
+    return (blkdev->alignment == 0) || (((uintptr_t)buffer & (blkdev->alignment - 1)) == 0);
+}
+
+/* Bytes a page taken by devfs_blkdev_cache_alloc() holds */
+static inline uint32_t devfs_blkdev_page_size(struct devfs_blkdev_t *blkdev)
+{
+    return blkdev->ownpage ? blkdev->sectorsize : DEVFS_BLKDEV_CACHE_PAGE_SIZE;
+}
+
+/*
+ * Multi-sector transfers hand the caller's buffer straight to the driver
+ * when it meets the driver's alignment, otherwise they bounce through a
+ * cache page, as many sectors at a time as fit in one page.
+ */
+static int devfs_blkdev_xfer_read(struct devfs_blkdev_t *blkdev, uint8_t *buffer, blkdev_sector_t block, uint32_t nsectors)
+{
+    struct devfs_blkdev_cache_t *bounce = NULL;
+    uint32_t per_page = devfs_blkdev_page_size(blkdev) / blkdev->sectorsize;
+    uint32_t count = 0;
+    int retval = 0;
+
+    if (devfs_blkdev_xfer_aligned(blkdev, buffer)) {
+        return devfs_blkdev_driver_read(blkdev, buffer, block, nsectors);
+    }
+
+    blkdev->stats.bounces++;
+
+    do {
+        retval = devfs_blkdev_cache_alloc(blkdev, &bounce);
+    } while (retval == -EAGAIN);
+
+    if (retval < 0) {
+        return retval;
+    }
+
+    while (nsectors > 0) {
+        count = (nsectors > per_page) ? per_page : nsectors;
+
+        retval = devfs_blkdev_driver_read(blkdev, bounce->data, block, count);
+        if (retval < 0) {
+            break;
+        }
+
+        memcpy(buffer, bounce->data, count * blkdev->sectorsize);
+
+        buffer   += count * blkdev->sectorsize;
+        block    += count;
+        nsectors -= count;
+    }
+
+    devfs_blkdev_cache_put(bounce);
+
+    return retval;
+}
+
+/* Driver sector of chunk index of a run of logical sectors, relative to the run */
+static inline uint32_t devfs_blkdev_chunk_sector(struct devfs_blkdev_t *blkdev, uint32_t index, uint32_t nchunks)
+{
+    return (index / nchunks) * blkdev->ratio + MIN((index % nchunks) * blkdev->chunkratio, blkdev->ratio);
+}
+
+/*
+ * Compare mode multi-sector write: read the sectors back a page at a time
+ * into bounce and program only the runs of chunks that differ from the new
+ * data.
+ */
+static int devfs_blkdev_xfer_compare(struct devfs_blkdev_t *blkdev, struct devfs_blkdev_cache_t *bounce,
+                                     const uint8_t *buffer, blkdev_sector_t block, uint32_t nsectors)
+{
+    uint32_t per_page = devfs_blkdev_page_size(blkdev) / blkdev->sectorsize;
+    uint32_t nchunks = (blkdev->ratio + blkdev->chunkratio - 1) / blkdev->chunkratio;
+    uint32_t unitsize = blkdev->sectorsize / blkdev->ratio;
+    uint32_t count = 0;
+    uint32_t first = 0;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    bool changed = false;
+    bool pending = false;
+    int retval = 0;
+
+    while (nsectors > 0) {
+        count = (nsectors > per_page) ? per_page : nsectors;
+
+        retval = devfs_blkdev_driver_read(blkdev, bounce->data, block, count);
+        if (retval < 0) {
+            break;
+        }
+
+        pending = false;
+
+        for (uint32_t i = 0; i <= count * nchunks; i++) {
+            changed = false;
+
+            if (i < count * nchunks) {
+                start = devfs_blkdev_chunk_sector(blkdev, i, nchunks);
+                end   = devfs_blkdev_chunk_sector(blkdev, i + 1, nchunks);
+
+                changed = (memcmp(&bounce->data[start * unitsize], &buffer[start * unitsize], (end - start) * unitsize) != 0);
+                if (changed) {
+                    blkdev->stats.compare_changed_bytes += (end - start) * unitsize;
+                } else {
+                    blkdev->stats.compare_skipped_bytes += (end - start) * unitsize;
+                }
+            }
+
+            if (changed && !pending) {
+                first = i;
+                pending = true;
+            } else if (!changed && pending) {
+                /* Program the run of changed chunks that ends here */
+                start = devfs_blkdev_chunk_sector(blkdev, first, nchunks);
+                end   = devfs_blkdev_chunk_sector(blkdev, i, nchunks);
+
+                memcpy(&bounce->data[start * unitsize], &buffer[start * unitsize], (end - start) * unitsize);
+
+                retval = devfs_blkdev_ops_write(blkdev, &bounce->data[start * unitsize],
+                                                block * blkdev->ratio + start, end - start);
+                if (retval < 0) {
+                    break;
+                }
+
+                pending = false;
+            }
+        }
+
+        if (retval < 0) {
+            break;
+        }
+
+        buffer   += count * blkdev->sectorsize;
+        block    += count;
+        nsectors -= count;
+    }
+
+    return retval;
+}
+
+/*
+ * With discard, cached copies of the sectors are dropped, or take the new
+ * data if pinned, once the write is done. The bounce page is taken first:
+ * allocating it may release the lock, and from then on no other writer
+ * gets in to dirty the pages. After a failed write dirty pages are kept
+ * and the error is returned.
+ */
+static int devfs_blkdev_xfer_write(struct devfs_blkdev_t *blkdev, const uint8_t *buffer, blkdev_sector_t block, uint32_t nsectors,
+                                   bool discard)
+{
+    struct devfs_blkdev_cache_t *bounce = NULL;
+    uint32_t per_page = devfs_blkdev_page_size(blkdev) / blkdev->sectorsize;
+    const uint8_t *data = buffer;
+    blkdev_sector_t sector = block;
+    uint32_t count = 0;
+    uint32_t left = nsectors;
+    int retval = 0;
+
+    if (blkdev->compare || !devfs_blkdev_xfer_aligned(blkdev, buffer)) {
+        if (!blkdev->compare) {
+            blkdev->stats.bounces++;
+        }
+
+        do {
+            retval = devfs_blkdev_cache_alloc(blkdev, &bounce);
+        } while (retval == -EAGAIN);
+
+        if (retval < 0) {
+            return retval;
+        }
+    }
+
+    if (blkdev->compare) {
+        retval = devfs_blkdev_xfer_compare(blkdev, bounce, buffer, block, nsectors);
+    } else if (bounce == NULL) {
+        retval = devfs_blkdev_driver_write(blkdev, buffer, block, nsectors);
+    } else {
+        while (left > 0) {
+            count = (left > per_page) ? per_page : left;
+
+            memcpy(bounce->data, data, count * blkdev->sectorsize);
+
+            retval = devfs_blkdev_driver_write(blkdev, bounce->data, sector, count);
+            if (retval < 0) {
+                break;
+            }
+
+            data   += count * blkdev->sectorsize;
+            sector += count;
+            left   -= count;
+        }
+    }
+
+    if (bounce) {
+        devfs_blkdev_cache_put(bounce);
+    }
+
+    if (discard) {
+        devfs_blkdev_bch_discard_cache(blkdev, block, nsectors, (retval < 0) ? NULL : buffer);
+    }
+
+    return retval;
+}
+
+/*
+ * Split a byte offset into a logical sector and the offset into it. With
+ * 64-bit offsets, positions in the first 4 GiB still take the 32-bit
+ * division, which 32-bit cores do in hardware instead of a library call.
+ */
+static inline blkdev_sector_t devfs_blkdev_offset_split(struct devfs_blkdev_t *blkdev, devfs_off_t offset, uint32_t *blkoff)
+{
+    devfs_off_t block = 0;
+
+#ifdef CONFIG_DEVFS_BLKDEV_64BIT
+    if ((uint64_t)offset <= UINT32_MAX) {
+        block = (uint32_t)offset / blkdev->sectorsize;
+        *blkoff = (uint32_t)offset - (uint32_t)block * blkdev->sectorsize;
+        return (blkdev_sector_t)block;
+    }
+#endif
+
+    block = (offset / blkdev->sectorsize);
+
+    /* A 64-bit off_t can point past the last 32-bit sector number */
+    if ((sizeof(devfs_off_t) > sizeof(blkdev_sector_t)) && (block >= (devfs_off_t)INVALID_BLOCK)) {
+        *blkoff = 0;
+        return INVALID_BLOCK;
+    }
+
+    *blkoff = (uint32_t)(offset - block * blkdev->sectorsize);
+
+    return (blkdev_sector_t)block;
+}
+
+/*
+ * Access hints. SEQUENTIAL files read ahead and their pages are reused
+ * first once the reader has gone past them, NOREUSE files give clean pages
+ * back as soon as they are read past, so neither pushes the sectors other
+ * users keep coming back to out of the cache. Pinned pages stay whatever
+ * the hint.
+ */
+static void devfs_blkdev_advise_read(struct devfs_blkdev_t *blkdev, int advice, devfs_off_t offset, size_t length)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    struct devfs_blkdev_cache_t *n = NULL;
+    blkdev_sector_t first = 0;
+    blkdev_sector_t end = 0;
+    uint32_t blkoff = 0;
+
+    if (blkdev->shadow || blkdev->ownpage) {
+        /* A device with a page of its own has nothing to read ahead into */
+        return;
+    }
+
+    first = devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+    end   = devfs_blkdev_offset_split(blkdev, offset + length, &blkoff);
+
+    list_for_each_entry_safe(cache, n, &blkdev->caches, node) {
+        if ((cache->block < first) || (cache->block >= end) || cache->pinned) {
+            continue;
+        }
+
+        if (advice == BLKDEV_ADV_SEQUENTIAL) {
+            devfs_blkdev_cache_cool(cache);
+        } else if (cache->dirtymap == 0) {
+            devfs_blkdev_cache_put(cache);
+        }
+    }
+
+    if (advice != BLKDEV_ADV_SEQUENTIAL) {
+        return;
+    }
+
+    end = devfs_blkdev_offset_split(blkdev, offset + length - 1, &blkoff) + 1;
+
+    for (uint32_t i = 0; (i < DEVFS_BLKDEV_READAHEAD) && (end + i < blkdev->nsectors); i++) {
+        if (devfs_blkdev_cache_lookup(blkdev, end + i)) {
+            continue;
+        }
+
+        if (devfs_blkdev_bch_read_cache(blkdev, end + i, &cache) < 0) {
+            break;
+        }
+
+        blkdev->stats.readaheads++;
+    }
+}
+
+/* Sectors covering a byte range of BIOC_ADVISE or BIOC_PIN, length 0 for the rest of the device */
+static int devfs_blkdev_range_sectors(struct devfs_blkdev_t *blkdev, uint64_t offset, uint64_t length,
+                                      blkdev_sector_t *block, blkdev_sector_t *nsectors)
+{
+    uint64_t size = (uint64_t)blkdev->nsectors * blkdev->sectorsize;
+
+    if ((offset >= size) || (length > size - offset)) {
+        return -EINVAL;
+    }
+
+    if (length == 0) {
+        length = size - offset;
+    }
+
+    *block    = (blkdev_sector_t)(offset / blkdev->sectorsize);
+    *nsectors = (blkdev_sector_t)((offset + length + blkdev->sectorsize - 1) / blkdev->sectorsize) - *block;
+
+    return 0;
+}
+
+static int devfs_blkdev_advise(struct devfs_file_t *file, struct devfs_blkdev_t *blkdev, const struct blkdev_advise_t *advise)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    struct devfs_blkdev_cache_t *n = NULL;
+    blkdev_sector_t block = 0;
+    blkdev_sector_t nsectors = 0;
+    int retval = 0;
+
+    if (advise == NULL) {
+        return -EINVAL;
+    }
+
+    switch (advise->advice) {
+    case BLKDEV_ADV_NORMAL:
+    case BLKDEV_ADV_SEQUENTIAL:
+    case BLKDEV_ADV_RANDOM:
+    case BLKDEV_ADV_NOREUSE:
+        file->advice = (uint8_t)advise->advice;
+        return 0;
+
+    case BLKDEV_ADV_WILLNEED:
+    case BLKDEV_ADV_DONTNEED:
+        retval = devfs_blkdev_range_sectors(blkdev, advise->offset, advise->length, &block, &nsectors);
+        if (retval < 0) {
+            return retval;
+        }
+        if (blkdev->shadow) {
+            /* Everything stays in RAM anyway */
+            return 0;
+        }
+        if (blkdev->ownpage && (advise->advice == BLKDEV_ADV_WILLNEED)) {
+            /* Its one page can't hold more than the sector in use */
+            return 0;
+        }
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    if (advise->advice == BLKDEV_ADV_WILLNEED) {
+        /* Leave half of the pool to everybody else */
+        nsectors = MIN(nsectors, DEVFS_BLKDEV_CACHE_PAGES / 2);
+
+        for (blkdev_sector_t i = 0; i < nsectors; i++) {
+            if (devfs_blkdev_cache_lookup(blkdev, block + i)) {
+                continue;
+            }
+
+            retval = devfs_blkdev_bch_read_cache(blkdev, block + i, &cache);
+            if (retval < 0) {
+                return retval;
+            }
+
+            blkdev->stats.readaheads++;
+        }
+
+        return 0;
+    }
+
+    list_for_each_entry_safe(cache, n, &blkdev->caches, node) {
+        if ((cache->block < block) || (cache->block - block >= nsectors) || cache->pinned) {
+            continue;
+        }
+
+        retval = devfs_blkdev_cache_writeback(cache);
+        if (retval < 0) {
+            return retval;
+        }
+
+        devfs_blkdev_cache_put(cache);
+    }
+
+    return 0;
+}
+
+/*
+ * BIOC_PIN: read sectors into the cache and keep them there until unpinned,
+ * across closes too. Fails with -ENOSPC once half of the pool is pinned,
+ * keeping the sectors pinned so far. Shadowed devices hold every sector
+ * already, there is nothing to pin. Devices with sectors larger than a pool
+ * page have only a page of their own and can't pin at all.
+ */
+static int devfs_blkdev_cache_pin(struct devfs_blkdev_t *blkdev, blkdev_sector_t block, blkdev_sector_t nsectors)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    int retval = 0;
+
+    if (blkdev->shadow) {
+        return 0;
+    }
+
+    if (blkdev->ownpage) {
+        return -ENOSPC;
+    }
+
+    for (blkdev_sector_t i = 0; i < nsectors; i++) {
+        retval = devfs_blkdev_bch_read_cache(blkdev, block + i, &cache);
+        if (retval < 0) {
+            return retval;
+        }
+
+        if (cache->pinned) {
+            continue;
+        }
+
+        devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
+
+        if (cache_pool->npinned >= DEVFS_BLKDEV_CACHE_PAGES / 2) {
+            devfs_mutex_unlock(&cache_pool->mutex);
+            return -ENOSPC;
+        }
+
+        cache->pinned = true;
+        cache_pool->npinned++;
+        list_del_init(&cache->lru);
+
+        devfs_mutex_unlock(&cache_pool->mutex);
+    }
+
+    return 0;
+}
+
+static void devfs_blkdev_cache_unpin(struct devfs_blkdev_t *blkdev, blkdev_sector_t block, blkdev_sector_t nsectors)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+
+    list_for_each_entry(cache, &blkdev->caches, node) {
+        if (!cache->pinned || cache->owned || (cache->block < block) || (cache->block - block >= nsectors)) {
+            continue;
+        }
+
+        devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
+
+        cache->pinned = false;
+        cache_pool->npinned--;
+        list_add_tail(&cache->lru, &cache_pool->lru);
+
+        devfs_mutex_unlock(&cache_pool->mutex);
+    }
+}
+
+static int devfs_blkdev_shadow_read(struct devfs_blkdev_t *blkdev, uint8_t *buffer, devfs_off_t offset, size_t length)
+{
+    uint32_t size = (uint32_t)(blkdev->nsectors * blkdev->sectorsize);
+
+    if ((uint64_t)offset >= size) {
+        /* Return end-of-file */
+        return 0;
+    }
+
+    if (length > size - (uint32_t)offset) {
+        length = size - (uint32_t)offset;
+    }
+
+    memcpy(buffer, &blkdev->shadow[offset], length);
+    blkdev->stats.cached_rdbytes += length;
+
+    return length;
+}
+
+/* Sectors whose data doesn't change stay clean and aren't written back */
+static int devfs_blkdev_shadow_write(struct devfs_blkdev_t *blkdev, const uint8_t *buffer, devfs_off_t offset, size_t length)
+{
+    uint32_t size = (uint32_t)(blkdev->nsectors * blkdev->sectorsize);
+    blkdev_sector_t block = 0;
+    uint32_t blkoff = 0;
+    uint32_t nbytes = 0;
+    uint8_t *data = NULL;
+
+    if ((uint64_t)offset >= size) {
+        return -EFBIG;
+    }
+
+    if (length > size - (uint32_t)offset) {
+        length = size - (uint32_t)offset;
+    }
+
+    block = devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+
+    for (size_t done = 0; done < length; done += nbytes) {
+        nbytes = (uint32_t)MIN(blkdev->sectorsize - blkoff, length - done);
+        data   = &blkdev->shadow[block * blkdev->sectorsize + blkoff];
+
+        if (memcmp(data, &buffer[done], nbytes) != 0) {
+            memcpy(data, &buffer[done], nbytes);
+            devfs_blkdev_shadow_mark(blkdev, block, true);
+        }
+
+        block++;
+        blkoff = 0;
+    }
+
+    blkdev->stats.cached_wrbytes += length;
+
+    return length;
+}
+
+static int devfs_blkdev_bch_read(struct devfs_inode_t *inode, uint8_t *buffer, devfs_off_t offset, size_t length)
+{
+    struct devfs_blkdev_t *blkdev = inode->dev_data;
+    struct devfs_blkdev_cache_t *cache = NULL;
+    blkdev_sector_t block = 0;
+    uint32_t nsectors = 0;
+    uint32_t blkoff = 0;
+    uint32_t rdbytes = 0;
+    uint32_t nbytes = 0;
+    int retval = 0;
+
+    DEVFS_ASSERT(blkdev);
+    DEVFS_ASSERT(blkdev->ops);
+
+    if (blkdev->shadow) {
+        return devfs_blkdev_shadow_read(blkdev, buffer, offset, length);
+    }
+
+    block = devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+
+    if (block >= blkdev->nsectors) {
+        /* Return end-of-file */
+        return 0;
+    }
+
+    if (blkoff > 0) {
+        retval = devfs_blkdev_bch_read_cache(blkdev, block, &cache);
+        if (retval < 0) {
+            return retval;
+        }
+
+        if ((blkoff + length) > blkdev->sectorsize) {
+            nbytes = blkdev->sectorsize - blkoff;
+        } else {
+            nbytes = length;
+        }
+
+        memcpy(buffer, &cache->data[blkoff], nbytes);
+        blkdev->stats.cached_rdbytes += nbytes;
+
+        block++;
+
+        if (block >= blkdev->nsectors) {
+            return nbytes;
+        }
+
+        rdbytes = nbytes;
+        buffer += nbytes;
+        length -= nbytes;
+    }
+
+    if (length >= blkdev->sectorsize) {
+        nsectors = length / blkdev->sectorsize;
+
+        if (nsectors > (blkdev->nsectors - block)) {
+            nsectors = (blkdev->nsectors - block);
+        }
+
+        retval = devfs_blkdev_xfer_read(blkdev, buffer, block, nsectors);
+        if (retval < 0) {
+            return retval;
+        }
+
+        devfs_blkdev_bch_overlay_cache(blkdev, buffer, block, nsectors);
+
+        block   += nsectors;
+        nbytes   = nsectors * blkdev->sectorsize;
+        rdbytes += nbytes;
+
+        blkdev->stats.direct_rdbytes += nbytes;
+
+        if (block >= blkdev->nsectors) {
+            return rdbytes;
+        }
+
+        buffer += nbytes;
+        length -= nbytes;
+    }
+
+    if (length > 0) {
+        retval = devfs_blkdev_bch_read_cache(blkdev, block, &cache);
+        if (retval < 0) {
+            return retval;
+        }
+
+        memcpy(buffer, cache->data, length);
+        blkdev->stats.cached_rdbytes += length;
+
+        rdbytes += length;
+    }
+
+    return rdbytes;
+}
+
+static int devfs_blkdev_bch_write(struct devfs_inode_t *inode, const uint8_t *buffer, devfs_off_t offset, size_t length)
+{
+    struct devfs_blkdev_t *blkdev = inode->dev_data;
+    struct devfs_blkdev_cache_t *cache = NULL;
+    blkdev_sector_t block = 0;
+    uint32_t nsectors = 0;
+    uint32_t blkoff = 0;
+    uint32_t wrbytes = 0;
+    uint32_t nbytes = 0;
+    int retval = 0;
+
+    DEVFS_ASSERT(blkdev);
+    DEVFS_ASSERT(blkdev->ops);
+
+    if (blkdev->shadow) {
+        return devfs_blkdev_shadow_write(blkdev, buffer, offset, length);
+    }
+
+    block = devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+
+    if (block >= blkdev->nsectors) {
+        return -EFBIG;
+    }
+
+    if (blkoff > 0) {
+        retval = devfs_blkdev_bch_read_cache(blkdev, block, &cache);
+        if (retval < 0) {
+            return retval;
+        }
+
+        if ((blkoff + length) > blkdev->sectorsize) {
+            nbytes = blkdev->sectorsize - blkoff;
+        } else {
+            nbytes = length;
+        }
+
+        devfs_blkdev_cache_update(blkdev, cache, buffer, blkoff, nbytes);
+        blkdev->stats.cached_wrbytes += nbytes;
+
+        block++;
+
+        if (block >= blkdev->nsectors) {
+            return nbytes;
+        }
+
+        wrbytes = nbytes;
+        buffer += nbytes;
+        length -= nbytes;
+    }
+
+    if (length >= blkdev->sectorsize) {
+        nsectors = length / blkdev->sectorsize;
+
+        if (nsectors > (blkdev->nsectors - block)) {
+            nsectors = (blkdev->nsectors - block);
+        }
+
+        retval = devfs_blkdev_xfer_write(blkdev, buffer, block, nsectors, true);
+        if (retval < 0) {
+            return retval;
+        }
+
+        block   += nsectors;
+        nbytes   = nsectors * blkdev->sectorsize;
+        wrbytes += nbytes;
+
+        blkdev->stats.direct_wrbytes += nbytes;
+
+        if (block >= blkdev->nsectors) {
+            return wrbytes;
+        }
+
+        buffer += nbytes;
+        length -= nbytes;
+    }
+
+    if (length > 0) {
+        retval = devfs_blkdev_bch_read_cache(blkdev, block, &cache);
+        if (retval < 0) {
+            return retval;
+        }
+
+        devfs_blkdev_cache_update(blkdev, cache, buffer, 0, length);
+        blkdev->stats.cached_wrbytes += length;
+
+        wrbytes += length;
+    }
+
+    return wrbytes;
+}
+
+/*
+ * O_DIRECT transfers go straight to the driver. Only whole sectors are
+ * accepted so that no cache page is ever needed. Shadowed devices read
+ * from the shadow and write through it.
+ */
+static int devfs_blkdev_direct_check(struct devfs_blkdev_t *blkdev, devfs_off_t offset, size_t length, blkdev_sector_t *block)
+{
+    uint32_t blkoff = 0;
+
+    *block = devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+
+    if (blkoff || (length % blkdev->sectorsize)) {
+        DEVFS_WARN("O_DIRECT offset[%lld] length[%u] not aligned to sectorsize[%u]",
+                   (long long)offset, (unsigned int)length, blkdev->sectorsize);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int devfs_blkdev_direct_read(struct devfs_inode_t *inode, uint8_t *buffer, devfs_off_t offset, size_t length)
+{
+    struct devfs_blkdev_t *blkdev = inode->dev_data;
+    blkdev_sector_t block = 0;
+    uint32_t nsectors = 0;
+    int retval = 0;
+
+    retval = devfs_blkdev_direct_check(blkdev, offset, length, &block);
+    if (retval < 0) {
+        return retval;
+    }
+
+    nsectors = (length / blkdev->sectorsize);
+
+    if (block >= blkdev->nsectors) {
+        /* Return end-of-file */
+        return 0;
+    }
+
+    if (nsectors > (blkdev->nsectors - block)) {
+        nsectors = (blkdev->nsectors - block);
+    }
+
+    if (blkdev->shadow) {
+        memcpy(buffer, &blkdev->shadow[block * blkdev->sectorsize], nsectors * blkdev->sectorsize);
+    } else {
+        retval = devfs_blkdev_xfer_read(blkdev, buffer, block, nsectors);
+        if (retval < 0) {
+            return retval;
+        }
+
+        /* Cached writers of the same device still win over stale media */
+        devfs_blkdev_bch_overlay_cache(blkdev, buffer, block, nsectors);
+    }
+
+    blkdev->stats.direct_rdbytes += nsectors * blkdev->sectorsize;
+
+    return nsectors * blkdev->sectorsize;
+}
+
+static int devfs_blkdev_direct_write(struct devfs_inode_t *inode, const uint8_t *buffer, devfs_off_t offset, size_t length)
+{
+    struct devfs_blkdev_t *blkdev = inode->dev_data;
+    blkdev_sector_t block = 0;
+    uint32_t nsectors = 0;
+    int retval = 0;
+
+    retval = devfs_blkdev_direct_check(blkdev, offset, length, &block);
+    if (retval < 0) {
+        return retval;
+    }
+
+    nsectors = (length / blkdev->sectorsize);
+
+    if (block >= blkdev->nsectors) {
+        return -EFBIG;
+    }
+
+    if (nsectors > (blkdev->nsectors - block)) {
+        nsectors = (blkdev->nsectors - block);
+    }
+
+    retval = devfs_blkdev_xfer_write(blkdev, buffer, block, nsectors, true);
+    if (retval < 0) {
+        return retval;
+    }
+
+    blkdev->stats.direct_wrbytes += nsectors * blkdev->sectorsize;
+
+    return nsectors * blkdev->sectorsize;
+}
+
+static int devfs_blkdev_driver_ioctl(struct devfs_blkdev_t *blkdev, unsigned int cmd, unsigned long arg)
+{
+    if (blkdev->ops->ioctl == NULL) {
+        return -ENOTTY;
+    }
+
+    return blkdev->ops->ioctl(blkdev->inode, cmd, arg);
+}
+
+static int devfs_blkdev_mtd_geometry(struct devfs_inode_t *inode, const struct devfs_blkdev_ops *ops, struct mtddev_geometry_t *geometry)
+{
+    if (ops->ioctl == NULL) {
+        return -ENOTTY;
+    }
+
+    geometry->erasevalue = 0xFF;
+
+    return ops->ioctl(inode, MTDIOC_GEOMETRY, (unsigned long)geometry);
+}
+
+/* The shadow already holds the erased value, read back what a failed erase left */
+static void devfs_blkdev_shadow_reload(struct devfs_blkdev_t *blkdev, const struct mtddev_erase_t *erase)
+{
+    blkdev_sector_t first = (blkdev_sector_t)erase->seraseblock * blkdev->eraseratio / blkdev->ratio;
+    blkdev_sector_t last = ((blkdev_sector_t)(erase->seraseblock + erase->neraseblocks) * blkdev->eraseratio +
+                            blkdev->ratio - 1) / blkdev->ratio;
+
+    last = MIN(last, blkdev->nsectors);
+
+    if (first < last) {
+        devfs_blkdev_bch_discard_cache(blkdev, first, (uint32_t)(last - first), NULL);
+    }
+}
+
+static int devfs_blkdev_mtd_erase(struct devfs_blkdev_t *blkdev, const struct mtddev_erase_t *erase)
+{
+    int retval = 0;
+
+    if (blkdev->erased == NULL) {
+        return devfs_blkdev_driver_ioctl(blkdev, MTDIOC_ERASE, (unsigned long)erase);
+    }
+
+    if ((erase == NULL) ||
+        (erase->seraseblock >= blkdev->neraseblocks) ||
+        (erase->neraseblocks > blkdev->neraseblocks - erase->seraseblock)) {
+        return -EINVAL;
+    }
+
+    retval = devfs_blkdev_bch_erase_cache(blkdev, (blkdev_sector_t)erase->seraseblock * blkdev->eraseratio,
+                                          erase->neraseblocks * blkdev->eraseratio);
+    if (retval < 0) {
+        return retval;
+    }
+
+    /* A failed erase leaves the blocks in an unknown state */
+    devfs_blkdev_erased_mark(blkdev, erase->seraseblock, erase->neraseblocks, false);
+
+    retval = devfs_blkdev_driver_ioctl(blkdev, MTDIOC_ERASE, (unsigned long)erase);
+    if (retval < 0) {
+        if (blkdev->shadow) {
+            devfs_blkdev_shadow_reload(blkdev, erase);
+        }
+        return retval;
+    }
+
+    devfs_blkdev_erased_mark(blkdev, erase->seraseblock, erase->neraseblocks, true);
+
+    return 0;
+}
+
+/* Read an erase block of unknown state back and compare it a word at a time */
+static int devfs_blkdev_mtd_verify(struct devfs_blkdev_t *blkdev, uint32_t eraseblock)
+{
+    struct devfs_blkdev_cache_t *page = NULL;
+    uint32_t blocksize = blkdev->sectorsize / blkdev->ratio;
+    uint32_t per_page = devfs_blkdev_page_size(blkdev) / blocksize;
+    uint32_t pattern = blkdev->erasevalue * 0x01010101UL;
+    blkdev_sector_t ssector = (blkdev_sector_t)eraseblock * blkdev->eraseratio;
+    uint32_t nsectors = blkdev->eraseratio;
+    uint32_t count = 0;
+    uint32_t nbytes = 0;
+    uint32_t i = 0;
+    int retval = 0;
+
+    do {
+        retval = devfs_blkdev_cache_alloc(blkdev, &page);
+    } while (retval == -EAGAIN);
+
+    if (retval < 0) {
+        return retval;
+    }
+
+    retval = 1;
+
+    while ((nsectors > 0) && (retval == 1)) {
+        count  = (nsectors > per_page) ? per_page : nsectors;
+        nbytes = count * blocksize;
+
+        retval = devfs_blkdev_ops_read(blkdev, page->data, ssector, count);
+        if (retval < 0) {
+            break;
+        }
+
+        retval = 1;
+
+        /* Cache pages are DMA aligned, so word access is safe */
+        for (i = 0; i + sizeof(uint32_t) <= nbytes; i += sizeof(uint32_t)) {
+            if (*(const uint32_t *)&page->data[i] != pattern) {
+                retval = 0;
+                break;
+            }
+        }
+
+        for (; (retval == 1) && (i < nbytes); i++) {
+            if (page->data[i] != blkdev->erasevalue) {
+                retval = 0;
+            }
+        }
+
+        ssector  += count;
+        nsectors -= count;
+    }
+
+    devfs_blkdev_cache_put(page);
+
+    return retval;
+}
+
+static int devfs_blkdev_mtd_erase_ranges(struct devfs_blkdev_t *blkdev, const struct mtddev_erase_ranges_t *ranges)
+{
+    int retval = 0;
+
+    if ((ranges == NULL) || ((ranges->ranges == NULL) && (ranges->nranges > 0))) {
+        return -EINVAL;
+    }
+
+    for (uint32_t i = 0; i < ranges->nranges; i++) {
+        retval = devfs_blkdev_mtd_erase(blkdev, &ranges->ranges[i]);
+        if (retval < 0) {
+            return retval;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * A request may finish on any thread holding the device mutex, often with
+ * the I/O turn of its stack too, so its callback is left to the worker,
+ * which runs it with neither held.
+ */
+static void devfs_blkdev_erase_complete(struct devfs_blkdev_t *blkdev, struct devfs_blkdev_erase_t *request, int result)
+{
+    if ((result < 0) && (blkdev->erase_error == 0)) {
+        blkdev->erase_error = result;
+    }
+
+    if (request->done == NULL) {
+        list_del(&request->node);
+        devfs_free(request);
+        return;
+    }
+
+    request->result = result;
+    list_move_tail(&request->node, &blkdev->erasedone);
+
+    devfs_work_submit(&blkdev->erasework);
+}
+
+/* Run the callbacks of finished requests, called without the device mutex */
+static void devfs_blkdev_erase_notify(struct devfs_blkdev_t *blkdev)
+{
+    struct devfs_blkdev_erase_t *request = NULL;
+
+    while (true) {
+        devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+
+        request = list_first_entry_or_null(&blkdev->erasedone, struct devfs_blkdev_erase_t, node);
+        if (request) {
+            list_del(&request->node);
+        }
+
+        devfs_mutex_unlock(&blkdev->mutex);
+
+        if (request == NULL) {
+            break;
+        }
+
+        request->done(request->result, request->arg);
+        devfs_free(request);
+    }
+}
+
+/*
+ * Queued erases are ordered before any later access to the blocks they
+ * cover: run every request up to the last one overlapping logical sectors
+ * [block, block + nsectors) right away.
+ */
+static int devfs_blkdev_erase_sync(struct devfs_blkdev_t *blkdev, blkdev_sector_t block, uint32_t nsectors)
+{
+    struct devfs_blkdev_erase_t *request = NULL;
+    struct devfs_blkdev_erase_t *n = NULL;
+    struct devfs_blkdev_erase_t *last = NULL;
+    struct mtddev_erase_t erase = {0};
+    blkdev_sector_t ssector = block * blkdev->ratio;
+    blkdev_sector_t esector = (block + nsectors) * blkdev->ratio;
+    blkdev_sector_t first = 0;
+    bool done = false;
+    int retval = 0;
+
+    if (list_empty(&blkdev->erases)) {
+        return 0;
+    }
+
+    list_for_each_entry(request, &blkdev->erases, node) {
+        for (uint32_t i = request->next; i < request->nranges; i++) {
+            first = (blkdev_sector_t)request->ranges[i].seraseblock * blkdev->eraseratio;
+
+            if ((first < esector) &&
+                (first + request->ranges[i].neraseblocks * blkdev->eraseratio > ssector)) {
+                last = request;
+                break;
+            }
+        }
+    }
+
+    if (last == NULL) {
+        return 0;
+    }
+
+    list_for_each_entry_safe(request, n, &blkdev->erases, node) {
+        while ((retval == 0) && (request->next < request->nranges)) {
+            /* The worker may have erased the start of the range already */
+            erase.seraseblock  = request->ranges[request->next].seraseblock + request->erased;
+            erase.neraseblocks = request->ranges[request->next].neraseblocks - request->erased;
+
+            retval = devfs_blkdev_mtd_erase(blkdev, &erase);
+            if (retval == 0) {
+                request->next++;
+                request->erased = 0;
+            }
+        }
+
+        done = (request == last);
+
+        devfs_blkdev_erase_complete(blkdev, request, retval);
+
+        if (done || (retval < 0)) {
+            break;
+        }
+    }
+
+    return retval;
+}
+
+/*
+ * Make sure a write to logical sectors [block, block + nsectors) inside the
+ * pre-erase region only lands on erased blocks, then move the window of
+ * blocks the worker keeps erased along with it.
+ */
+static int devfs_blkdev_preerase_sync(struct devfs_blkdev_t *blkdev, blkdev_sector_t block, uint32_t nsectors)
+{
+    struct mtddev_erase_t erase = {0};
+    uint32_t first = 0;
+    uint32_t last = 0;
+    int retval = 0;
+
+    if (blkdev->preerase_start == blkdev->preerase_end) {
+        return 0;
+    }
+
+    first = (uint32_t)((block * blkdev->ratio) / blkdev->eraseratio);
+    last  = (uint32_t)(((block + nsectors) * blkdev->ratio - 1) / blkdev->eraseratio);
+
+    if ((last < blkdev->preerase_start) || (first >= blkdev->preerase_end)) {
+        return 0;
+    }
+
+    if (last >= blkdev->preerase_end) {
+        last = blkdev->preerase_end - 1;
+    }
+
+    while ((blkdev->preerase_next <= last) &&
+           (devfs_blkdev_erased_test(blkdev, blkdev->preerase_next))) {
+        blkdev->preerase_next++;
+    }
+
+    if (blkdev->preerase_next <= last) {
+        /* The writer caught up with the worker */
+        erase.seraseblock  = blkdev->preerase_next;
+        erase.neraseblocks = last + 1 - blkdev->preerase_next;
+
+        retval = devfs_blkdev_mtd_erase(blkdev, &erase);
+        if (retval < 0) {
+            return retval;
+        }
+
+        blkdev->preerase_next = last + 1;
+    }
+
+    if (last + 1 + blkdev->preerase_ahead > blkdev->preerase_limit) {
+        blkdev->preerase_limit = last + 1 + blkdev->preerase_ahead;
+        devfs_work_submit(&blkdev->erasework);
+    }
+
+    return 0;
+}
+
+static int devfs_blkdev_mtd_blankcheck(struct devfs_blkdev_t *blkdev, struct mtddev_blankcheck_t *check)
+{
+    int retval = 0;
+
+    if (blkdev->erased == NULL) {
+        return devfs_blkdev_driver_ioctl(blkdev, MTDIOC_BLANKCHECK, (unsigned long)check);
+    }
+
+    if ((check == NULL) ||
+        (check->seraseblock >= blkdev->neraseblocks) ||
+        (check->neraseblocks > blkdev->neraseblocks - check->seraseblock)) {
+        return -EINVAL;
+    }
+
+    retval = devfs_blkdev_erase_sync(blkdev, ((blkdev_sector_t)check->seraseblock * blkdev->eraseratio) / blkdev->ratio,
+                                     (check->neraseblocks * blkdev->eraseratio + blkdev->ratio - 1) / blkdev->ratio);
+    if (retval < 0) {
+        return retval;
+    }
+
+    /* Data still in the cache is not blank either */
+    retval = devfs_blkdev_bch_flush_cache(blkdev);
+    if (retval < 0) {
+        return retval;
+    }
+
+    for (check->nblank = 0; check->nblank < check->neraseblocks; check->nblank++) {
+        uint32_t eraseblock = check->seraseblock + check->nblank;
+
+        if (devfs_blkdev_erased_test(blkdev, eraseblock)) {
+            continue;
+        }
+
+        retval = devfs_blkdev_mtd_verify(blkdev, eraseblock);
+        if (retval < 0) {
+            return retval;
+        }
+
+        if (retval == 0) {
+            break;
+        }
+
+        devfs_blkdev_erased_mark(blkdev, eraseblock, 1, true);
+    }
+
+    return 0;
+}
+
+/* Called with blkdev locked before every read or write of the file */
+static int devfs_blkdev_erase_prepare(struct devfs_blkdev_t *blkdev, devfs_off_t offset, size_t length, bool write)
+{
+    blkdev_sector_t block = 0;
+    uint32_t nsectors = 0;
+    uint32_t blkoff = 0;
+    int retval = 0;
+
+    if ((blkdev->erased == NULL) || (length == 0)) {
+        return 0;
+    }
+
+    block = devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+    if (block >= blkdev->nsectors) {
+        return 0;
+    }
+
+    nsectors = (blkoff + length + blkdev->sectorsize - 1) / blkdev->sectorsize;
+    if (nsectors > (blkdev->nsectors - block)) {
+        nsectors = (blkdev->nsectors - block);
+    }
+
+    retval = devfs_blkdev_erase_sync(blkdev, block, nsectors);
+    if (retval < 0) {
+        return retval;
+    }
+
+    if (write) {
+        retval = devfs_blkdev_preerase_sync(blkdev, block, nsectors);
+    }
+
+    return retval;
+}
+
+/*
+ * Worker: run queued erases first, then keep the pre-erase window erased.
+ * One erase block per mutex hold, so readers and writers get in between,
+ * and the callbacks of finished requests run between the holds.
+ */
+static void devfs_blkdev_erase_work(devfs_work_t *work)
+{
+    struct devfs_blkdev_t *blkdev = container_of(work, struct devfs_blkdev_t, erasework);
+    struct devfs_blkdev_erase_t *request = NULL;
+    struct mtddev_erase_t erase = {0};
+    bool busy = true;
+    bool notify = false;
+    int retval = 0;
+
+    while (busy) {
+        devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+
+        if (!list_empty(&blkdev->erases)) {
+            request = list_first_entry(&blkdev->erases, struct devfs_blkdev_erase_t, node);
+
+            erase.seraseblock  = request->ranges[request->next].seraseblock + request->erased;
+            erase.neraseblocks = (request->ranges[request->next].neraseblocks > request->erased) ? 1 : 0;
+
+            retval = (erase.neraseblocks > 0) ? devfs_blkdev_mtd_erase(blkdev, &erase) : 0;
+            if ((retval == 0) && (++request->erased >= request->ranges[request->next].neraseblocks)) {
+                request->next++;
+                request->erased = 0;
+            }
+
+            if ((retval < 0) || (request->next == request->nranges)) {
+                devfs_blkdev_erase_complete(blkdev, request, retval);
+            }
+        } else if ((blkdev->preerase_next < blkdev->preerase_end) &&
+                   (blkdev->preerase_next < blkdev->preerase_limit)) {
+            if (!devfs_blkdev_erased_test(blkdev, blkdev->preerase_next)) {
+                erase.seraseblock  = blkdev->preerase_next;
+                erase.neraseblocks = 1;
+
+                retval = devfs_blkdev_mtd_erase(blkdev, &erase);
+            } else {
+                retval = 0;
+            }
+
+            if (retval < 0) {
+                /* Leave the block to the writer, which will report the failure */
+                DEVFS_ERROR("pre-erase block[%u] fail[%d]", blkdev->preerase_next, retval);
+                blkdev->preerase_limit = blkdev->preerase_next;
+            } else {
+                blkdev->preerase_next++;
+            }
+        } else {
+            busy = false;
+        }
+
+        notify = !list_empty(&blkdev->erasedone);
+
+        devfs_mutex_unlock(&blkdev->mutex);
+
+        if (notify) {
+            devfs_blkdev_erase_notify(blkdev);
+        }
+    }
+}
+
+static int devfs_blkdev_mtd_erase_async(struct devfs_blkdev_t *blkdev, const struct mtddev_erase_ranges_t *ranges)
+{
+    struct devfs_blkdev_erase_t *request = NULL;
+
+    if (blkdev->erased == NULL) {
+        return -ENOTTY;
+    }
+
+    if ((ranges == NULL) || (ranges->ranges == NULL) || (ranges->nranges == 0)) {
+        return -EINVAL;
+    }
+
+    for (uint32_t i = 0; i < ranges->nranges; i++) {
+        if ((ranges->ranges[i].seraseblock >= blkdev->neraseblocks) ||
+            (ranges->ranges[i].neraseblocks > blkdev->neraseblocks - ranges->ranges[i].seraseblock)) {
+            return -EINVAL;
+        }
+    }
+
+    request = devfs_malloc(sizeof(struct devfs_blkdev_erase_t) + ranges->nranges * sizeof(struct mtddev_erase_t));
+    if (request == NULL) {
+        return -ENOMEM;
+    }
+
+    request->done = ranges->done;
+    request->arg = ranges->arg;
+    request->next = 0;
+    request->erased = 0;
+    request->nranges = ranges->nranges;
+    memcpy(request->ranges, ranges->ranges, ranges->nranges * sizeof(struct mtddev_erase_t));
+
+    list_add_tail(&request->node, &blkdev->erases);
+
+    return devfs_work_submit(&blkdev->erasework);
+}
+
+static int devfs_blkdev_mtd_erase_wait(struct devfs_blkdev_t *blkdev)
+{
+    int retval = 0;
+
+    /* Also wait for the callbacks, which the worker runs */
+    while (!list_empty(&blkdev->erases) || !list_empty(&blkdev->erasedone)) {
+        devfs_mutex_unlock(&blkdev->mutex);
+
+        devfs_work_flush(&blkdev->erasework);
+
+        devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+    }
+
+    retval = blkdev->erase_error;
+    blkdev->erase_error = 0;
+
+    return retval;
+}
+
+static int devfs_blkdev_mtd_preerase(struct devfs_blkdev_t *blkdev, const struct mtddev_preerase_t *preerase)
+{
+    if (blkdev->erased == NULL) {
+        return -ENOTTY;
+    }
+
+    if (preerase == NULL) {
+        blkdev->preerase_start = 0;
+        blkdev->preerase_end   = 0;
+        blkdev->preerase_next  = 0;
+        blkdev->preerase_limit = 0;
+        return 0;
+    }
+
+    if ((preerase->seraseblock >= blkdev->neraseblocks) ||
+        (preerase->neraseblocks > blkdev->neraseblocks - preerase->seraseblock)) {
+        return -EINVAL;
+    }
+
+    blkdev->preerase_ahead = preerase->nahead ? preerase->nahead : DEVFS_MTD_PREERASE_AHEAD;
+    blkdev->preerase_start = preerase->seraseblock;
+    blkdev->preerase_end   = preerase->seraseblock + preerase->neraseblocks;
+    blkdev->preerase_next  = preerase->seraseblock;
+    blkdev->preerase_limit = preerase->seraseblock + blkdev->preerase_ahead;
+
+    return devfs_work_submit(&blkdev->erasework);
+}
+
+/*
+ * Stream mode, for image downloads: the one writer of the device switched
+ * by BIOC_STREAM gets each erase block erased when it first reaches it, and
+ * each sector programmed as soon as the writer has filled it, or with a
+ * write-back queue as soon as a merge worth of sectors is filled. Data of a
+ * reached block outside of what the writer puts there is lost.
+ */
+static int devfs_blkdev_stream_start(struct devfs_blkdev_t *blkdev)
+{
+    if (blkdev->erased == NULL) {
+        return -ENOTTY;
+    }
+
+    if (blkdev->streamed) {
+        return -EBUSY;
+    }
+
+    blkdev->streamed = devfs_malloc(((blkdev->neraseblocks + 31) / 32) * sizeof(uint32_t));
+    if (blkdev->streamed == NULL) {
+        return -ENOMEM;
+    }
+
+    memset(blkdev->streamed, 0x00, ((blkdev->neraseblocks + 31) / 32) * sizeof(uint32_t));
+
+    return 0;
+}
+
+static void devfs_blkdev_stream_stop(struct devfs_blkdev_t *blkdev)
+{
+    devfs_free(blkdev->streamed);
+    blkdev->streamed = NULL;
+}
+
+/* Erase the blocks a stream write is about to reach for the first time */
+static int devfs_blkdev_stream_prepare(struct devfs_blkdev_t *blkdev, devfs_off_t offset, size_t length)
+{
+    struct mtddev_erase_t erase = {0};
+    blkdev_sector_t block = 0;
+    blkdev_sector_t lblock = 0;
+    uint32_t blkoff = 0;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    int retval = 0;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    block = devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+    if (block >= blkdev->nsectors) {
+        return 0;
+    }
+
+    lblock = block + (blkoff + length - 1) / blkdev->sectorsize;
+    if (lblock >= blkdev->nsectors) {
+        lblock = blkdev->nsectors - 1;
+    }
+
+    first = (uint32_t)(block * blkdev->ratio / blkdev->eraseratio);
+    last  = (uint32_t)(((lblock + 1) * blkdev->ratio - 1) / blkdev->eraseratio);
+
+    for (uint32_t i = first; i <= last; i++) {
+        if (blkdev->streamed[i / 32] & (1UL << (i % 32))) {
+            continue;
+        }
+
+        if (!devfs_blkdev_erased_test(blkdev, i)) {
+            erase.seraseblock  = i;
+            erase.neraseblocks = 1;
+
+            retval = devfs_blkdev_mtd_erase(blkdev, &erase);
+            if (retval < 0) {
+                return retval;
+            }
+
+            blkdev->stats.stream_erases++;
+        }
+
+        blkdev->streamed[i / 32] |= (1UL << (i % 32));
+    }
+
+    return 0;
+}
+
+/*
+ * Program the sector a stream write started in once the write has filled it.
+ * With a write-back queue the sector waits until the run of dirty sectors it
+ * ends spans a whole merge, then the queue programs the run in one call.
+ */
+static int devfs_blkdev_stream_complete(struct devfs_blkdev_t *blkdev, devfs_off_t offset, size_t length)
+{
+    struct devfs_blkdev_cache_t *cache = NULL;
+    struct devfs_blkdev_cache_t *prev = NULL;
+    blkdev_sector_t block = 0;
+    uint32_t blkoff = 0;
+    uint32_t run = 1;
+
+    block = devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+    if ((block >= blkdev->nsectors) || (blkoff + length < blkdev->sectorsize)) {
+        return 0;
+    }
+
+    cache = devfs_blkdev_cache_lookup(blkdev, block);
+    if ((cache == NULL) || (cache->dirtymap == 0)) {
+        return 0;
+    }
+
+    if (blkdev->merge == NULL) {
+        return devfs_blkdev_cache_writeback(cache);
+    }
+
+    for (; (run * blkdev->ratio < blkdev->mergesectors) && (run <= block); run++) {
+        prev = devfs_blkdev_cache_lookup(blkdev, block - run);
+        if ((prev == NULL) || (prev->dirtymap == 0)) {
+            return 0;
+        }
+    }
+
+    if (run * blkdev->ratio < blkdev->mergesectors) {
+        return 0;
+    }
+
+    return devfs_blkdev_queue_dispatch(blkdev, cache);
+}
+
+/*
+ * Stream writes go through the cache. With a write-back queue, the whole
+ * sectors of a write shorter than a merge are cached as well rather than
+ * programmed one driver call at a time, so small writes reach the device
+ * as merge sized ones. A failed program shows up at the next write-back or
+ * at close.
+ */
+static int devfs_blkdev_stream_write(struct devfs_inode_t *inode, const uint8_t *buffer, devfs_off_t offset, size_t length)
+{
+    struct devfs_blkdev_t *blkdev = inode->dev_data;
+    struct devfs_blkdev_cache_t *cache = NULL;
+    blkdev_sector_t block = 0;
+    uint32_t blkoff = 0;
+    uint32_t nbytes = 0;
+    int wrbytes = 0;
+    int retval = 0;
+
+    if ((blkdev->merge == NULL) || blkdev->shadow ||
+        ((length / blkdev->sectorsize) * blkdev->ratio >= blkdev->mergesectors)) {
+        retval = devfs_blkdev_bch_write(inode, buffer, offset, length);
+        if (retval > 0) {
+            devfs_blkdev_stream_complete(blkdev, offset, retval);
+        }
+        return retval;
+    }
+
+    block = devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+
+    if (block >= blkdev->nsectors) {
+        return -EFBIG;
+    }
+
+    while ((length > 0) && (block < blkdev->nsectors)) {
+        retval = devfs_blkdev_bch_read_cache(blkdev, block, &cache);
+        if (retval < 0) {
+            return (wrbytes > 0) ? wrbytes : retval;
+        }
+
+        nbytes = MIN(length, blkdev->sectorsize - blkoff);
+
+        devfs_blkdev_cache_update(blkdev, cache, buffer, blkoff, nbytes);
+        blkdev->stats.cached_wrbytes += nbytes;
+
+        devfs_blkdev_stream_complete(blkdev, offset, nbytes);
+
+        wrbytes += nbytes;
+        buffer  += nbytes;
+        offset  += nbytes;
+        length  -= nbytes;
+        blkoff   = 0;
+        block++;
     }
 
     return wrbytes;
 }
 
-static int devfs_blkdev_open(struct devfs_file_t *file)
+/*
+ * BIOC_CHECKSUM: CRC32 of a byte range, summed where the data already is.
+ * Cached sectors, dirty ones included, are summed from their page; runs of
+ * uncached sectors are read a page at a time into one bounce page. Nothing
+ * is copied to the caller and nothing is written back. Shadowed devices are
+ * summed straight from the shadow.
+ */
+static int devfs_blkdev_checksum(struct devfs_blkdev_t *blkdev, uint64_t offset, uint64_t length, uint32_t *crc)
+{
+    struct devfs_blkdev_cache_t *bounce = NULL;
+    struct devfs_blkdev_cache_t *cache = NULL;
+    uint32_t per_page = devfs_blkdev_page_size(blkdev) / blkdev->sectorsize;
+    uint64_t size = (uint64_t)blkdev->nsectors * blkdev->sectorsize;
+    const uint8_t *data = NULL;
+    blkdev_sector_t block = 0;
+    uint32_t blkoff = 0;
+    uint32_t count = 0;
+    uint32_t nbytes = 0;
+    uint32_t n = 0;
+    int retval = 0;
+
+    if ((offset > size) || (length > size - offset)) {
+        return -EINVAL;
+    }
+
+    if (length == 0) {
+        length = size - offset;
+    }
+
+    block  = (blkdev_sector_t)(offset / blkdev->sectorsize);
+    blkoff = (uint32_t)(offset % blkdev->sectorsize);
+
+    *crc = 0;
+
+    if (blkdev->shadow && (length > 0)) {
+        retval = devfs_blkdev_erase_sync(blkdev, block, (uint32_t)((blkoff + length + blkdev->sectorsize - 1) / blkdev->sectorsize));
+        if (retval == 0) {
+            *crc = devfs_crc32(0, &blkdev->shadow[offset], (size_t)length);
+        }
+        return retval;
+    }
+
+    while ((retval == 0) && (length > 0)) {
+        count = (uint32_t)MIN((blkoff + length + blkdev->sectorsize - 1) / blkdev->sectorsize, per_page);
+
+        /* Queued erases of the range finish first, as for read() */
+        retval = devfs_blkdev_erase_sync(blkdev, block, count);
+        if (retval < 0) {
+            break;
+        }
+
+        cache = devfs_blkdev_cache_lookup(blkdev, block);
+        if (cache != NULL) {
+            data  = cache->data;
+            count = 1;
+        } else if (bounce == NULL) {
+            /* On -EAGAIN the mutex was dropped, look the sector up again */
+            retval = devfs_blkdev_cache_alloc(blkdev, &bounce);
+            if (retval == -EAGAIN) {
+                retval = 0;
+            }
+            continue;
+        } else {
+            for (n = 1; n < count; n++) {
+                if (devfs_blkdev_cache_lookup(blkdev, block + n)) {
+                    break;
+                }
+            }
+            count = n;
+
+            retval = devfs_blkdev_driver_read(blkdev, bounce->data, block, count);
+            if (retval < 0) {
+                break;
+            }
+            retval = 0;
+
+            data = bounce->data;
+        }
+
+        nbytes = count * blkdev->sectorsize - blkoff;
+        if (nbytes > length) {
+            nbytes = (uint32_t)length;
+        }
+
+        *crc = devfs_crc32(*crc, &data[blkoff], nbytes);
+
+        block  += count;
+        blkoff  = 0;
+        length -= nbytes;
+    }
+
+    if (bounce) {
+        devfs_blkdev_cache_put(bounce);
+    }
+
+    return retval;
+}
+
+/* Copy what a span of sectors holds of each range of a BIOC_READV group */
+static void devfs_blkdev_readv_scatter(struct devfs_blkdev_t *blkdev, struct blkdev_iovec_t **iov, uint32_t niov,
+                                       blkdev_sector_t block, uint32_t nsectors, const uint8_t *data)
+{
+    uint64_t start = (uint64_t)block * blkdev->sectorsize;
+    uint64_t end = start + (uint64_t)nsectors * blkdev->sectorsize;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+
+    for (uint32_t i = 0; i < niov; i++) {
+        lo = MAX(iov[i]->offset, start);
+        hi = MIN(iov[i]->offset + iov[i]->nread, end);
+
+        if (lo < hi) {
+            memcpy((uint8_t *)iov[i]->buffer + (lo - iov[i]->offset), &data[lo - start], (size_t)(hi - lo));
+        }
+    }
+}
+
+/*
+ * BIOC_READV: read a list of byte ranges in one call. The ranges are sorted
+ * by offset and those sharing or touching sectors form one group, read from
+ * its first sector to its last: cached sectors are copied from their page,
+ * runs of the others are read into one buffer of up to
+ * DEVFS_BLKDEV_COPY_SIZE (or one sector, if larger) per driver call, and
+ * each span is scattered to every range it overlaps.
+ */
+static int devfs_blkdev_readv(struct devfs_blkdev_t *blkdev, struct blkdev_readv_t *readv)
+{
+    struct blkdev_iovec_t **sorted = NULL;
+    struct blkdev_iovec_t *iov = NULL;
+    struct devfs_blkdev_cache_t *cache = NULL;
+    uint32_t buffersize = MAX(DEVFS_BLKDEV_COPY_SIZE, blkdev->sectorsize);
+    uint32_t per_buffer = buffersize / blkdev->sectorsize;
+    uint64_t size = (uint64_t)blkdev->nsectors * blkdev->sectorsize;
+    uint8_t *buffer = NULL;
+    const uint8_t *data = NULL;
+    blkdev_sector_t block = 0;
+    blkdev_sector_t end = 0;
+    uint32_t nsorted = 0;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    uint32_t count = 0;
+    uint32_t n = 0;
+    int retval = 0;
+
+    if ((readv == NULL) || ((readv->niov > 0) && (readv->iov == NULL))) {
+        return -EINVAL;
+    }
+
+    if (readv->niov == 0) {
+        return 0;
+    }
+
+    sorted = devfs_malloc(readv->niov * sizeof(struct blkdev_iovec_t *));
+    buffer = devfs_malloc_aligned(DEVFS_DMA_ALIGN, buffersize);
+    if ((sorted == NULL) || (buffer == NULL)) {
+        devfs_free(sorted);
+        devfs_free(buffer);
+        return -ENOMEM;
+    }
+
+    /* nread doubles as the length clamped to the device; insertion sort, lists are short */
+    for (uint32_t i = 0; i < readv->niov; i++) {
+        iov = &readv->iov[i];
+
+        iov->nread = 0;
+        if ((iov->offset >= size) || (iov->length == 0)) {
+            continue;
+        }
+
+        iov->nread = (uint32_t)MIN((uint64_t)iov->length, size - iov->offset);
+
+        for (n = nsorted; (n > 0) && (sorted[n - 1]->offset > iov->offset); n--) {
+            sorted[n] = sorted[n - 1];
+        }
+        sorted[n] = iov;
+        nsorted++;
+    }
+
+    while ((retval == 0) && (first < nsorted)) {
+        block = (blkdev_sector_t)(sorted[first]->offset / blkdev->sectorsize);
+        end   = (blkdev_sector_t)((sorted[first]->offset + sorted[first]->nread + blkdev->sectorsize - 1) / blkdev->sectorsize);
+
+        for (last = first + 1; last < nsorted; last++) {
+            if (sorted[last]->offset / blkdev->sectorsize > end) {
+                break;
+            }
+
+            end = MAX(end, (blkdev_sector_t)((sorted[last]->offset + sorted[last]->nread + blkdev->sectorsize - 1) /
+                                             blkdev->sectorsize));
+        }
+
+        while (block < end) {
+            count = (uint32_t)MIN(end - block, per_buffer);
+
+            /* Queued erases of the range finish first, as for read() */
+            retval = devfs_blkdev_erase_sync(blkdev, block, count);
+            if (retval < 0) {
+                break;
+            }
+
+            cache = devfs_blkdev_cache_lookup(blkdev, block);
+            if (blkdev->shadow) {
+                data = &blkdev->shadow[block * blkdev->sectorsize];
+
+                blkdev->stats.cached_rdbytes += count * blkdev->sectorsize;
+            } else if (cache != NULL) {
+                data  = cache->data;
+                count = 1;
+
+                blkdev->stats.cached_rdbytes += blkdev->sectorsize;
+            } else {
+                for (n = 1; n < count; n++) {
+                    if (devfs_blkdev_cache_lookup(blkdev, block + n)) {
+                        break;
+                    }
+                }
+                count = n;
+
+                retval = devfs_blkdev_driver_read(blkdev, buffer, block, count);
+                if (retval < 0) {
+                    break;
+                }
+                retval = 0;
+
+                data = buffer;
+
+                blkdev->stats.direct_rdbytes += count * blkdev->sectorsize;
+            }
+
+            devfs_blkdev_readv_scatter(blkdev, &sorted[first], last - first, block, count, data);
+
+            block += count;
+        }
+
+        first = last;
+    }
+
+    if (retval < 0) {
+        for (uint32_t i = 0; i < readv->niov; i++) {
+            readv->iov[i].nread = 0;
+        }
+    }
+
+    devfs_free(buffer);
+    devfs_free(sorted);
+
+    return retval;
+}
+
+/* First open of a shadowed device: read all of it into a new shadow */
+static int devfs_blkdev_shadow_load(struct devfs_blkdev_t *blkdev)
+{
+    uint32_t size = (uint32_t)(blkdev->nsectors * blkdev->sectorsize);
+    uint32_t mapsize = (uint32_t)((blkdev->nsectors + 31) / 32) * sizeof(uint32_t);
+    uint32_t *dirty = NULL;
+    uint8_t *shadow = NULL;
+    int retval = 0;
+
+    shadow = devfs_malloc_aligned(DEVFS_DMA_ALIGN, size);
+    dirty  = devfs_malloc(mapsize);
+    if ((shadow == NULL) || (dirty == NULL)) {
+        devfs_free(shadow);
+        devfs_free(dirty);
+        return -ENOMEM;
+    }
+
+    /* Pages of an earlier open without the shadow would go stale */
+    devfs_blkdev_cache_unpin(blkdev, 0, blkdev->nsectors);
+
+    retval = devfs_blkdev_bch_release_cache(blkdev);
+    if (retval == 0) {
+        retval = devfs_blkdev_driver_read(blkdev, shadow, 0, (uint32_t)blkdev->nsectors);
+    }
+    if (retval < 0) {
+        devfs_free(shadow);
+        devfs_free(dirty);
+        return retval;
+    }
+
+    memset(dirty, 0x00, mapsize);
+
+    blkdev->shadow = shadow;
+    blkdev->shadowdirty = dirty;
+    blkdev->nshadowdirty = 0;
+    blkdev->shadowsize = size + mapsize;
+
+    return 0;
+}
+
+static int devfs_blkdev_open(struct devfs_file_t *file)
+{
+    struct devfs_inode_t  *inode  = NULL;
+    struct devfs_blkdev_t *blkdev = NULL;
+    int retval = 0;
+
+    DEVFS_ASSERT(file);
+    DEVFS_ASSERT(file->inode);
+
+    inode  = file->inode;
+    blkdev = file->inode->dev_data;
+
+    DEVFS_ASSERT(blkdev);
+    DEVFS_ASSERT(blkdev->ops);
+
+    if (blkdev->ops->open) {
+        retval = blkdev->ops->open(inode);
+    }
+
+    if ((retval == 0) && blkdev->shadowed) {
+        devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+        if (blkdev->shadow == NULL) {
+            retval = devfs_blkdev_shadow_load(blkdev);
+        }
+        devfs_mutex_unlock(&blkdev->mutex);
+
+        if (retval == -ENOMEM) {
+            DEVFS_WARN("no memory to shadow %s, using the cache", inode->name);
+            retval = 0;
+        }
+        if ((retval < 0) && blkdev->ops->close) {
+            blkdev->ops->close(inode);
+        }
+    }
+
+    return retval;
+}
+
+/*
+ * Bytes of a read or write to move in the next hold of the device lock. Past
+ * the first, pieces start on a sector boundary, so each is at most maxxfer
+ * bytes of whole sectors plus the head of the first one.
+ */
+static size_t devfs_blkdev_xfer_piece(struct devfs_blkdev_t *blkdev, devfs_off_t offset, size_t length)
+{
+    uint32_t blkoff = 0;
+
+    if ((blkdev->maxxfer == 0) || (length <= blkdev->maxxfer)) {
+        return length;
+    }
+
+    devfs_blkdev_offset_split(blkdev, offset, &blkoff);
+
+    return blkdev->maxxfer - blkoff;
+}
+
+/* Called with blkdev locked, for one piece of a read */
+static int devfs_blkdev_read_piece(struct devfs_file_t *file, uint8_t *dest, size_t nbytes)
+{
+    struct devfs_inode_t  *inode  = file->inode;
+    struct devfs_blkdev_t *blkdev = file->inode->dev_data;
+    int retval = 0;
+
+    retval = devfs_blkdev_erase_prepare(blkdev, file->offset, nbytes, false);
+    if (retval == 0) {
+        retval = devfs_blkdev_queue_expire(blkdev);
+    }
+    if (retval < 0) {
+        return retval;
+    }
+
+    if (file->flags & DEVFS_O_DIRECT) {
+        retval = devfs_blkdev_direct_read(inode, dest, file->offset, nbytes);
+    } else {
+        retval = devfs_blkdev_bch_read(inode, dest, file->offset, nbytes);
+
+        if ((retval > 0) && (file->advice != BLKDEV_ADV_NORMAL)) {
+            devfs_blkdev_advise_read(blkdev, file->advice, file->offset, retval);
+        }
+    }
+    if (retval > 0) {
+        file->offset += retval;
+    }
+
+    return retval;
+}
+
+/* Called with blkdev locked, for one piece of a write */
+static int devfs_blkdev_write_piece(struct devfs_file_t *file, const uint8_t *src, size_t nbytes)
+{
+    struct devfs_inode_t  *inode  = file->inode;
+    struct devfs_blkdev_t *blkdev = file->inode->dev_data;
+    int retval = 0;
+
+    retval = devfs_blkdev_erase_prepare(blkdev, file->offset, nbytes, true);
+    if (retval == 0) {
+        retval = devfs_blkdev_queue_expire(blkdev);
+    }
+    if ((retval == 0) && file->stream) {
+        retval = devfs_blkdev_stream_prepare(blkdev, file->offset, nbytes);
+    }
+    if (retval < 0) {
+        return retval;
+    }
+
+    if (file->flags & DEVFS_O_DIRECT) {
+        retval = devfs_blkdev_direct_write(inode, src, file->offset, nbytes);
+    } else if (file->stream) {
+        retval = devfs_blkdev_stream_write(inode, src, file->offset, nbytes);
+    } else {
+        retval = devfs_blkdev_bch_write(inode, src, file->offset, nbytes);
+    }
+    if (retval > 0) {
+        file->offset += retval;
+    }
+
+    return retval;
+}
+
+/*
+ * Reads and writes take turns: one piece at a time holds the turn, taken
+ * before the device mutex, and the others wait in arrival order instead of
+ * on the mutex. Devices stacked on another one take the turns of the
+ * bottom device, as their pieces end up on the same driver. When the turn
+ * is given up it goes to the waiter of the best class, where each
+ * DEVFS_BLKDEV_IOPRIO_AGING_MS waited counts as one class better; ties go
+ * to the oldest. Waiters don't block on a mutex, so the kernel's priority
+ * inheritance is done here: the holder runs at the priority of the most
+ * urgent waiting thread until it passes the turn on, and threads of
+ * priorities in between can't keep a waiter out. Other users of the device
+ * mutex, ioctls and the erase worker, don't take turns.
+ */
+static const uint32_t ioprio_rank[BLKDEV_IOPRIO_CLASSES] = {
+    [BLKDEV_IOPRIO_HIGH]   = 0,
+    [BLKDEV_IOPRIO_NORMAL] = 1,
+    [BLKDEV_IOPRIO_LOW]    = 2,
+};
+
+/* Called with blkdev unlocked, returns holding the turn; true if it had to wait */
+static bool devfs_blkdev_ioprio_enter(struct devfs_blkdev_t *blkdev, int ioprio)
+{
+    struct devfs_blkdev_turn_t *turn = blkdev->turn;
+    struct devfs_blkdev_waiter_t waiter;
+    devfs_thread_t self = devfs_thread_self();
+    int prio = devfs_thread_priority_get(self);
+
+    devfs_mutex_lock(&turn->lock, DEVFS_FOREVER);
+
+    if (!turn->busy) {
+        turn->busy = true;
+        turn->holder = self;
+        turn->holderprio = prio;
+        turn->boosted = false;
+        devfs_mutex_unlock(&turn->lock);
+        return false;
+    }
+
+    devfs_sem_init(&waiter.sem, 0, 1);
+    waiter.rank   = ioprio_rank[ioprio];
+    waiter.since  = devfs_uptime_ms();
+    waiter.thread = self;
+    waiter.prio   = prio;
+    list_add_tail(&waiter.node, &turn->waiters);
+
+    if (prio < devfs_thread_priority_get(turn->holder)) {
+        devfs_thread_priority_set(turn->holder, prio);
+        turn->boosted = true;
+    }
+
+    devfs_mutex_unlock(&turn->lock);
+
+    devfs_sem_take(&waiter.sem, DEVFS_FOREVER);
+    devfs_sem_free(&waiter.sem);
+
+    return true;
+}
+
+/* Called with blkdev unlocked: pass the turn on */
+static void devfs_blkdev_ioprio_leave(struct devfs_blkdev_t *blkdev)
+{
+    struct devfs_blkdev_turn_t *turn = blkdev->turn;
+    struct devfs_blkdev_waiter_t *waiter = NULL;
+    struct devfs_blkdev_waiter_t *best = NULL;
+    uint32_t now = devfs_uptime_ms();
+    uint32_t bestrank = 0;
+    uint32_t rank = 0;
+    uint32_t aged = 0;
+
+    devfs_mutex_lock(&turn->lock, DEVFS_FOREVER);
+
+    if (turn->boosted) {
+        devfs_thread_priority_set(turn->holder, turn->holderprio);
+        turn->boosted = false;
+    }
+
+    list_for_each_entry(waiter, &turn->waiters, node) {
+        aged = DEVFS_BLKDEV_IOPRIO_AGING_MS ? (now - waiter->since) / DEVFS_BLKDEV_IOPRIO_AGING_MS : 0;
+        rank = (waiter->rank > aged) ? waiter->rank - aged : 0;
+
+        if ((best == NULL) || (rank < bestrank)) {
+            best = waiter;
+            bestrank = rank;
+        }
+    }
+
+    if (best == NULL) {
+        turn->busy = false;
+    } else {
+        /* The turn goes straight to it, busy stays set */
+        list_del(&best->node);
+
+        turn->holder = best->thread;
+        turn->holderprio = best->prio;
+
+        list_for_each_entry(waiter, &turn->waiters, node) {
+            if (waiter->prio < devfs_thread_priority_get(best->thread)) {
+                devfs_thread_priority_set(best->thread, waiter->prio);
+                turn->boosted = true;
+            }
+        }
+
+        devfs_sem_give(&best->sem);
+    }
+
+    devfs_mutex_unlock(&turn->lock);
+}
+
+/* Called with blkdev locked when a read or write returns */
+static void devfs_blkdev_ioprio_account(struct devfs_blkdev_t *blkdev, int ioprio, unsigned int start, bool waited)
+{
+    struct blkdev_ioprio_stats_t *stats = &blkdev->stats.ioprio[ioprio];
+    uint32_t us = devfs_cycles_to_us(devfs_cycles() - start);
+
+    stats->requests++;
+    stats->total_us += us;
+    stats->max_us = MAX(stats->max_us, us);
+
+    if (waited) {
+        stats->waits++;
+    }
+}
+
+/*
+ * Reads and writes longer than the device's maxtransfer run as several
+ * pieces, dropping the lock and yielding between them so that requests
+ * queued on the device and other threads get in. Each piece takes its own
+ * turn, so a waiting request of a better class gets in before the rest of
+ * a long one. A failing piece after the first ends the call short instead
+ * of failing it.
+ */
+static int devfs_blkdev_read(struct devfs_file_t *file, void *dest, size_t nbytes)
+{
+    struct devfs_blkdev_t *blkdev = NULL;
+    unsigned int start = devfs_cycles();
+    int ioprio = 0;
+    size_t count = 0;
+    size_t done = 0;
+    bool waited = false;
+    bool more = false;
+    int retval = 0;
+
+    DEVFS_ASSERT(file);
+    DEVFS_ASSERT(file->inode);
+
+    blkdev = file->inode->dev_data;
+    ioprio = file->ioprio;
+
+    do {
+        if (devfs_blkdev_ioprio_enter(blkdev, ioprio)) {
+            waited = true;
+        }
+
+        devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+
+        count  = devfs_blkdev_xfer_piece(blkdev, file->offset, nbytes - done);
+        retval = devfs_blkdev_read_piece(file, (uint8_t *)dest + done, count);
+        if (retval > 0) {
+            done += retval;
+        }
+
+        more = (retval == (int)count) && (done < nbytes);
+        if (more) {
+            blkdev->stats.transfer_splits++;
+        } else {
+            devfs_blkdev_ioprio_account(blkdev, ioprio, start, waited);
+        }
+
+        devfs_mutex_unlock(&blkdev->mutex);
+        devfs_blkdev_ioprio_leave(blkdev);
+
+        if (more) {
+            devfs_yield();
+        }
+    } while (more);
+
+    return (done > 0) ? (int)done : retval;
+}
+
+static int devfs_blkdev_write(struct devfs_file_t *file, const void *src, size_t nbytes)
+{
+    struct devfs_blkdev_t *blkdev = NULL;
+    unsigned int start = devfs_cycles();
+    int ioprio = 0;
+    size_t count = 0;
+    size_t done = 0;
+    bool waited = false;
+    bool more = false;
+    int retval = 0;
+
+    DEVFS_ASSERT(file);
+    DEVFS_ASSERT(file->inode);
+
+    blkdev = file->inode->dev_data;
+    ioprio = file->ioprio;
+
+    do {
+        if (devfs_blkdev_ioprio_enter(blkdev, ioprio)) {
+            waited = true;
+        }
+
+        devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+
+        count  = devfs_blkdev_xfer_piece(blkdev, file->offset, nbytes - done);
+        retval = devfs_blkdev_write_piece(file, (const uint8_t *)src + done, count);
+        if (retval > 0) {
+            done += retval;
+        }
+
+        more = (retval == (int)count) && (done < nbytes);
+        if (more) {
+            blkdev->stats.transfer_splits++;
+        } else {
+            devfs_blkdev_ioprio_account(blkdev, ioprio, start, waited);
+        }
+
+        devfs_mutex_unlock(&blkdev->mutex);
+        devfs_blkdev_ioprio_leave(blkdev);
+
+        if (more) {
+            devfs_yield();
+        }
+    } while (more);
+
+    return (done > 0) ? (int)done : retval;
+}
+
+static int devfs_blkdev_lseek64(struct devfs_file_t *file, devfs_off_t off, int whence)
+{
+    struct devfs_inode_t  *inode  = NULL;
+    struct devfs_blkdev_t *blkdev = NULL;
+    devfs_off_t base = 0;
+
+    DEVFS_ASSERT(file);
+    DEVFS_ASSERT(file->inode);
+
+    inode  = file->inode;
+    blkdev = file->inode->dev_data;
+
+    DEVFS_ASSERT(blkdev);
+    DEVFS_ASSERT(blkdev->ops);
+
+    switch(whence) {
+    case SEEK_CUR:
+        base = file->offset;
+        break;
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_END:
+        if ((uint64_t)blkdev->nsectors > (uint64_t)DEVFS_OFF_MAX / blkdev->sectorsize) {
+            return -EOVERFLOW;
+        }
+
+        base = (devfs_off_t)blkdev->sectorsize * (devfs_off_t)blkdev->nsectors;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if ((off < 0) ? (base + off < 0) : (off > DEVFS_OFF_MAX - base)) {
+        return (off < 0) ? -EINVAL : -EOVERFLOW;
+    }
+
+    file->offset = base + off;
+    return 0;
+}
+
+static int devfs_blkdev_copy_range(struct devfs_file_t *file, struct blkdev_copy_t *copy);
+
+static int devfs_blkdev_ioctl(struct devfs_file_t *file, unsigned int cmd, unsigned long arg)
+{
+    struct devfs_inode_t  *inode  = NULL;
+    struct devfs_blkdev_t *blkdev = NULL;
+    int retval = 0;
+
+    DEVFS_ASSERT(file);
+    DEVFS_ASSERT(file->inode);
+
+    inode  = file->inode;
+    blkdev = file->inode->dev_data;
+
+    DEVFS_ASSERT(blkdev);
+    DEVFS_ASSERT(blkdev->ops);
+
+    if (cmd == BIOC_COPY) {
+        /* Reads and writes of the copy take the lock themselves */
+        return devfs_blkdev_copy_range(file, (struct blkdev_copy_t *)arg);
+    }
+
+    devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+
+    switch(cmd) {
+    case BIOC_GEOMETRY: {
+        struct blkdev_geometry_t *geometry = (struct blkdev_geometry_t *)arg;
+
+        if (geometry == NULL) {
+            retval = -EINVAL;
+            break;
+        }
+
+        geometry->sectorsize = blkdev->sectorsize;
+        geometry->nsectors   = blkdev->nsectors;
+        geometry->alignment  = blkdev->alignment;
+
+        break;
+    }
+
+    case BIOC_FLUSH: {
+        retval = devfs_blkdev_bch_flush_cache(blkdev);
+        break;
+    }
+
+    case BIOC_SEEK: {
+        struct blkdev_seek_t *seek = (struct blkdev_seek_t *)arg;
+
+        if (seek == NULL) {
+            retval = -EINVAL;
+            break;
+        }
+
+        /* Without 64-bit offsets this still seeks, within the range of off_t */
+        if ((seek->offset > DEVFS_OFF_MAX) || (seek->offset < -DEVFS_OFF_MAX)) {
+            retval = -EOVERFLOW;
+            break;
+        }
+
+        retval = devfs_blkdev_lseek64(file, (devfs_off_t)seek->offset, seek->whence);
+        if (retval == 0) {
+            seek->position = file->offset;
+        }
+
+        break;
+    }
+
+    case BIOC_CHECKSUM:
+    case BIOC_VERIFY: {
+        struct blkdev_checksum_t *checksum = (struct blkdev_checksum_t *)arg;
+        uint32_t crc = 0;
+
+        if (checksum == NULL) {
+            retval = -EINVAL;
+            break;
+        }
+
+        retval = devfs_blkdev_checksum(blkdev, checksum->offset, checksum->length, &crc);
+        if (retval < 0) {
+            break;
+        }
+
+        if (cmd == BIOC_CHECKSUM) {
+            checksum->crc = crc;
+        } else if (checksum->crc != crc) {
+            retval = -EBADMSG;
+        }
+
+        break;
+    }
+
+    case BIOC_ADVISE: {
+        retval = devfs_blkdev_advise(file, blkdev, (const struct blkdev_advise_t *)arg);
+        break;
+    }
+
+    case BIOC_PIN:
+    case BIOC_UNPIN: {
+        struct blkdev_range_t *range = (struct blkdev_range_t *)arg;
+        blkdev_sector_t block = 0;
+        blkdev_sector_t nsectors = 0;
+
+        if (range == NULL) {
+            retval = -EINVAL;
+            break;
+        }
+
+        retval = devfs_blkdev_range_sectors(blkdev, range->offset, range->length, &block, &nsectors);
+        if (retval < 0) {
+            break;
+        }
+
+        if (cmd == BIOC_PIN) {
+            retval = devfs_blkdev_cache_pin(blkdev, block, nsectors);
+        } else {
+            devfs_blkdev_cache_unpin(blkdev, block, nsectors);
+        }
+
+        break;
+    }
+
+    case BIOC_IOPRIO: {
+        if (arg >= BLKDEV_IOPRIO_CLASSES) {
+            retval = -EINVAL;
+            break;
+        }
+
+        file->ioprio = (uint8_t)arg;
+        break;
+    }
+
+    case BIOC_READV: {
+        retval = devfs_blkdev_readv(blkdev, (struct blkdev_readv_t *)arg);
+        break;
+    }
+
+    case BIOC_STATS: {
+        struct blkdev_stats_t *stats = (struct blkdev_stats_t *)arg;
+
+        if (stats == NULL) {
+            retval = -EINVAL;
+            break;
+        }
+
+        memcpy(stats, &blkdev->stats, sizeof(struct blkdev_stats_t));
+        stats->shadow_bytes = blkdev->shadowsize;
+        break;
+    }
+
+    case BIOC_STATS_RESET: {
+        memset(&blkdev->stats, 0x00, sizeof(struct blkdev_stats_t));
+        break;
+    }
+
+    case BIOC_DIRECT: {
+        if (arg) {
+            file->flags |= DEVFS_O_DIRECT;
+        } else {
+            file->flags &= ~DEVFS_O_DIRECT;
+        }
+        break;
+    }
+
+    case BIOC_STREAM: {
+        if (arg && !file->stream) {
+            retval = devfs_blkdev_stream_start(blkdev);
+            if (retval == 0) {
+                file->stream = true;
+            }
+        } else if (!arg && file->stream) {
+            retval = devfs_blkdev_bch_flush_cache(blkdev);
+            devfs_blkdev_stream_stop(blkdev);
+            file->stream = false;
+        }
+        break;
+    }
+
+    case MTDIOC_GEOMETRY: {
+        struct mtddev_geometry_t *geometry = (struct mtddev_geometry_t *)arg;
+
+        if (geometry == NULL) {
+            retval = -EINVAL;
+            break;
+        }
+
+        retval = devfs_blkdev_mtd_geometry(inode, blkdev->ops, geometry);
+        break;
+    }
+
+    case MTDIOC_ERASE: {
+        retval = devfs_blkdev_mtd_erase(blkdev, (const struct mtddev_erase_t *)arg);
+        break;
+    }
+
+    case MTDIOC_BLANKCHECK: {
+        retval = devfs_blkdev_mtd_blankcheck(blkdev, (struct mtddev_blankcheck_t *)arg);
+        break;
+    }
+
+    case MTDIOC_ERASE_RANGES: {
+        retval = devfs_blkdev_mtd_erase_ranges(blkdev, (const struct mtddev_erase_ranges_t *)arg);
+        break;
+    }
+
+    case MTDIOC_ERASE_ASYNC: {
+        retval = devfs_blkdev_mtd_erase_async(blkdev, (const struct mtddev_erase_ranges_t *)arg);
+        break;
+    }
+
+    case MTDIOC_ERASE_WAIT: {
+        retval = devfs_blkdev_mtd_erase_wait(blkdev);
+        break;
+    }
+
+    case MTDIOC_PREERASE: {
+        retval = devfs_blkdev_mtd_preerase(blkdev, (const struct mtddev_preerase_t *)arg);
+        break;
+    }
+
+    default:
+        retval = devfs_blkdev_driver_ioctl(blkdev, cmd, arg);
+        break;
+    }
+
+    devfs_mutex_unlock(&blkdev->mutex);
+
+    return retval;
+}
+
+static int devfs_blkdev_close(struct devfs_file_t *file)
 {
     struct devfs_inode_t  *inode  = NULL;
     struct devfs_blkdev_t *blkdev = NULL;
@@ -265,154 +3610,231 @@ static int devfs_blkdev_open(struct devfs_file_t *file)
     DEVFS_ASSERT(blkdev);
     DEVFS_ASSERT(blkdev->ops);
 
-    if (blkdev->ops->open) {
-        retval = blkdev->ops->open(inode);
-        if (retval < 0) {
-            return retval;
-        }
+    devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+
+    if (inode->references > 1 + blkdev->stacked) {
+        retval = devfs_blkdev_bch_flush_cache(blkdev);
+    } else {
+        /* Last user, give the cache pages back to the pool */
+        retval = devfs_blkdev_bch_release_cache(blkdev);
+    }
+
+    if (file->stream) {
+        devfs_blkdev_stream_stop(blkdev);
+    }
+
+    devfs_mutex_unlock(&blkdev->mutex);
+
+    if (retval < 0) {
+        DEVFS_ERROR("flush cache fail[%d]", retval);
+    }
+
+    if (blkdev->ops->close) {
+        blkdev->ops->close(inode);
     }
 
     return 0;
 }
 
-static int devfs_blkdev_read(struct devfs_file_t *file, void *dest, size_t nbytes)
+/*
+ * Copy whole sectors of one device with the driver's copy op. Dirty cached
+ * sectors are written back first so the driver copies current data, and
+ * cached copies of the destination are dropped afterwards. Returns
+ * -ENOTSUP when the range isn't sector aligned or the driver declines.
+ */
+static int devfs_blkdev_copy_offload(struct devfs_blkdev_t *blkdev, struct devfs_file_t *in, struct devfs_file_t *out,
+                                     size_t nbytes)
 {
-    struct devfs_inode_t *inode = NULL;
+    blkdev_sector_t sblock = 0;
+    blkdev_sector_t dblock = 0;
+    uint32_t nsectors = 0;
+    uint32_t soff = 0;
+    uint32_t doff = 0;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    unsigned int start = 0;
     int retval = 0;
 
-    DEVFS_ASSERT(file);
-    DEVFS_ASSERT(file->inode);
+    devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
 
-    inode  = file->inode;
+    sblock = devfs_blkdev_offset_split(blkdev, in->offset, &soff);
+    dblock = devfs_blkdev_offset_split(blkdev, out->offset, &doff);
 
-    retval = devfs_blkdev_bch_read(inode, dest, file->offset, nbytes);
-    if (retval > 0) {
-        file->offset += retval;
+    if ((soff != 0) || (doff != 0) || (nbytes % blkdev->sectorsize) ||
+        (sblock >= blkdev->nsectors) || (dblock >= blkdev->nsectors)) {
+        devfs_mutex_unlock(&blkdev->mutex);
+        return -ENOTSUP;
     }
 
-    return retval;
-}
+    nsectors = nbytes / blkdev->sectorsize;
+    nsectors = MIN(nsectors, blkdev->nsectors - sblock);
+    nsectors = MIN(nsectors, blkdev->nsectors - dblock);
 
-static int devfs_blkdev_write(struct devfs_file_t *file, const void *src, size_t nbytes)
-{
-    struct devfs_inode_t *inode = NULL;
-    int retval = 0;
+    retval = devfs_blkdev_erase_prepare(blkdev, in->offset, nsectors * blkdev->sectorsize, false);
+    if (retval == 0) {
+        retval = devfs_blkdev_erase_prepare(blkdev, out->offset, nsectors * blkdev->sectorsize, true);
+    }
+    if (retval == 0) {
+        retval = devfs_blkdev_bch_flush_cache(blkdev);
+    }
+    if (retval < 0) {
+        devfs_mutex_unlock(&blkdev->mutex);
+        return retval;
+    }
 
-    DEVFS_ASSERT(file);
-    DEVFS_ASSERT(file->inode);
+    if (blkdev->erased) {
+        first = (uint32_t)(dblock * blkdev->ratio / blkdev->eraseratio);
+        last  = (uint32_t)(((dblock + nsectors) * blkdev->ratio - 1) / blkdev->eraseratio);
 
-    inode  = file->inode;
+        devfs_blkdev_erased_mark(blkdev, first, last - first + 1, false);
+    }
 
-    retval = devfs_blkdev_bch_write(inode, src, file->offset, nbytes);
-    if (retval > 0) {
-        file->offset += retval;
+    start = devfs_cycles();
+
+    retval = blkdev->ops->copy(blkdev->inode, dblock * blkdev->ratio, sblock * blkdev->ratio, nsectors * blkdev->ratio);
+
+    blkdev->stats.driver_writes++;
+    blkdev->stats.driver_time_us += devfs_cycles_to_us(devfs_cycles() - start);
+
+    /* Nothing is dirty after the flush, so dropping the pages now is safe */
+    devfs_blkdev_bch_discard_cache(blkdev, dblock, nsectors, NULL);
+
+    if (retval == 0) {
+        in->offset  += nsectors * blkdev->sectorsize;
+        out->offset += nsectors * blkdev->sectorsize;
+        retval = nsectors * blkdev->sectorsize;
     }
 
+    devfs_mutex_unlock(&blkdev->mutex);
+
     return retval;
 }
 
-static int devfs_blkdev_lseek(struct devfs_file_t *file, off_t off, int whence)
+/*
+ * devfs_copy() between block devices, or two ranges of one. Sector aligned
+ * copies within a device whose driver can copy on chip stay on the chip.
+ * Everything else moves through one DMA aligned buffer, a read and a write
+ * per piece; whole sectors of each go to the drivers in multi-sector calls
+ * without passing through the cache. Only one device mutex is held at a
+ * time, so copies in opposite directions can't deadlock.
+ */
+static int devfs_blkdev_copy(struct devfs_file_t *in, struct devfs_file_t *out, size_t nbytes)
 {
-    struct devfs_inode_t  *inode  = NULL;
-    struct devfs_blkdev_t *blkdev = NULL;
-    off_t newpos = 0;
-
-    DEVFS_ASSERT(file);
-    DEVFS_ASSERT(file->inode);
-
-    inode  = file->inode;
-    blkdev = file->inode->dev_data;
-
-    DEVFS_ASSERT(blkdev);
-    DEVFS_ASSERT(blkdev->ops);
+    struct devfs_blkdev_t *src = in->inode->dev_data;
+    struct devfs_blkdev_t *dst = out->inode->dev_data;
+    uint8_t *buffer = NULL;
+    size_t buffersize = 0;
+    size_t copied = 0;
+    size_t count = 0;
+    int retval = 0;
 
-    switch(whence) {
-    case SEEK_CUR:
-        newpos = file->offset + off;
-        break;
-    case SEEK_SET:
-        newpos = off;
-        break;
-    case SEEK_END:
-        newpos = (off_t)blkdev->sectorsize * (off_t)blkdev->nsectors + off;
-        break;
-    default:
-        return -EINVAL;
+    if (nbytes > INT32_MAX) {
+        nbytes = INT32_MAX;
     }
 
-    if (newpos < 0) {
+    /* Overlapping ranges of one device would read back data already overwritten */
+    if ((src == dst) &&
+        ((uint64_t)in->offset < (uint64_t)out->offset + nbytes) &&
+        ((uint64_t)out->offset < (uint64_t)in->offset + nbytes)) {
         return -EINVAL;
     }
 
-    file->offset = newpos;
-    return newpos;
-}
+    if ((src == dst) && src->ops->copy) {
+        retval = devfs_blkdev_copy_offload(src, in, out, nbytes);
+        if (retval != -ENOTSUP) {
+            return retval;
+        }
+    }
 
-static int devfs_blkdev_ioctl(struct devfs_file_t *file, unsigned int cmd, unsigned long arg)
-{
-    struct devfs_inode_t  *inode  = NULL;
-    struct devfs_blkdev_t *blkdev = NULL;
-    int retval = 0;
+    /* A source sector larger than the copy size still fits whole */
+    buffersize = MAX(DEVFS_BLKDEV_COPY_SIZE, src->sectorsize);
+    buffer = devfs_malloc_aligned(DEVFS_DMA_ALIGN, buffersize);
+    if (buffer == NULL) {
+        return -ENOMEM;
+    }
 
-    DEVFS_ASSERT(file);
-    DEVFS_ASSERT(file->inode);
+    retval = 0;
 
-    inode  = file->inode;
-    blkdev = file->inode->dev_data;
+    while (copied < nbytes) {
+        /* The first piece ends on a source sector boundary, so the rest read whole sectors */
+        count = buffersize - (size_t)(in->offset % src->sectorsize);
+        count = MIN(count, nbytes - copied);
 
-    DEVFS_ASSERT(blkdev);
-    DEVFS_ASSERT(blkdev->ops);
+        retval = devfs_blkdev_read(in, buffer, count);
+        if (retval <= 0) {
+            break;
+        }
 
-    switch(cmd) {
-    case BIOC_GEOMETRY: {
-        struct blkdev_geometry_t *geometry = (struct blkdev_geometry_t *)arg;
+        count = retval;
 
-        if (geometry == NULL) {
-            retval = -EINVAL;
+        retval = devfs_blkdev_write(out, buffer, count);
+        if (retval <= 0) {
+            /* Leave the source where the destination stopped */
+            in->offset -= count;
             break;
         }
 
-        retval = blkdev->ops->geometry(inode, geometry);
+        copied += retval;
 
-        break;
+        if ((size_t)retval < count) {
+            in->offset -= count - retval;
+            break;
+        }
     }
 
-    case BIOC_FLUSH: {
-        retval = devfs_blkdev_bch_flush_cache(inode);
-        break;
-    }
+    devfs_free(buffer);
 
-    default:
-        if (blkdev->ops->ioctl) {
-            retval = blkdev->ops->ioctl(inode, cmd, arg);
-        } else {
-            retval = -ENOTTY;
-        }
-        break;
+    if ((copied == 0) && (retval < 0)) {
+        return retval;
     }
 
-    return retval;
+    return (int)copied;
 }
 
-static int devfs_blkdev_close(struct devfs_file_t *file)
+/*
+ * BIOC_COPY: devfs_copy() from one range of the device of file to another,
+ * for callers holding only a file descriptor. It runs on two copies of the
+ * file, so the position of file is left alone.
+ */
+static int devfs_blkdev_copy_range(struct devfs_file_t *file, struct blkdev_copy_t *copy)
 {
-    struct devfs_inode_t  *inode  = NULL;
-    struct devfs_blkdev_t *blkdev = NULL;
+    struct devfs_file_t in = *file;
+    struct devfs_file_t out = *file;
     int retval = 0;
 
-    DEVFS_ASSERT(file);
-    DEVFS_ASSERT(file->inode);
+    if (copy == NULL) {
+        return -EINVAL;
+    }
 
-    inode  = file->inode;
-    blkdev = file->inode->dev_data;
+    if (!(file->flags & DEVFS_O_READ) || !(file->flags & DEVFS_O_WRITE)) {
+        return -EACCES;
+    }
 
-    DEVFS_ASSERT(blkdev);
-    DEVFS_ASSERT(blkdev->ops);
+    if ((copy->src > DEVFS_OFF_MAX) || (copy->dst > DEVFS_OFF_MAX)) {
+        return -EOVERFLOW;
+    }
 
-    retval = devfs_blkdev_bch_flush_cache(inode);
+    /* The copy moves partial sectors and doesn't stream, whatever the file does */
+    in.flags  &= ~DEVFS_O_DIRECT;
+    out.flags &= ~DEVFS_O_DIRECT;
+    in.stream  = false;
+    out.stream = false;
+    in.offset  = (devfs_off_t)copy->src;
+    out.offset = (devfs_off_t)copy->dst;
 
-    if (blkdev->ops->close) {
-        blkdev->ops->close(inode);
+    copy->copied = 0;
+
+    while (copy->copied < copy->length) {
+        retval = devfs_blkdev_copy(&in, &out, (size_t)MIN(copy->length - copy->copied, INT32_MAX));
+        if (retval <= 0) {
+            break;
+        }
+
+        copy->copied += retval;
+    }
+
+    if ((copy->copied == 0) && (retval < 0)) {
+        return retval;
     }
 
     return 0;
@@ -422,16 +3844,100 @@ static const struct devfs_inode_ops blkdev_inode_ops = {
     devfs_blkdev_open,
     devfs_blkdev_read,
     devfs_blkdev_write,
-    devfs_blkdev_lseek,
+    NULL,
     devfs_blkdev_ioctl,
-    devfs_blkdev_close
+    devfs_blkdev_close,
+    devfs_blkdev_copy,
+    devfs_blkdev_lseek64
 };
 
+/*
+ * Hand the driver of a registered block device to a driver stacked on top
+ * of it, which then calls it directly with the device's inode. The device
+ * can't be unregistered until the stacked driver calls
+ * devfs_blkdev_unstack(), and stops trusting its erased block bitmap,
+ * which no longer sees every write.
+ */
+int devfs_blkdev_stack(struct devfs_inode_t *inode, const struct devfs_blkdev_ops **ops)
+{
+    struct devfs_blkdev_t *blkdev = NULL;
+
+    DEVFS_ASSERT(inode);
+    DEVFS_ASSERT(ops);
+
+    blkdev = inode->dev_data;
+    if ((inode->type != devfs_type_blkdev) || (blkdev == NULL)) {
+        return -ENOTBLK;
+    }
+
+    devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+    devfs_inode_lock();
+
+    inode->references++;
+    blkdev->stacked++;
+
+    devfs_inode_unlock();
+
+    *ops = blkdev->ops;
+
+    devfs_mutex_unlock(&blkdev->mutex);
+
+    return 0;
+}
+
+int devfs_blkdev_unstack(struct devfs_inode_t *inode)
+{
+    struct devfs_blkdev_t *blkdev = NULL;
+
+    DEVFS_ASSERT(inode);
+
+    blkdev = inode->dev_data;
+    if ((inode->type != devfs_type_blkdev) || (blkdev == NULL)) {
+        return -ENOTBLK;
+    }
+
+    devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+    devfs_inode_lock();
+
+    DEVFS_ASSERT(blkdev->stacked > 0);
+
+    inode->references--;
+    blkdev->stacked--;
+
+    devfs_inode_unlock();
+    devfs_mutex_unlock(&blkdev->mutex);
+
+    return 0;
+}
+
+/* The driver of a registered block device, so a driver can tell its own devices */
+const struct devfs_blkdev_ops *devfs_blkdev_driver_ops(struct devfs_inode_t *inode)
+{
+    struct devfs_blkdev_t *blkdev = NULL;
+
+    DEVFS_ASSERT(inode);
+
+    blkdev = inode->dev_data;
+    if ((inode->type != devfs_type_blkdev) || (blkdev == NULL)) {
+        return NULL;
+    }
+
+    return blkdev->ops;
+}
+
 int devfs_blkdev_register(const char *name, const struct devfs_blkdev_ops *ops, void *data)
+{
+    return devfs_blkdev_register_with_config(name, ops, data, NULL);
+}
+
+int devfs_blkdev_register_with_config(const char *name, const struct devfs_blkdev_ops *ops, void *data,
+                                      const struct blkdev_config_t *config)
 {
     struct devfs_blkdev_t *blkdev = NULL;
     struct devfs_inode_t *inode = NULL;
     struct blkdev_geometry_t geometry = {0};
+    struct mtddev_geometry_t mtdgeometry = {0};
+    uint32_t sectorsize = 0;
     int retval = 0;
 
     DEVFS_ASSERT(name);
@@ -458,17 +3964,205 @@ int devfs_blkdev_register(const char *name, const struct devfs_blkdev_ops *ops,
     DEVFS_ASSERT(geometry.sectorsize);
     DEVFS_ASSERT(geometry.nsectors);
 
-    blkdev = devfs_malloc(sizeof(struct devfs_blkdev_t) + geometry.sectorsize);
+    sectorsize = geometry.sectorsize;
+
+    if (config && config->sectorsize) {
+        /* Group several driver sectors into one logical sector */
+        if ((config->sectorsize % geometry.sectorsize) ||
+            (config->sectorsize / geometry.sectorsize > geometry.nsectors)) {
+            DEVFS_ERROR("sectorsize[%u] isn't a multiple of driver sectorsize[%u]", config->sectorsize, geometry.sectorsize);
+            devfs_inode_free(inode);
+            return -EINVAL;
+        }
+
+        sectorsize = config->sectorsize;
+    }
+
+    if (config && config->shadow &&
+        ((uint64_t)(geometry.nsectors / (sectorsize / geometry.sectorsize)) * sectorsize > DEVFS_BLKDEV_SHADOW_MAX)) {
+        DEVFS_ERROR("%s: too large to shadow, the limit is %u bytes", name, DEVFS_BLKDEV_SHADOW_MAX);
+        devfs_inode_free(inode);
+        return -EINVAL;
+    }
+
+    if (config && config->lower &&
+        ((config->lower->type != devfs_type_blkdev) || (config->lower->dev_data == NULL))) {
+        devfs_inode_free(inode);
+        return -ENOTBLK;
+    }
+
+    if ((geometry.alignment > DEVFS_DMA_ALIGN) ||
+        (geometry.alignment & (geometry.alignment - 1))) {
+        DEVFS_ERROR("alignment[%u] unsupported, DMA alignment is %u", geometry.alignment, DEVFS_DMA_ALIGN);
+        devfs_inode_free(inode);
+        return -EINVAL;
+    }
+
+    retval = devfs_blkdev_pool_init();
+    if (retval < 0) {
+        devfs_inode_free(inode);
+        return retval;
+    }
+
+    blkdev = devfs_malloc(sizeof(struct devfs_blkdev_t));
     if (blkdev == NULL) {
         devfs_inode_free(inode);
         return -ENOMEM;
     }
 
     blkdev->ops = ops;
-    blkdev->sectorsize = geometry.sectorsize;
-    blkdev->nsectors = geometry.nsectors;
-    blkdev->block = INVALID_BLOCK;
-    blkdev->dirty = false;
+    blkdev->inode = inode;
+    blkdev->sectorsize = sectorsize;
+    blkdev->ratio = sectorsize / geometry.sectorsize;
+    blkdev->nsectors = geometry.nsectors / blkdev->ratio;
+
+    blkdev->alignment = geometry.alignment;
+
+    /* Track dirty data in at most 32 chunks of whole driver sectors */
+    blkdev->chunkratio = (blkdev->ratio + 31) / 32;
+    blkdev->chunksize = blkdev->chunkratio * geometry.sectorsize;
+
+    if (blkdev->alignment && (blkdev->chunksize % blkdev->alignment)) {
+        /* Chunks would start at misaligned addresses, write whole sectors */
+        blkdev->chunkratio = blkdev->ratio;
+        blkdev->chunksize = sectorsize;
+    }
+
+    blkdev->erased = NULL;
+    blkdev->eraseratio = 0;
+    blkdev->neraseblocks = 0;
+    blkdev->erasevalue = 0xFF;
+
+    if ((devfs_blkdev_mtd_geometry(inode, ops, &mtdgeometry) == 0) &&
+        (mtdgeometry.erasesize > 0) && (mtdgeometry.neraseblocks > 0) &&
+        ((mtdgeometry.erasesize % geometry.sectorsize) == 0)) {
+        /* Every erase block starts in the unknown state */
+        blkdev->erased = devfs_malloc(((mtdgeometry.neraseblocks + 31) / 32) * sizeof(uint32_t));
+        if (blkdev->erased == NULL) {
+            devfs_free(blkdev);
+            devfs_inode_free(inode);
+            return -ENOMEM;
+        }
+
+        memset(blkdev->erased, 0x00, ((mtdgeometry.neraseblocks + 31) / 32) * sizeof(uint32_t));
+
+        blkdev->eraseratio = mtdgeometry.erasesize / geometry.sectorsize;
+        blkdev->neraseblocks = mtdgeometry.neraseblocks;
+        blkdev->erasevalue = (uint8_t)mtdgeometry.erasevalue;
+    }
+
+    if (geometry.nsectors % blkdev->ratio) {
+        DEVFS_WARN("%s: last %u driver sectors don't fill a logical sector", name, (uint32_t)(geometry.nsectors % blkdev->ratio));
+    }
+
+    memset(&blkdev->stats, 0x00, sizeof(struct blkdev_stats_t));
+
+    devfs_mutex_init(&blkdev->mutex);
+    INIT_LIST_HEAD(&blkdev->caches);
+    blkdev->reclaimers = 0;
+    blkdev->unregistered = NULL;
+
+    devfs_work_init(&blkdev->erasework, devfs_blkdev_erase_work);
+    INIT_LIST_HEAD(&blkdev->erases);
+    INIT_LIST_HEAD(&blkdev->erasedone);
+    blkdev->erase_error = 0;
+    blkdev->preerase_start = 0;
+    blkdev->preerase_end = 0;
+    blkdev->preerase_next = 0;
+    blkdev->preerase_limit = 0;
+    blkdev->preerase_ahead = DEVFS_MTD_PREERASE_AHEAD;
+    blkdev->stacked = 0;
+    blkdev->maxxfer = 0;
+    devfs_mutex_init(&blkdev->turns.lock);
+    blkdev->turns.busy = false;
+    blkdev->turns.holder = NULL;
+    blkdev->turns.holderprio = 0;
+    blkdev->turns.boosted = false;
+    INIT_LIST_HEAD(&blkdev->turns.waiters);
+    blkdev->turn = &blkdev->turns;
+    if (config && config->lower) {
+        blkdev->turn = ((struct devfs_blkdev_t *)config->lower->dev_data)->turn;
+    }
+    blkdev->compare = config ? config->compare : false;
+    blkdev->streamed = NULL;
+
+    blkdev->shadowed = config ? config->shadow : false;
+    blkdev->shadow = NULL;
+    blkdev->shadowdirty = NULL;
+    blkdev->nshadowdirty = 0;
+    blkdev->shadowtime = 0;
+    blkdev->shadowsize = 0;
+
+    blkdev->merge = NULL;
+    blkdev->sorted = NULL;
+    blkdev->segments = NULL;
+    blkdev->mergesectors = 0;
+    blkdev->deadline = 0;
+    blkdev->head = 0;
+
+    if (config && (config->mergesize >= 2 * sectorsize)) {
+        blkdev->mergesectors = (config->mergesize / sectorsize) * blkdev->ratio;
+        blkdev->deadline = config->deadline_ms;
+        blkdev->merge = devfs_malloc_aligned(DEVFS_DMA_ALIGN, config->mergesize / sectorsize * sectorsize);
+        blkdev->sorted = devfs_malloc(DEVFS_BLKDEV_CACHE_PAGES * sizeof(struct devfs_blkdev_cache_t *));
+        blkdev->segments = devfs_malloc(DEVFS_BLKDEV_CACHE_PAGES * sizeof(struct devfs_blkdev_segment_t));
+        if ((blkdev->merge == NULL) || (blkdev->sorted == NULL) || (blkdev->segments == NULL)) {
+            devfs_free(blkdev->merge);
+            devfs_free(blkdev->sorted);
+            devfs_free(blkdev->segments);
+            devfs_mutex_free(&blkdev->mutex);
+            devfs_mutex_free(&blkdev->turns.lock);
+            if (blkdev->erased) {
+                devfs_free(blkdev->erased);
+            }
+            devfs_free(blkdev);
+            devfs_inode_free(inode);
+            return -ENOMEM;
+        }
+    }
+
+    if (blkdev->shadowed) {
+        blkdev->deadline = config->deadline_ms;
+    }
+
+    blkdev->ownpage = NULL;
+
+    if (sectorsize > DEVFS_BLKDEV_CACHE_PAGE_SIZE) {
+        /* Pool pages can't hold a sector, the device caches one in a page of its own */
+        blkdev->ownpage = devfs_malloc(sizeof(struct devfs_blkdev_cache_t));
+        if (blkdev->ownpage) {
+            blkdev->ownpage->data = devfs_malloc_aligned(DEVFS_DMA_ALIGN, sectorsize);
+        }
+        if ((blkdev->ownpage == NULL) || (blkdev->ownpage->data == NULL)) {
+            devfs_free(blkdev->ownpage);
+            devfs_mutex_free(&blkdev->mutex);
+            devfs_mutex_free(&blkdev->turns.lock);
+            if (blkdev->erased) {
+                devfs_free(blkdev->erased);
+            }
+            if (blkdev->merge) {
+                devfs_free(blkdev->merge);
+                devfs_free(blkdev->sorted);
+                devfs_free(blkdev->segments);
+            }
+            devfs_free(blkdev);
+            devfs_inode_free(inode);
+            return -ENOMEM;
+        }
+
+        INIT_LIST_HEAD(&blkdev->ownpage->lru);
+        blkdev->ownpage->owner = blkdev;
+        blkdev->ownpage->block = INVALID_BLOCK;
+        blkdev->ownpage->dirtymap = 0;
+        blkdev->ownpage->dirtytime = 0;
+        blkdev->ownpage->pinned = true;
+        blkdev->ownpage->owned = true;
+        list_add(&blkdev->ownpage->node, &blkdev->caches);
+    }
+
+    if (config && config->maxtransfer) {
+        blkdev->maxxfer = MAX(config->maxtransfer / sectorsize, 1) * sectorsize;
+    }
 
     devfs_inode_lock();
 
@@ -482,6 +4176,7 @@ int devfs_blkdev_register(const char *name, const struct devfs_blkdev_ops *ops,
 int devfs_blkdev_unregister(const char *name)
 {
     struct devfs_inode_t *inode = NULL;
+    struct devfs_blkdev_t *blkdev = NULL;
     int retval = 0;
 
     retval = devfs_inode_search_with_type(&inode, name, devfs_type_blkdev);
@@ -489,10 +4184,73 @@ int devfs_blkdev_unregister(const char *name)
         return retval;
     }
 
+    blkdev = inode->dev_data;
+
     retval = devfs_inode_free(inode);
     if (retval < 0) {
         return retval;
     }
 
+    if (blkdev) {
+        struct devfs_blkdev_erase_t *request = NULL;
+        struct devfs_blkdev_erase_t *n = NULL;
+
+        devfs_mutex_lock(&blkdev->mutex, DEVFS_FOREVER);
+
+        list_for_each_entry_safe(request, n, &blkdev->erases, node) {
+            devfs_blkdev_erase_complete(blkdev, request, -ECANCELED);
+        }
+        devfs_blkdev_mtd_preerase(blkdev, NULL);
+
+        devfs_blkdev_cache_unpin(blkdev, 0, blkdev->nsectors);
+        devfs_blkdev_bch_release_cache(blkdev);
+        devfs_mutex_unlock(&blkdev->mutex);
+
+        devfs_work_cancel(&blkdev->erasework);
+
+        /* The worker is gone, tell the owners of cancelled requests here */
+        devfs_blkdev_erase_notify(blkdev);
+
+        /* Another device may still be waiting to reclaim a page of this one */
+        devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
+
+        if (blkdev->reclaimers > 0) {
+            devfs_sem_t unregistered;
+
+            devfs_sem_init(&unregistered, 0, 1);
+            blkdev->unregistered = &unregistered;
+
+            devfs_mutex_unlock(&cache_pool->mutex);
+
+            devfs_sem_take(&unregistered, DEVFS_FOREVER);
+
+            /* The giver is out of its critical section once the mutex is free */
+            devfs_mutex_lock(&cache_pool->mutex, DEVFS_FOREVER);
+            devfs_sem_free(&unregistered);
+        }
+
+        devfs_mutex_unlock(&cache_pool->mutex);
+
+        devfs_mutex_free(&blkdev->mutex);
+        devfs_mutex_free(&blkdev->turns.lock);
+        if (blkdev->erased) {
+            devfs_free(blkdev->erased);
+        }
+        if (blkdev->merge) {
+            devfs_free(blkdev->merge);
+            devfs_free(blkdev->sorted);
+            devfs_free(blkdev->segments);
+        }
+        if (blkdev->ownpage) {
+            devfs_free(blkdev->ownpage->data);
+            devfs_free(blkdev->ownpage);
+        }
+        if (blkdev->shadow) {
+            devfs_free(blkdev->shadow);
+            devfs_free(blkdev->shadowdirty);
+        }
+        devfs_free(blkdev);
+    }
+
     return 0;
 }
@@ -0,0 +1,816 @@
+/*
+ * Copyright (c) 2022 tangchunhui@coros.com
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "devfs.h"
+
+#include "devfs_os.h"
+DEVFS_LOG_MODULE_REG(devfs_blkdev_ftl);
+
+/*
+ * Log-structured flash translation layer over a raw MTD driver.
+ *
+ * Every erase block starts with a metadata area followed by slots of one
+ * FTL sector each:
+ *
+ *   | magic | erase count | sequence | lsn[0] ... lsn[nslots - 1] | pad | slot 0 | slot 1 | ...
+ *
+ * Each field takes whole program units of the MTD device, so it can be
+ * programmed on its own once the block is erased. Sectors are appended to
+ * the active block, the data first and then its logical sector number,
+ * which commits it. The newest copy of a sector wins, so rewriting a sector
+ * never erases anything; stale copies are reclaimed by garbage collection,
+ * which moves the valid sectors out of the block with the fewest of them
+ * and erases it. Free blocks are handed out least worn first, and a block
+ * whose erase count lags too far behind has its cold data moved so that it
+ * takes its share of the erases.
+ */
+
+#define FTL_MAGIC           0x4C544644  /* "DFTL" */
+#define FTL_INVALID         0xFFFFFFFF
+
+#define FTL_FIELD_MAGIC     0
+#define FTL_FIELD_ERASES    1
+#define FTL_FIELD_SEQ       2
+#define FTL_FIELD_LSN       3           /* lsn of slot n is field FTL_FIELD_LSN + n */
+
+#define FTL_BATCH           8           /* Slots programmed with one driver call */
+#define FTL_MIN_RESERVED    3
+#define FTL_SECTOR_SIZE     512
+
+enum devfs_ftl_state_t {
+    ftl_block_dirty,                    /* Must be erased before use */
+    ftl_block_free,                     /* Erased, header written */
+    ftl_block_used,
+    ftl_block_active,                   /* Receiving new sectors */
+};
+
+struct devfs_ftl_block_t {
+    uint32_t erases;
+    uint32_t seq;                       /* Order in which the block was opened */
+    uint16_t valid;                     /* Slots holding the newest copy of a sector */
+    uint16_t used;                      /* Slots programmed so far */
+    uint8_t state;
+};
+
+struct devfs_blkdev_ftl_t {
+    struct devfs_inode_t *parent;       /* MTD block device the FTL is stacked on */
+    const struct devfs_blkdev_ops *ops; /* Its driver, called with its inode */
+
+    uint32_t blocksize;                 /* Program unit of the MTD device */
+    uint32_t erasesize;
+    uint32_t seraseblock;               /* First MTD erase block owned by the FTL */
+    uint32_t nblocks;
+    uint32_t alignment;
+    uint8_t erasevalue;
+    uint32_t blank;                     /* A field nobody programmed */
+
+    uint32_t sectorsize;
+    uint32_t nsectors;
+    uint32_t nslots;                    /* Sectors per erase block */
+    uint32_t fieldsize;
+    uint32_t dataoff;                   /* Offset of slot 0 in an erase block */
+
+    uint32_t seq;
+    uint32_t nfree;                     /* Free and dirty blocks */
+    uint32_t active;
+    uint32_t *map;                      /* Logical sector to block * nslots + slot */
+    struct devfs_ftl_block_t *blocks;
+
+    uint8_t *buffer;                    /* One sector for garbage collection and mount */
+    uint8_t *fields;                    /* FTL_BATCH metadata fields */
+
+    struct blkdev_ftl_stats_t stats;
+};
+
+static inline uint32_t devfs_ftl_encode(struct devfs_blkdev_ftl_t *ftl, uint32_t lsn)
+{
+    /* Keeps sector 0 distinct from a blank field whatever the erase value */
+    return lsn ^ ~ftl->blank;
+}
+
+static void devfs_ftl_field_set(struct devfs_blkdev_ftl_t *ftl, uint32_t index, uint32_t value)
+{
+    memset(&ftl->fields[index * ftl->fieldsize], ftl->erasevalue, ftl->fieldsize);
+    memcpy(&ftl->fields[index * ftl->fieldsize], &value, sizeof(uint32_t));
+}
+
+static inline uint32_t devfs_ftl_field_get(struct devfs_blkdev_ftl_t *ftl, uint32_t index)
+{
+    uint32_t value = 0;
+
+    memcpy(&value, &ftl->fields[index * ftl->fieldsize], sizeof(uint32_t));
+
+    return value;
+}
+
+static int devfs_ftl_mtd_read(struct devfs_blkdev_ftl_t *ftl, uint32_t block, uint32_t offset, void *buffer, uint32_t length)
+{
+    blkdev_sector_t ssector = ((blkdev_sector_t)(ftl->seraseblock + block) * ftl->erasesize + offset) / ftl->blocksize;
+    int retval = 0;
+
+    retval = ftl->ops->read(ftl->parent, buffer, ssector, length / ftl->blocksize);
+
+    return (retval < 0) ? retval : 0;
+}
+
+static int devfs_ftl_mtd_write(struct devfs_blkdev_ftl_t *ftl, uint32_t block, uint32_t offset, const void *buffer, uint32_t length)
+{
+    blkdev_sector_t ssector = ((blkdev_sector_t)(ftl->seraseblock + block) * ftl->erasesize + offset) / ftl->blocksize;
+    int retval = 0;
+
+    retval = ftl->ops->write(ftl->parent, buffer, ssector, length / ftl->blocksize);
+
+    return (retval < 0) ? retval : 0;
+}
+
+/* Erase a block and write its header back with the new erase count */
+static int devfs_ftl_erase(struct devfs_blkdev_ftl_t *ftl, uint32_t block)
+{
+    struct devfs_ftl_block_t *blk = &ftl->blocks[block];
+    struct mtddev_erase_t erase = {0};
+    int retval = 0;
+
+    erase.seraseblock  = ftl->seraseblock + block;
+    erase.neraseblocks = 1;
+
+    retval = ftl->ops->ioctl(ftl->parent, MTDIOC_ERASE, (unsigned long)&erase);
+    if (retval < 0) {
+        DEVFS_ERROR("erase block[%u] fail[%d]", block, retval);
+        return retval;
+    }
+
+    ftl->stats.erases++;
+
+    if (blk->state != ftl_block_dirty) {
+        ftl->nfree++;
+    }
+
+    blk->erases++;
+    blk->seq = FTL_INVALID;
+    blk->valid = 0;
+    blk->used = 0;
+    blk->state = ftl_block_dirty;
+
+    devfs_ftl_field_set(ftl, FTL_FIELD_MAGIC, FTL_MAGIC);
+    devfs_ftl_field_set(ftl, FTL_FIELD_ERASES, blk->erases);
+
+    retval = devfs_ftl_mtd_write(ftl, block, 0, ftl->fields, 2 * ftl->fieldsize);
+    if (retval < 0) {
+        return retval;
+    }
+
+    blk->state = ftl_block_free;
+
+    return 0;
+}
+
+/* Open the least worn free block for appending */
+static int devfs_ftl_alloc(struct devfs_blkdev_ftl_t *ftl)
+{
+    struct devfs_ftl_block_t *blk = NULL;
+    uint32_t block = FTL_INVALID;
+    int retval = 0;
+
+    for (uint32_t i = 0; i < ftl->nblocks; i++) {
+        if (((ftl->blocks[i].state == ftl_block_free) || (ftl->blocks[i].state == ftl_block_dirty)) &&
+            ((block == FTL_INVALID) || (ftl->blocks[i].erases < ftl->blocks[block].erases))) {
+            block = i;
+        }
+    }
+
+    if (block == FTL_INVALID) {
+        return -ENOSPC;
+    }
+
+    blk = &ftl->blocks[block];
+
+    if (blk->state == ftl_block_dirty) {
+        retval = devfs_ftl_erase(ftl, block);
+        if (retval < 0) {
+            return retval;
+        }
+    }
+
+    devfs_ftl_field_set(ftl, 0, ftl->seq);
+
+    retval = devfs_ftl_mtd_write(ftl, block, FTL_FIELD_SEQ * ftl->fieldsize, ftl->fields, ftl->fieldsize);
+    if (retval < 0) {
+        /* The header is half written, erase it again next time */
+        blk->state = ftl_block_dirty;
+        return retval;
+    }
+
+    blk->seq = ftl->seq++;
+    blk->state = ftl_block_active;
+    ftl->nfree--;
+    ftl->active = block;
+
+    return 0;
+}
+
+/*
+ * Program count sectors into the active block, which must have room for
+ * them, and point their logical sectors at the new copies.
+ */
+static int devfs_ftl_append(struct devfs_blkdev_ftl_t *ftl, const uint8_t *data, const uint32_t *lsns, uint32_t count)
+{
+    struct devfs_ftl_block_t *blk = &ftl->blocks[ftl->active];
+    uint32_t slot = blk->used;
+    uint32_t old = 0;
+    int retval = 0;
+
+    /* Programmed slots can't be used again even if programming failed */
+    blk->used += count;
+    ftl->stats.flash_writes += count;
+
+    retval = devfs_ftl_mtd_write(ftl, ftl->active, ftl->dataoff + slot * ftl->sectorsize, data, count * ftl->sectorsize);
+    if (retval < 0) {
+        return retval;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        devfs_ftl_field_set(ftl, i, devfs_ftl_encode(ftl, lsns[i]));
+    }
+
+    retval = devfs_ftl_mtd_write(ftl, ftl->active, (FTL_FIELD_LSN + slot) * ftl->fieldsize, ftl->fields, count * ftl->fieldsize);
+    if (retval < 0) {
+        return retval;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        old = ftl->map[lsns[i]];
+        if (old != FTL_INVALID) {
+            ftl->blocks[old / ftl->nslots].valid--;
+        }
+
+        ftl->map[lsns[i]] = ftl->active * ftl->nslots + slot + i;
+        blk->valid++;
+    }
+
+    return 0;
+}
+
+static int devfs_ftl_open(struct devfs_blkdev_ftl_t *ftl, bool gc);
+
+/* Move the valid sectors out of block and erase it */
+static int devfs_ftl_reclaim(struct devfs_blkdev_ftl_t *ftl, uint32_t block)
+{
+    struct devfs_ftl_block_t *blk = &ftl->blocks[block];
+    uint32_t lsns[FTL_BATCH];
+    uint32_t count = 0;
+    uint32_t lsn = 0;
+    int retval = 0;
+
+    for (uint32_t slot = 0; (slot < blk->used) && (blk->valid > 0); slot += count) {
+        count = MIN(FTL_BATCH, blk->used - slot);
+
+        retval = devfs_ftl_mtd_read(ftl, block, (FTL_FIELD_LSN + slot) * ftl->fieldsize, ftl->fields, count * ftl->fieldsize);
+        if (retval < 0) {
+            return retval;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            lsns[i] = devfs_ftl_encode(ftl, devfs_ftl_field_get(ftl, i));
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            lsn = lsns[i];
+
+            if ((lsn >= ftl->nsectors) || (ftl->map[lsn] != block * ftl->nslots + slot + i)) {
+                continue;
+            }
+
+            retval = devfs_ftl_mtd_read(ftl, block, ftl->dataoff + (slot + i) * ftl->sectorsize, ftl->buffer, ftl->sectorsize);
+            if (retval < 0) {
+                return retval;
+            }
+
+            retval = devfs_ftl_open(ftl, true);
+            if (retval < 0) {
+                return retval;
+            }
+
+            retval = devfs_ftl_append(ftl, ftl->buffer, &lsn, 1);
+            if (retval < 0) {
+                return retval;
+            }
+
+            ftl->stats.gc_copies++;
+        }
+    }
+
+    retval = devfs_ftl_erase(ftl, block);
+    if (retval < 0) {
+        return retval;
+    }
+
+    ftl->stats.gc_runs++;
+
+    return 0;
+}
+
+/* Reclaim the used block with the fewest valid sectors */
+static int devfs_ftl_gc(struct devfs_blkdev_ftl_t *ftl)
+{
+    uint32_t victim = FTL_INVALID;
+
+    for (uint32_t i = 0; i < ftl->nblocks; i++) {
+        if ((ftl->blocks[i].state == ftl_block_used) &&
+            ((victim == FTL_INVALID) || (ftl->blocks[i].valid < ftl->blocks[victim].valid))) {
+            victim = i;
+        }
+    }
+
+    if ((victim == FTL_INVALID) || (ftl->blocks[victim].valid >= ftl->nslots)) {
+        DEVFS_ERROR("no block to reclaim");
+        return -ENOSPC;
+    }
+
+    return devfs_ftl_reclaim(ftl, victim);
+}
+
+/* Move the data of the least worn block once the wear spread grows too wide */
+static int devfs_ftl_wear_level(struct devfs_blkdev_ftl_t *ftl)
+{
+    uint32_t coldest = FTL_INVALID;
+    uint32_t hottest = 0;
+
+    for (uint32_t i = 0; i < ftl->nblocks; i++) {
+        if (ftl->blocks[i].erases > hottest) {
+            hottest = ftl->blocks[i].erases;
+        }
+
+        if ((ftl->blocks[i].state == ftl_block_used) &&
+            ((coldest == FTL_INVALID) || (ftl->blocks[i].erases < ftl->blocks[coldest].erases))) {
+            coldest = i;
+        }
+    }
+
+    if ((coldest == FTL_INVALID) ||
+        (hottest - ftl->blocks[coldest].erases <= DEVFS_BLKDEV_FTL_WEAR_DELTA)) {
+        return 0;
+    }
+
+    if (ftl->blocks[coldest].valid > ftl->nslots - ftl->blocks[ftl->active].used) {
+        /* Wait for a block with room for all of it */
+        return 0;
+    }
+
+    ftl->stats.wl_moves++;
+
+    return devfs_ftl_reclaim(ftl, coldest);
+}
+
+/*
+ * Make sure the active block has a free slot. Garbage collection keeps one
+ * free block in hand for itself, and runs with gc set so it never recurses.
+ */
+static int devfs_ftl_open(struct devfs_blkdev_ftl_t *ftl, bool gc)
+{
+    int retval = 0;
+
+    if ((ftl->active != FTL_INVALID) &&
+        (ftl->blocks[ftl->active].used < ftl->nslots)) {
+        return 0;
+    }
+
+    if (ftl->active != FTL_INVALID) {
+        ftl->blocks[ftl->active].state = ftl_block_used;
+        ftl->active = FTL_INVALID;
+    }
+
+    while ((gc == false) && (ftl->nfree < 2)) {
+        retval = devfs_ftl_gc(ftl);
+        if (retval < 0) {
+            return retval;
+        }
+    }
+
+    if (ftl->active == FTL_INVALID) {
+        retval = devfs_ftl_alloc(ftl);
+        if (retval < 0) {
+            return retval;
+        }
+    }
+
+    if (gc == false) {
+        retval = devfs_ftl_wear_level(ftl);
+    }
+
+    return retval;
+}
+
+static int devfs_blkdev_ftl_read(struct devfs_inode_t *inode, void *dst, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_ftl_t *ftl = (struct devfs_blkdev_ftl_t *)inode->private_data;
+    uint8_t *buffer = dst;
+    uint32_t phys = 0;
+    uint32_t count = 0;
+    int retval = 0;
+
+    for (uint32_t i = 0; i < nsectors; i += count) {
+        phys = ftl->map[ssector + i];
+        count = 1;
+
+        if (phys == FTL_INVALID) {
+            memset(&buffer[i * ftl->sectorsize], ftl->erasevalue, ftl->sectorsize);
+            continue;
+        }
+
+        /* Sectors written together usually sit side by side */
+        while ((i + count < nsectors) &&
+               ((phys + count) % ftl->nslots != 0) &&
+               (ftl->map[ssector + i + count] == phys + count)) {
+            count++;
+        }
+
+        retval = devfs_ftl_mtd_read(ftl, phys / ftl->nslots, ftl->dataoff + (phys % ftl->nslots) * ftl->sectorsize,
+                                    &buffer[i * ftl->sectorsize], count * ftl->sectorsize);
+        if (retval < 0) {
+            return retval;
+        }
+    }
+
+    return (nsectors * ftl->sectorsize);
+}
+
+static int devfs_blkdev_ftl_write(struct devfs_inode_t *inode, const void *src, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_ftl_t *ftl = (struct devfs_blkdev_ftl_t *)inode->private_data;
+    const uint8_t *buffer = src;
+    uint32_t lsns[FTL_BATCH];
+    uint32_t count = 0;
+    int retval = 0;
+
+    for (uint32_t i = 0; i < nsectors; i += count) {
+        retval = devfs_ftl_open(ftl, false);
+        if (retval < 0) {
+            return retval;
+        }
+
+        count = MIN(nsectors - i, ftl->nslots - ftl->blocks[ftl->active].used);
+        count = MIN(count, FTL_BATCH);
+
+        for (uint32_t j = 0; j < count; j++) {
+            lsns[j] = (uint32_t)(ssector + i + j);
+        }
+
+        retval = devfs_ftl_append(ftl, &buffer[i * ftl->sectorsize], lsns, count);
+        if (retval < 0) {
+            return retval;
+        }
+
+        ftl->stats.host_writes += count;
+    }
+
+    return (nsectors * ftl->sectorsize);
+}
+
+static int devfs_blkdev_ftl_ioctl(struct devfs_inode_t *inode, unsigned int cmd, unsigned long arg)
+{
+    struct devfs_blkdev_ftl_t *ftl = (struct devfs_blkdev_ftl_t *)inode->private_data;
+    int retval = 0;
+
+    switch(cmd) {
+    case BIOC_FTL_STATS: {
+        struct blkdev_ftl_stats_t *stats = (struct blkdev_ftl_stats_t *)arg;
+
+        if (stats == NULL) {
+            retval = -EINVAL;
+            break;
+        }
+
+        ftl->stats.min_erases = FTL_INVALID;
+        ftl->stats.max_erases = 0;
+
+        for (uint32_t i = 0; i < ftl->nblocks; i++) {
+            ftl->stats.min_erases = MIN(ftl->stats.min_erases, ftl->blocks[i].erases);
+            ftl->stats.max_erases = MAX(ftl->stats.max_erases, ftl->blocks[i].erases);
+        }
+
+        memcpy(stats, &ftl->stats, sizeof(struct blkdev_ftl_stats_t));
+        break;
+    }
+
+    default:
+        retval = -ENOTTY;
+        break;
+    }
+
+    return retval;
+}
+
+static int devfs_blkdev_ftl_geometry(struct devfs_inode_t *inode, struct blkdev_geometry_t *geometry)
+{
+    struct devfs_blkdev_ftl_t *ftl = (struct devfs_blkdev_ftl_t *)inode->private_data;
+
+    geometry->sectorsize = ftl->sectorsize;
+    geometry->nsectors   = ftl->nsectors;
+    geometry->alignment  = ftl->alignment;
+
+    return 0;
+}
+
+static const struct devfs_blkdev_ops devfs_blkdev_ftl_ops = {
+    .read     = devfs_blkdev_ftl_read,
+    .write    = devfs_blkdev_ftl_write,
+    .ioctl    = devfs_blkdev_ftl_ioctl,
+    .geometry = devfs_blkdev_ftl_geometry,
+};
+
+/* Rebuild the map from the metadata areas, the newest copy of a sector wins */
+static int devfs_ftl_mount(struct devfs_blkdev_ftl_t *ftl)
+{
+    struct devfs_ftl_block_t *blk = NULL;
+    uint32_t count = 0;
+    uint32_t lsn = 0;
+    uint32_t phys = 0;
+    int retval = 0;
+
+    ftl->nfree = 0;
+    ftl->active = FTL_INVALID;
+    ftl->seq = 0;
+
+    for (uint32_t block = 0; block < ftl->nblocks; block++) {
+        blk = &ftl->blocks[block];
+
+        retval = devfs_ftl_mtd_read(ftl, block, 0, ftl->fields, FTL_FIELD_LSN * ftl->fieldsize);
+        if (retval < 0) {
+            return retval;
+        }
+
+        blk->valid = 0;
+        blk->used = 0;
+        blk->seq = FTL_INVALID;
+
+        if (devfs_ftl_field_get(ftl, FTL_FIELD_MAGIC) != FTL_MAGIC) {
+            blk->erases = 0;
+            blk->state = ftl_block_dirty;
+            ftl->nfree++;
+            continue;
+        }
+
+        blk->erases = devfs_ftl_field_get(ftl, FTL_FIELD_ERASES);
+
+        if (devfs_ftl_field_get(ftl, FTL_FIELD_SEQ) == ftl->blank) {
+            blk->state = ftl_block_free;
+            ftl->nfree++;
+            continue;
+        }
+
+        blk->seq = devfs_ftl_field_get(ftl, FTL_FIELD_SEQ);
+        blk->state = ftl_block_used;
+
+        if (blk->seq >= ftl->seq) {
+            ftl->seq = blk->seq + 1;
+        }
+    }
+
+    for (uint32_t block = 0; block < ftl->nblocks; block++) {
+        blk = &ftl->blocks[block];
+
+        if (blk->state != ftl_block_used) {
+            continue;
+        }
+
+        /* Slots are programmed in order, the first blank one ends the scan */
+        while (blk->used < ftl->nslots) {
+            uint32_t slot = blk->used;
+
+            count = MIN(FTL_BATCH, ftl->nslots - slot);
+
+            retval = devfs_ftl_mtd_read(ftl, block, (FTL_FIELD_LSN + slot) * ftl->fieldsize, ftl->fields, count * ftl->fieldsize);
+            if (retval < 0) {
+                return retval;
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                if (devfs_ftl_field_get(ftl, i) == ftl->blank) {
+                    break;
+                }
+
+                blk->used = slot + i + 1;
+
+                lsn = devfs_ftl_encode(ftl, devfs_ftl_field_get(ftl, i));
+                if (lsn >= ftl->nsectors) {
+                    continue;
+                }
+
+                phys = ftl->map[lsn];
+                if ((phys == FTL_INVALID) ||
+                    (ftl->blocks[phys / ftl->nslots].seq < blk->seq) ||
+                    (phys / ftl->nslots == block)) {
+                    ftl->map[lsn] = block * ftl->nslots + slot + i;
+                }
+            }
+
+            if (blk->used < slot + count) {
+                break;
+            }
+        }
+
+        /* Keep appending to the newest block if it has room */
+        if ((blk->used < ftl->nslots) &&
+            ((ftl->active == FTL_INVALID) || (ftl->blocks[ftl->active].seq < blk->seq))) {
+            ftl->active = block;
+        }
+    }
+
+    for (uint32_t i = 0; i < ftl->nsectors; i++) {
+        if (ftl->map[i] != FTL_INVALID) {
+            ftl->blocks[ftl->map[i] / ftl->nslots].valid++;
+        }
+    }
+
+    if (ftl->active != FTL_INVALID) {
+        blk = &ftl->blocks[ftl->active];
+        blk->state = ftl_block_active;
+
+        /* Skip slots whose data was programmed but never committed */
+        while (blk->used < ftl->nslots) {
+            retval = devfs_ftl_mtd_read(ftl, ftl->active, ftl->dataoff + blk->used * ftl->sectorsize, ftl->buffer, ftl->sectorsize);
+            if (retval < 0) {
+                return retval;
+            }
+
+            count = 0;
+            while ((count < ftl->sectorsize) && (ftl->buffer[count] == ftl->erasevalue)) {
+                count++;
+            }
+
+            if (count == ftl->sectorsize) {
+                break;
+            }
+
+            blk->used++;
+        }
+    }
+
+    DEVFS_INFO("ftl: %u blocks, %u free, %u sectors of %u bytes", ftl->nblocks, ftl->nfree, ftl->nsectors, ftl->sectorsize);
+
+    return 0;
+}
+
+static void devfs_ftl_free(struct devfs_blkdev_ftl_t *ftl)
+{
+    devfs_free(ftl->map);
+    devfs_free(ftl->blocks);
+    devfs_free(ftl->buffer);
+    devfs_free(ftl->fields);
+    devfs_free(ftl);
+}
+
+/*
+ * Register an FTL over erase blocks of the MTD block device parent. It is
+ * stacked on parent like a partition and drives parent's driver directly.
+ */
+int devfs_blkdev_ftl_register(const char *name, const char *parent, const struct blkdev_ftl_config_t *config)
+{
+    struct devfs_blkdev_ftl_t *ftl = NULL;
+    struct devfs_inode_t *inode = NULL;
+    struct mtddev_geometry_t mtdgeometry = {0};
+    struct blkdev_geometry_t geometry = {0};
+    struct blkdev_config_t blkconfig = {0};
+    uint32_t nreserved = FTL_MIN_RESERVED;
+    uint32_t meta = 0;
+    int retval = 0;
+
+    DEVFS_ASSERT(name);
+    DEVFS_ASSERT(parent);
+
+    retval = devfs_inode_search_with_type(&inode, parent, devfs_type_blkdev);
+    if (retval < 0) {
+        return retval;
+    }
+
+    ftl = devfs_malloc(sizeof(struct devfs_blkdev_ftl_t));
+    if (ftl == NULL) {
+        return -ENOMEM;
+    }
+
+    memset(ftl, 0x00, sizeof(struct devfs_blkdev_ftl_t));
+
+    ftl->parent = inode;
+
+    retval = devfs_blkdev_stack(inode, &ftl->ops);
+    if (retval < 0) {
+        devfs_free(ftl);
+        return retval;
+    }
+
+    DEVFS_ASSERT(ftl->ops->read);
+    DEVFS_ASSERT(ftl->ops->write);
+    DEVFS_ASSERT(ftl->ops->geometry);
+
+    mtdgeometry.erasevalue = 0xFF;
+
+    retval = ftl->ops->ioctl ? ftl->ops->ioctl(inode, MTDIOC_GEOMETRY, (unsigned long)&mtdgeometry) : -ENOTTY;
+    if (retval == 0) {
+        retval = ftl->ops->geometry(inode, &geometry);
+    }
+    if (retval < 0) {
+        DEVFS_ERROR("%s: %s isn't an MTD device[%d]", name, parent, retval);
+        devfs_blkdev_unstack(inode);
+        devfs_free(ftl);
+        return retval;
+    }
+
+    ftl->blocksize = mtdgeometry.blocksize;
+    ftl->erasesize = mtdgeometry.erasesize;
+    ftl->alignment = geometry.alignment;
+    ftl->erasevalue = (uint8_t)mtdgeometry.erasevalue;
+    ftl->blank = ftl->erasevalue * 0x01010101UL;
+
+    ftl->seraseblock = config ? config->seraseblock : 0;
+    ftl->nblocks = (config && config->neraseblocks) ? config->neraseblocks : mtdgeometry.neraseblocks - ftl->seraseblock;
+    ftl->sectorsize = (config && config->sectorsize) ? config->sectorsize : MIN(FTL_SECTOR_SIZE, DEVFS_BLKDEV_CACHE_PAGE_SIZE);
+
+    if (config && (config->nreserved > nreserved)) {
+        nreserved = config->nreserved;
+    }
+
+    /* Each metadata field takes whole program units, at least a word */
+    ftl->fieldsize = ((sizeof(uint32_t) + ftl->blocksize - 1) / ftl->blocksize) * ftl->blocksize;
+
+    ftl->nslots = (ftl->erasesize - FTL_FIELD_LSN * ftl->fieldsize) / (ftl->sectorsize + ftl->fieldsize);
+    meta = ((FTL_FIELD_LSN + ftl->nslots) * ftl->fieldsize + ftl->sectorsize - 1) / ftl->sectorsize * ftl->sectorsize;
+    if (meta + ftl->nslots * ftl->sectorsize > ftl->erasesize) {
+        ftl->nslots--;
+        meta = ((FTL_FIELD_LSN + ftl->nslots) * ftl->fieldsize + ftl->sectorsize - 1) / ftl->sectorsize * ftl->sectorsize;
+    }
+    ftl->dataoff = meta;
+
+    if ((ftl->sectorsize % ftl->blocksize) ||
+        (ftl->seraseblock >= mtdgeometry.neraseblocks) ||
+        (ftl->nblocks > mtdgeometry.neraseblocks - ftl->seraseblock) ||
+        (ftl->nblocks <= nreserved) ||
+        (ftl->nslots < 2) || (ftl->nslots > UINT16_MAX)) {
+        DEVFS_ERROR("%s: unsupported layout sectorsize[%u] blocksize[%u] erasesize[%u] nblocks[%u]",
+                    name, ftl->sectorsize, ftl->blocksize, ftl->erasesize, ftl->nblocks);
+        devfs_blkdev_unstack(inode);
+        devfs_free(ftl);
+        return -EINVAL;
+    }
+
+    ftl->nsectors = (ftl->nblocks - nreserved) * ftl->nslots;
+
+    ftl->map = devfs_malloc(ftl->nsectors * sizeof(uint32_t));
+    ftl->blocks = devfs_malloc(ftl->nblocks * sizeof(struct devfs_ftl_block_t));
+    ftl->buffer = devfs_malloc_aligned(DEVFS_DMA_ALIGN, ftl->sectorsize);
+    ftl->fields = devfs_malloc_aligned(DEVFS_DMA_ALIGN, MAX(FTL_BATCH, FTL_FIELD_LSN) * ftl->fieldsize);
+    if ((ftl->map == NULL) || (ftl->blocks == NULL) || (ftl->buffer == NULL) || (ftl->fields == NULL)) {
+        devfs_blkdev_unstack(inode);
+        devfs_ftl_free(ftl);
+        return -ENOMEM;
+    }
+
+    memset(ftl->map, 0xFF, ftl->nsectors * sizeof(uint32_t));
+    memset(ftl->blocks, 0x00, ftl->nblocks * sizeof(struct devfs_ftl_block_t));
+
+    /* Reads and writes of the FTL take turns with the parent's */
+    blkconfig.lower = inode;
+
+    retval = devfs_ftl_mount(ftl);
+    if (retval == 0) {
+        retval = devfs_blkdev_register_with_config(name, &devfs_blkdev_ftl_ops, ftl, &blkconfig);
+    }
+    if (retval < 0) {
+        devfs_blkdev_unstack(inode);
+        devfs_ftl_free(ftl);
+        return retval;
+    }
+
+    return 0;
+}
+
+int devfs_blkdev_ftl_unregister(const char *name)
+{
+    struct devfs_inode_t *inode = NULL;
+    struct devfs_blkdev_ftl_t *ftl = NULL;
+    int retval = 0;
+
+    retval = devfs_inode_search_with_type(&inode, name, devfs_type_blkdev);
+    if (retval < 0) {
+        return retval;
+    }
+
+    /* Only tear down devices the FTL registered */
+    if (devfs_blkdev_driver_ops(inode) != &devfs_blkdev_ftl_ops) {
+        return -EINVAL;
+    }
+
+    ftl = (struct devfs_blkdev_ftl_t *)inode->private_data;
+
+    retval = devfs_blkdev_unregister(name);
+    if (retval < 0) {
+        return retval;
+    }
+
+    devfs_blkdev_unstack(ftl->parent);
+    devfs_ftl_free(ftl);
+
+    return 0;
+}
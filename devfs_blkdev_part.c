@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2022 tangchunhui@coros.com
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+
+#include "devfs.h"
+
+#include "devfs_os.h"
+DEVFS_LOG_MODULE_REG(devfs_blkdev_part);
+
+/*
+ * Partitions of a registered block device.
+ *
+ * A partition is a block device of its own whose driver is a window over
+ * the driver of the parent: it gets its own sector cache, lock, stats and
+ * erase state, so users of different partitions neither evict each other's
+ * cached sectors nor wait for each other. The parent driver is called
+ * directly, not through the parent's cache, so writes to a partition are
+ * not seen by sectors of it cached by the parent; don't use the same range
+ * through both.
+ */
+
+struct devfs_blkdev_part_t {
+    struct devfs_inode_t *parent;
+    const struct devfs_blkdev_ops *ops;
+
+    blkdev_sector_t ssector;    /* First parent driver sector of the partition */
+    blkdev_sector_t nsectors;
+    uint32_t seraseblock;       /* First parent erase block, MTD parents only */
+    uint32_t neraseblocks;
+};
+
+static int devfs_blkdev_part_open(struct devfs_inode_t *inode)
+{
+    struct devfs_blkdev_part_t *part = (struct devfs_blkdev_part_t *)inode->private_data;
+
+    if (part->ops->open) {
+        return part->ops->open(part->parent);
+    }
+
+    return 0;
+}
+
+static int devfs_blkdev_part_read(struct devfs_inode_t *inode, void *dst, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_part_t *part = (struct devfs_blkdev_part_t *)inode->private_data;
+
+    return part->ops->read(part->parent, dst, part->ssector + ssector, nsectors);
+}
+
+static int devfs_blkdev_part_write(struct devfs_inode_t *inode, const void *src, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_part_t *part = (struct devfs_blkdev_part_t *)inode->private_data;
+
+    return part->ops->write(part->parent, src, part->ssector + ssector, nsectors);
+}
+
+static int devfs_blkdev_part_copy(struct devfs_inode_t *inode, blkdev_sector_t dsector, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_part_t *part = (struct devfs_blkdev_part_t *)inode->private_data;
+
+    if (part->ops->copy == NULL) {
+        return -ENOTSUP;
+    }
+
+    return part->ops->copy(part->parent, part->ssector + dsector, part->ssector + ssector, nsectors);
+}
+
+static int devfs_blkdev_part_ioctl(struct devfs_inode_t *inode, unsigned int cmd, unsigned long arg)
+{
+    struct devfs_blkdev_part_t *part = (struct devfs_blkdev_part_t *)inode->private_data;
+    int retval = 0;
+
+    if (part->ops->ioctl == NULL) {
+        return -ENOTTY;
+    }
+
+    switch(cmd) {
+    case MTDIOC_GEOMETRY: {
+        struct mtddev_geometry_t *geometry = (struct mtddev_geometry_t *)arg;
+
+        if ((geometry == NULL) || (part->neraseblocks == 0)) {
+            retval = (geometry == NULL) ? -EINVAL : -ENOTTY;
+            break;
+        }
+
+        retval = part->ops->ioctl(part->parent, cmd, arg);
+        if (retval == 0) {
+            geometry->neraseblocks = part->neraseblocks;
+        }
+
+        break;
+    }
+
+    case MTDIOC_ERASE: {
+        struct mtddev_erase_t *erase = (struct mtddev_erase_t *)arg;
+        struct mtddev_erase_t window = {0};
+
+        if ((erase == NULL) ||
+            (erase->seraseblock >= part->neraseblocks) ||
+            (erase->neraseblocks > part->neraseblocks - erase->seraseblock)) {
+            retval = -EINVAL;
+            break;
+        }
+
+        window.seraseblock  = part->seraseblock + erase->seraseblock;
+        window.neraseblocks = erase->neraseblocks;
+
+        retval = part->ops->ioctl(part->parent, cmd, (unsigned long)&window);
+
+        break;
+    }
+
+    case MTDIOC_BLANKCHECK: {
+        struct mtddev_blankcheck_t *check = (struct mtddev_blankcheck_t *)arg;
+        struct mtddev_blankcheck_t window = {0};
+
+        if ((check == NULL) ||
+            (check->seraseblock >= part->neraseblocks) ||
+            (check->neraseblocks > part->neraseblocks - check->seraseblock)) {
+            retval = -EINVAL;
+            break;
+        }
+
+        window.seraseblock  = part->seraseblock + check->seraseblock;
+        window.neraseblocks = check->neraseblocks;
+
+        retval = part->ops->ioctl(part->parent, cmd, (unsigned long)&window);
+        check->nblank = window.nblank;
+
+        break;
+    }
+
+    case MTDIOC_WEAR: {
+        struct mtddev_wear_t *wear = (struct mtddev_wear_t *)arg;
+        struct mtddev_wear_t window = {0};
+
+        if ((wear == NULL) ||
+            (wear->seraseblock >= part->neraseblocks) ||
+            (wear->neraseblocks > part->neraseblocks - wear->seraseblock)) {
+            retval = -EINVAL;
+            break;
+        }
+
+        window.seraseblock  = part->seraseblock + wear->seraseblock;
+        window.neraseblocks = wear->neraseblocks;
+        window.erases       = wear->erases;
+
+        retval = part->ops->ioctl(part->parent, cmd, (unsigned long)&window);
+
+        break;
+    }
+
+    case BIOC_JEDEC_ID:
+        retval = part->ops->ioctl(part->parent, cmd, arg);
+        break;
+
+    default:
+        /* Other commands may carry addresses that would escape the window */
+        retval = -ENOTTY;
+        break;
+    }
+
+    return retval;
+}
+
+static int devfs_blkdev_part_geometry(struct devfs_inode_t *inode, struct blkdev_geometry_t *geometry)
+{
+    struct devfs_blkdev_part_t *part = (struct devfs_blkdev_part_t *)inode->private_data;
+    int retval = 0;
+
+    retval = part->ops->geometry(part->parent, geometry);
+    if (retval < 0) {
+        return retval;
+    }
+
+    geometry->nsectors = part->nsectors;
+
+    return 0;
+}
+
+static int devfs_blkdev_part_close(struct devfs_inode_t *inode)
+{
+    struct devfs_blkdev_part_t *part = (struct devfs_blkdev_part_t *)inode->private_data;
+
+    if (part->ops->close) {
+        return part->ops->close(part->parent);
+    }
+
+    return 0;
+}
+
+static const struct devfs_blkdev_ops devfs_blkdev_part_ops = {
+    .open     = devfs_blkdev_part_open,
+    .read     = devfs_blkdev_part_read,
+    .write    = devfs_blkdev_part_write,
+    .ioctl    = devfs_blkdev_part_ioctl,
+    .geometry = devfs_blkdev_part_geometry,
+    .close    = devfs_blkdev_part_close,
+    .copy     = devfs_blkdev_part_copy,
+};
+
+/* Check a partition against the parent geometry and fill in its window */
+static int devfs_blkdev_part_layout(struct devfs_blkdev_part_t *part, const char *name,
+                                    const struct blkdev_partition_t *partition)
+{
+    struct blkdev_geometry_t geometry = {0};
+    struct mtddev_geometry_t mtdgeometry = {0};
+    uint32_t align = 0;
+    uint64_t end = 0;
+    int retval = 0;
+
+    retval = part->ops->geometry(part->parent, &geometry);
+    if (retval < 0) {
+        return retval;
+    }
+
+    align = geometry.sectorsize;
+
+    if (part->ops->ioctl && (part->ops->ioctl(part->parent, MTDIOC_GEOMETRY, (unsigned long)&mtdgeometry) == 0) &&
+        (mtdgeometry.erasesize > 0)) {
+        /* Erase blocks must not straddle two partitions */
+        align = mtdgeometry.erasesize;
+    } else {
+        mtdgeometry.erasesize = 0;
+    }
+
+    end = (uint64_t)geometry.sectorsize * geometry.nsectors;
+    if (partition->size == 0) {
+        end = (partition->offset < end) ? end : 0;
+    } else {
+        end = partition->offset + partition->size;
+    }
+
+    if ((partition->offset % align) || (end % align) ||
+        (end <= partition->offset) || (end > (uint64_t)geometry.sectorsize * geometry.nsectors)) {
+        DEVFS_ERROR("%s: offset[%llu] size[%llu] doesn't fit the parent or its %u byte blocks",
+                    name, (unsigned long long)partition->offset, (unsigned long long)partition->size, align);
+        return -EINVAL;
+    }
+
+    part->ssector  = (blkdev_sector_t)(partition->offset / geometry.sectorsize);
+    part->nsectors = (blkdev_sector_t)((end - partition->offset) / geometry.sectorsize);
+
+    if (mtdgeometry.erasesize > 0) {
+        part->seraseblock  = (uint32_t)(partition->offset / mtdgeometry.erasesize);
+        part->neraseblocks = (uint32_t)((end - partition->offset) / mtdgeometry.erasesize);
+    }
+
+    return 0;
+}
+
+/*
+ * A partition without a name is called after the parent and its index,
+ * counting from 1: "flashp1" for the first partition of "flash".
+ */
+static void devfs_blkdev_part_name(char *name, size_t size, const char *parent, const struct blkdev_partition_t *partition,
+                                   int index)
+{
+    if (partition->name) {
+        snprintf(name, size, "%s", partition->name);
+    } else {
+        snprintf(name, size, "%sp%d", parent, index + 1);
+    }
+}
+
+/*
+ * Register partitions of the block device parent. If one of them fails,
+ * those registered before it are unregistered again.
+ */
+int devfs_blkdev_partition_register(const char *parent, const struct blkdev_partition_t *partitions, int npartitions,
+                                    const struct blkdev_config_t *config)
+{
+    struct devfs_blkdev_part_t *part = NULL;
+    struct devfs_inode_t *inode = NULL;
+    struct blkdev_config_t pconfig = {0};
+    char name[DEVFS_NAME_MAX + 1];
+    int retval = 0;
+    int i = 0;
+
+    DEVFS_ASSERT(parent);
+    DEVFS_ASSERT(partitions);
+
+    retval = devfs_inode_search_with_type(&inode, parent, devfs_type_blkdev);
+    if (retval < 0) {
+        return retval;
+    }
+
+    if (config) {
+        pconfig = *config;
+    }
+
+    /* Reads and writes of all partitions take turns with the parent's */
+    pconfig.lower = inode;
+
+    for (i = 0; i < npartitions; i++) {
+        devfs_blkdev_part_name(name, sizeof(name), parent, &partitions[i], i);
+
+        part = devfs_malloc(sizeof(struct devfs_blkdev_part_t));
+        if (part == NULL) {
+            retval = -ENOMEM;
+            break;
+        }
+
+        memset(part, 0x00, sizeof(struct devfs_blkdev_part_t));
+
+        part->parent = inode;
+
+        retval = devfs_blkdev_stack(inode, &part->ops);
+        if (retval < 0) {
+            devfs_free(part);
+            break;
+        }
+
+        retval = devfs_blkdev_part_layout(part, name, &partitions[i]);
+        if (retval == 0) {
+            retval = devfs_blkdev_register_with_config(name, &devfs_blkdev_part_ops, part, &pconfig);
+        }
+        if (retval < 0) {
+            devfs_blkdev_unstack(inode);
+            devfs_free(part);
+            break;
+        }
+
+        DEVFS_INFO("%s: sectors[%llu, %llu) of %s", name, (unsigned long long)part->ssector,
+                   (unsigned long long)(part->ssector + part->nsectors), parent);
+    }
+
+    if (retval < 0) {
+        while (--i >= 0) {
+            devfs_blkdev_part_name(name, sizeof(name), parent, &partitions[i], i);
+            devfs_blkdev_partition_unregister(name);
+        }
+
+        return retval;
+    }
+
+    return 0;
+}
+
+int devfs_blkdev_partition_unregister(const char *name)
+{
+    struct devfs_inode_t *inode = NULL;
+    struct devfs_blkdev_part_t *part = NULL;
+    int retval = 0;
+
+    retval = devfs_inode_search_with_type(&inode, name, devfs_type_blkdev);
+    if (retval < 0) {
+        return retval;
+    }
+
+    /* Only tear down devices registered as partitions */
+    if (devfs_blkdev_driver_ops(inode) != &devfs_blkdev_part_ops) {
+        return -EINVAL;
+    }
+
+    part = (struct devfs_blkdev_part_t *)inode->private_data;
+
+    retval = devfs_blkdev_unregister(name);
+    if (retval < 0) {
+        return retval;
+    }
+
+    devfs_blkdev_unstack(part->parent);
+    devfs_free(part);
+
+    return 0;
+}
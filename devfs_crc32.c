@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2022 tangchunhui@coros.com
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "devfs.h"
+
+#include <stdatomic.h>
+
+/*
+ * CRC-32 of Ethernet, zlib and PNG: reflected polynomial 0xEDB88320 with
+ * the register inverted on entry and exit, so the result matches
+ * crc32_ieee() and crc32 tools on the host, and a range can be summed in
+ * pieces by passing the previous result back in.
+ *
+ * Slicing-by-8 consumes eight bytes per step with eight 256 entry tables,
+ * 8 KiB built on first use. CONFIG_DEVFS_CRC32_SMALL trades that for a 64
+ * byte table handling four bits at a time, about eight times slower.
+ */
+
+#define DEVFS_CRC32_POLY    0xEDB88320UL
+
+#ifndef CONFIG_DEVFS_CRC32_SMALL
+
+enum {
+    crc32_empty,
+    crc32_building,
+    crc32_ready,
+};
+
+static uint32_t crc32_table[8][256];
+static atomic_int crc32_state;
+
+static void devfs_crc32_init(void)
+{
+    uint32_t crc = 0;
+
+    for (uint32_t i = 0; i < 256; i++) {
+        crc = i;
+
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? DEVFS_CRC32_POLY : 0);
+        }
+
+        crc32_table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc = crc32_table[t - 1][i];
+            crc32_table[t][i] = (crc >> 8) ^ crc32_table[0][crc & 0xFF];
+        }
+    }
+}
+
+/*
+ * The first caller builds the tables and publishes them with a release
+ * store; callers that see them ready through the acquire load also see
+ * every entry. Callers arriving while they are built don't wait, they
+ * take the bitwise loop instead.
+ */
+static bool devfs_crc32_tables(void)
+{
+    int state = atomic_load_explicit(&crc32_state, memory_order_acquire);
+
+    if (state == crc32_ready) {
+        return true;
+    }
+
+    if ((state == crc32_empty) &&
+        atomic_compare_exchange_strong_explicit(&crc32_state, &state, crc32_building,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        devfs_crc32_init();
+        atomic_store_explicit(&crc32_state, crc32_ready, memory_order_release);
+        return true;
+    }
+
+    return false;
+}
+
+uint32_t devfs_crc32(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+
+    crc = ~crc;
+
+    if (!devfs_crc32_tables()) {
+        while (length > 0) {
+            crc ^= *p++;
+
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? DEVFS_CRC32_POLY : 0);
+            }
+
+            length--;
+        }
+
+        return ~crc;
+    }
+
+    while (length >= 8) {
+        /* Assembled byte by byte: any alignment, either endianness */
+        lo = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+
+        crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+              crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+              crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+
+        p      += 8;
+        length -= 8;
+    }
+
+    while (length > 0) {
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *p++) & 0xFF];
+        length--;
+    }
+
+    return ~crc;
+}
+
+#else
+
+static const uint32_t crc32_table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+uint32_t devfs_crc32(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+
+    while (length > 0) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ crc32_table[crc & 0x0F];
+        crc = (crc >> 4) ^ crc32_table[crc & 0x0F];
+        length--;
+    }
+
+    return ~crc;
+}
+
+#endif
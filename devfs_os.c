@@ -1,4 +1,6 @@
 
+#include "devfs.h"
+
 #include "devfs_os.h"
 
 void* devfs_malloc(size_t size)
@@ -12,6 +14,50 @@ void devfs_free(void *mem)
         k_free(mem);
 }
 
+void* devfs_malloc_aligned(size_t align, size_t size)
+{
+    /* k_aligned_alloc() takes multiples of the pointer size only */
+    align = MAX(align, sizeof(void *));
+
+    /* Pad to whole alignment units so no other data shares the cache line */
+    return k_aligned_alloc(align, (size + align - 1) & ~(align - 1));
+}
+
+unsigned int devfs_cycles(void)
+{
+    return k_cycle_get_32();
+}
+
+unsigned int devfs_cycles_to_us(unsigned int cycles)
+{
+    return (unsigned int)k_cyc_to_us_floor64(cycles);
+}
+
+unsigned int devfs_uptime_ms(void)
+{
+    return k_uptime_get_32();
+}
+
+void devfs_yield(void)
+{
+    k_yield();
+}
+
+devfs_thread_t devfs_thread_self(void)
+{
+    return k_current_get();
+}
+
+int devfs_thread_priority_get(devfs_thread_t thread)
+{
+    return k_thread_priority_get(thread);
+}
+
+void devfs_thread_priority_set(devfs_thread_t thread, int priority)
+{
+    k_thread_priority_set(thread, priority);
+}
+
 int devfs_mutex_init(devfs_mutex_t *mutex)
 {
     return k_mutex_init(mutex);
@@ -56,4 +102,54 @@ int devfs_sem_free(devfs_sem_t *sem)
     /* do nothing */
 
     return 0;
-}
\ No newline at end of file
+}
+
+static K_THREAD_STACK_DEFINE(devfs_workq_stack, CONFIG_DEVFS_WORKQ_STACK_SIZE);
+static struct k_work_q devfs_workq;
+static bool devfs_workq_started = false;
+
+int devfs_work_init(devfs_work_t *work, devfs_work_handler_t handler)
+{
+    if (devfs_workq_started == false) {
+        const struct k_work_queue_config config = {
+            .name = "devfs_workq",
+        };
+
+        k_work_queue_init(&devfs_workq);
+        k_work_queue_start(&devfs_workq, devfs_workq_stack, K_THREAD_STACK_SIZEOF(devfs_workq_stack),
+                           CONFIG_DEVFS_WORKQ_PRIORITY, &config);
+
+        devfs_workq_started = true;
+    }
+
+    k_work_init(work, handler);
+
+    return 0;
+}
+
+int devfs_work_submit(devfs_work_t *work)
+{
+    int retval = 0;
+
+    retval = k_work_submit_to_queue(&devfs_workq, work);
+
+    return (retval < 0) ? retval : 0;
+}
+
+int devfs_work_flush(devfs_work_t *work)
+{
+    struct k_work_sync sync;
+
+    k_work_flush(work, &sync);
+
+    return 0;
+}
+
+int devfs_work_cancel(devfs_work_t *work)
+{
+    struct k_work_sync sync;
+
+    k_work_cancel_sync(work, &sync);
+
+    return 0;
+}
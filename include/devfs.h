@@ -12,6 +12,7 @@
 #define DEVFS_O_READ	0x01
 #define DEVFS_O_WRITE	0x02
 #define DEVFS_O_RDWR	(DEVFS_O_READ | DEVFS_O_WRITE)
+#define DEVFS_O_DIRECT	0x0100	/* Block devices: whole sectors only, bypass the cache */
 
 #define DEVFS_SEEK_SET	0
 #define DEVFS_SEEK_CUR	1
@@ -21,7 +22,11 @@ struct devfs_file_t {
 	int flags;
 	struct devfs_inode_t *inode;
 
-	off_t offset;
+	devfs_off_t offset;
+
+	bool stream;	/* MTD block devices: BIOC_STREAM, erase each erase block when the writer first reaches it */
+	uint8_t advice;	/* Block devices: BLKDEV_ADV_* access pattern set by BIOC_ADVISE */
+	uint8_t ioprio;	/* Block devices: BLKDEV_IOPRIO_* class of the file's reads and writes, set by BIOC_IOPRIO */
 };
 
 struct devfs_dir_t {
@@ -38,7 +43,9 @@ int devfs_open(struct devfs_file_t *file, const char *path, int flags);
 int devfs_read(struct devfs_file_t *file, void *buff, size_t size);
 int devfs_write(struct devfs_file_t *file, const void *buff, size_t size);
 int devfs_lseek(struct devfs_file_t *file, off_t off, int whence);
+int devfs_lseek64(struct devfs_file_t *file, devfs_off_t off, int whence, devfs_off_t *pos);
 int devfs_ioctl(struct devfs_file_t *file, unsigned int cmd, unsigned long arg);
+int devfs_copy(struct devfs_file_t *in, struct devfs_file_t *out, size_t size);
 int devfs_close(struct devfs_file_t *file);
 
 int devfs_opendir(struct devfs_dir_t *dir, const char *path);
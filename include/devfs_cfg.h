@@ -9,6 +9,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -25,6 +26,99 @@
 
 #define DEVFS_INODE_MAX CONFIG_DEVFS_INODE_MAX
 
+/* Total memory shared by the sector caches of all block devices */
+#ifndef CONFIG_DEVFS_BLKDEV_CACHE_SIZE
+#define CONFIG_DEVFS_BLKDEV_CACHE_SIZE      4096
+#endif
+
+/* Size of one cache page; devices with larger sectors cache one sector in a page of their own */
+#ifndef CONFIG_DEVFS_BLKDEV_CACHE_PAGE_SIZE
+#define CONFIG_DEVFS_BLKDEV_CACHE_PAGE_SIZE 512
+#endif
+
+#define DEVFS_BLKDEV_CACHE_SIZE         CONFIG_DEVFS_BLKDEV_CACHE_SIZE
+#define DEVFS_BLKDEV_CACHE_PAGE_SIZE    CONFIG_DEVFS_BLKDEV_CACHE_PAGE_SIZE
+#define DEVFS_BLKDEV_CACHE_PAGES        (DEVFS_BLKDEV_CACHE_SIZE / DEVFS_BLKDEV_CACHE_PAGE_SIZE)
+
+/* Alignment of buffers handed to drivers for DMA, a power of two */
+#ifndef CONFIG_DEVFS_DMA_ALIGN
+#if defined(CONFIG_DCACHE_LINE_SIZE) && (CONFIG_DCACHE_LINE_SIZE > 0)
+#define CONFIG_DEVFS_DMA_ALIGN  CONFIG_DCACHE_LINE_SIZE
+#else
+#define CONFIG_DEVFS_DMA_ALIGN  4
+#endif
+#endif
+
+#define DEVFS_DMA_ALIGN         CONFIG_DEVFS_DMA_ALIGN
+#define DEVFS_DMA_ROUND_UP(x)   (((x) + DEVFS_DMA_ALIGN - 1) & ~(DEVFS_DMA_ALIGN - 1))
+
+/* Buffer devfs_copy() and BIOC_READV move block device data through, allocated per call, at least a sector */
+#ifndef CONFIG_DEVFS_BLKDEV_COPY_SIZE
+#define CONFIG_DEVFS_BLKDEV_COPY_SIZE   2048
+#endif
+
+#define DEVFS_BLKDEV_COPY_SIZE  CONFIG_DEVFS_BLKDEV_COPY_SIZE
+
+/* Sectors read ahead of files advised BLKDEV_ADV_SEQUENTIAL */
+#ifndef CONFIG_DEVFS_BLKDEV_READAHEAD
+#define CONFIG_DEVFS_BLKDEV_READAHEAD   2
+#endif
+
+#define DEVFS_BLKDEV_READAHEAD  CONFIG_DEVFS_BLKDEV_READAHEAD
+
+/* Largest device that may be registered with a RAM shadow, in bytes */
+#ifndef CONFIG_DEVFS_BLKDEV_SHADOW_MAX
+#define CONFIG_DEVFS_BLKDEV_SHADOW_MAX  65536
+#endif
+
+#define DEVFS_BLKDEV_SHADOW_MAX CONFIG_DEVFS_BLKDEV_SHADOW_MAX
+
+/* A queued block read or write moves up one priority class per this many ms waited, 0 never */
+#ifndef CONFIG_DEVFS_BLKDEV_IOPRIO_AGING_MS
+#define CONFIG_DEVFS_BLKDEV_IOPRIO_AGING_MS 100
+#endif
+
+#define DEVFS_BLKDEV_IOPRIO_AGING_MS    CONFIG_DEVFS_BLKDEV_IOPRIO_AGING_MS
+
+/* Stack and priority of the thread running background erases */
+#ifndef CONFIG_DEVFS_WORKQ_STACK_SIZE
+#define CONFIG_DEVFS_WORKQ_STACK_SIZE   1024
+#endif
+
+#ifndef CONFIG_DEVFS_WORKQ_PRIORITY
+#define CONFIG_DEVFS_WORKQ_PRIORITY     K_LOWEST_APPLICATION_THREAD_PRIO
+#endif
+
+/* Erase blocks kept erased ahead of a writer in an MTDIOC_PREERASE region */
+#ifndef CONFIG_DEVFS_MTD_PREERASE_AHEAD
+#define CONFIG_DEVFS_MTD_PREERASE_AHEAD 2
+#endif
+
+#define DEVFS_MTD_PREERASE_AHEAD        CONFIG_DEVFS_MTD_PREERASE_AHEAD
+
+/* Erase count spread at which the FTL moves cold data off its least worn block */
+#ifndef CONFIG_DEVFS_BLKDEV_FTL_WEAR_DELTA
+#define CONFIG_DEVFS_BLKDEV_FTL_WEAR_DELTA  16
+#endif
+
+#define DEVFS_BLKDEV_FTL_WEAR_DELTA     CONFIG_DEVFS_BLKDEV_FTL_WEAR_DELTA
+
+/*
+ * Width of block device sector numbers and file offsets. 32-bit sectors
+ * reach 2 TiB with 512 byte sectors but off_t of 32-bit targets stops
+ * at 2 GiB; CONFIG_DEVFS_BLKDEV_64BIT widens both, at the cost of 64-bit
+ * arithmetic on every transfer.
+ */
+#ifdef CONFIG_DEVFS_BLKDEV_64BIT
+typedef uint64_t blkdev_sector_t;
+typedef int64_t devfs_off_t;
+#define DEVFS_OFF_MAX   INT64_MAX
+#else
+typedef uint32_t blkdev_sector_t;
+typedef off_t devfs_off_t;
+#define DEVFS_OFF_MAX   ((off_t)(((uint64_t)1 << (sizeof(off_t) * 8 - 1)) - 1))
+#endif
+
 #include "devfs_list.h"
 #include "devfs_inode.h"
 #include "devfs_dev.h"
@@ -10,9 +10,50 @@
 int devfs_chdev_register(const char *name, const struct devfs_inode_ops *ops, void *data);
 int devfs_chdev_unregister(const char *name);
 
+struct blkdev_config_t {
+    uint32_t sectorsize;    /* Logical sector size, a multiple of the driver's; 0 to use the driver's */
+    uint32_t mergesize;     /* Bytes of write-backs merged into one driver call, 0 for no write-back queue */
+    uint32_t deadline_ms;   /* Longest a dirty sector waits with a write-back queue or shadow, 0 for no limit */
+    bool compare;           /* Skip programming data the device already holds */
+    bool shadow;            /* Keep the whole device in RAM from the first open, see devfs_blkdev.c */
+    uint32_t maxtransfer;   /* Bytes a read or write moves per hold of the device lock, 0 for no limit */
+    struct devfs_inode_t *lower; /* Block device this one is stacked on, whose I/O turns it shares; NULL for none */
+};
+
 int devfs_blkdev_register(const char *name, const struct devfs_blkdev_ops *ops, void *data);
+int devfs_blkdev_register_with_config(const char *name, const struct devfs_blkdev_ops *ops, void *data,
+                                      const struct blkdev_config_t *config);
 int devfs_blkdev_unregister(const char *name);
 
+/* Lets a driver stacked on a registered block device call its driver directly */
+int devfs_blkdev_stack(struct devfs_inode_t *inode, const struct devfs_blkdev_ops **ops);
+int devfs_blkdev_unstack(struct devfs_inode_t *inode);
+
+/* The driver a block device was registered with, NULL if the inode isn't one */
+const struct devfs_blkdev_ops *devfs_blkdev_driver_ops(struct devfs_inode_t *inode);
+
+struct blkdev_partition_t {
+    const char *name;       /* NULL for the parent name followed by "p" and the index from 1 */
+    uint64_t offset;        /* Byte offset in the parent, a multiple of its erase or sector size */
+    uint64_t size;          /* Bytes, 0 for the rest of the parent */
+};
+
+/* Partitions of a registered block device, each with its own cache and lock, see devfs_blkdev_part.c */
+int devfs_blkdev_partition_register(const char *parent, const struct blkdev_partition_t *partitions, int npartitions,
+                                    const struct blkdev_config_t *config);
+int devfs_blkdev_partition_unregister(const char *name);
+
+struct blkdev_ftl_config_t {
+    uint32_t sectorsize;    /* Sector size exposed by the FTL, 0 for 512 bytes */
+    uint32_t seraseblock;   /* First erase block of the MTD device given to the FTL */
+    uint32_t neraseblocks;  /* Erase blocks given to the FTL, 0 for the rest of the device */
+    uint32_t nreserved;     /* Spare erase blocks kept for garbage collection, at least 3 */
+};
+
+/* Wear-leveling flash translation layer stacked on an MTD block device, see devfs_blkdev_ftl.c */
+int devfs_blkdev_ftl_register(const char *name, const char *parent, const struct blkdev_ftl_config_t *config);
+int devfs_blkdev_ftl_unregister(const char *name);
+
 #define _CIOCBASE           (0x0800) /* Character driver ioctl commands */
 #define _BIOCBASE           (0x0900) /* Block driver ioctl commands */
 #define _MTDIOCBASE         (0x0A00) /* MTD ioctl commands */
@@ -39,6 +80,135 @@ struct led_brightness {
 #define BIOC_JEDEC_ID           _IOC(_BIOCBASE, 0x0002)
 #define BIOC_GEOMETRY           _IOC(_BIOCBASE, 0x0003)
 #define BIOC_FLUSH              _IOC(_BIOCBASE, 0x0004)
+#define BIOC_DIRECT             _IOC(_BIOCBASE, 0x0005) /* arg != 0: switch the file to O_DIRECT */
+#define BIOC_STATS              _IOC(_BIOCBASE, 0x0006) /* arg: struct blkdev_stats_t * */
+#define BIOC_STATS_RESET        _IOC(_BIOCBASE, 0x0007)
+#define BIOC_FTL_STATS          _IOC(_BIOCBASE, 0x0008) /* arg: struct blkdev_ftl_stats_t * */
+#define BIOC_SEEK               _IOC(_BIOCBASE, 0x0009) /* arg: struct blkdev_seek_t *, for offsets past off_t */
+#define BIOC_CHECKSUM           _IOC(_BIOCBASE, 0x000A) /* arg: struct blkdev_checksum_t *, fills crc */
+#define BIOC_VERIFY             _IOC(_BIOCBASE, 0x000B) /* arg: struct blkdev_checksum_t *, -EBADMSG if crc differs */
+#define BIOC_STREAM             _IOC(_BIOCBASE, 0x000C) /* arg != 0: put the file in stream mode, one per device */
+#define BIOC_READV              _IOC(_BIOCBASE, 0x000D) /* arg: struct blkdev_readv_t * */
+#define BIOC_ADVISE             _IOC(_BIOCBASE, 0x000E) /* arg: struct blkdev_advise_t * */
+#define BIOC_PIN                _IOC(_BIOCBASE, 0x000F) /* arg: struct blkdev_range_t * */
+#define BIOC_UNPIN              _IOC(_BIOCBASE, 0x0010) /* arg: struct blkdev_range_t * */
+#define BIOC_IOPRIO             _IOC(_BIOCBASE, 0x0011) /* arg: BLKDEV_IOPRIO_* class of the file */
+#define BIOC_COPY               _IOC(_BIOCBASE, 0x0012) /* arg: struct blkdev_copy_t * */
+
+/* Seek through ioctl() where the lseek() of the application has a 32-bit off_t */
+struct blkdev_seek_t {
+    int64_t offset;
+    int whence;
+    int64_t position;           /* Out: new position of the file */
+};
+
+/* CRC32 of a byte range, summed inside the block layer without copying it out */
+struct blkdev_checksum_t {
+    uint64_t offset;            /* Byte offset on the device */
+    uint64_t length;            /* Bytes, 0 for the rest of the device */
+    uint32_t crc;               /* BIOC_CHECKSUM out, BIOC_VERIFY in: devfs_crc32() of the range */
+};
+
+/* Ranges read by one BIOC_READV, in any order; the file position is left alone */
+struct blkdev_iovec_t {
+    uint64_t offset;            /* Byte offset on the device */
+    void *buffer;
+    uint32_t length;
+    uint32_t nread;             /* Out: bytes read, short at the end of the device */
+};
+
+struct blkdev_readv_t {
+    struct blkdev_iovec_t *iov;
+    unsigned int niov;
+};
+
+/* devfs_copy() between two ranges of one device, through its file descriptor; the file position is left alone */
+struct blkdev_copy_t {
+    uint64_t src;               /* Byte offset copied from */
+    uint64_t dst;               /* Byte offset copied to, the ranges must not overlap */
+    uint64_t length;
+    uint64_t copied;            /* Out: bytes copied, short at the end of the device */
+};
+
+/* Access hints of BIOC_ADVISE, as posix_fadvise() */
+#define BLKDEV_ADV_NORMAL       0   /* The file's default: no read-ahead, pages age by use */
+#define BLKDEV_ADV_SEQUENTIAL   1   /* The file reads ahead, pages it has read past are reused first */
+#define BLKDEV_ADV_RANDOM       2   /* The file doesn't read ahead */
+#define BLKDEV_ADV_NOREUSE      3   /* The file gives clean pages back once it has read past them */
+#define BLKDEV_ADV_WILLNEED     4   /* Read the range into the cache now, up to half of the pool */
+#define BLKDEV_ADV_DONTNEED     5   /* Write back the cached pages of the range and give them back */
+
+/*
+ * I/O priority classes of BIOC_IOPRIO. Reads and writes waiting for a
+ * device are served by class, then in arrival order; a waiting request is
+ * promoted one class per CONFIG_DEVFS_BLKDEV_IOPRIO_AGING_MS so that LOW
+ * work still progresses.
+ */
+#define BLKDEV_IOPRIO_NORMAL    0   /* The file's default */
+#define BLKDEV_IOPRIO_HIGH      1   /* Latency sensitive, e.g. a real-time logger */
+#define BLKDEV_IOPRIO_LOW       2   /* Background work, e.g. an upload */
+#define BLKDEV_IOPRIO_CLASSES   3
+
+struct blkdev_advise_t {
+    uint64_t offset;            /* Byte range of WILLNEED and DONTNEED */
+    uint64_t length;            /* Bytes, 0 for the rest of the device */
+    int advice;
+};
+
+/* Sectors of BIOC_PIN stay cached until BIOC_UNPIN, at most half of the pool over all devices */
+struct blkdev_range_t {
+    uint64_t offset;
+    uint64_t length;            /* Bytes, 0 for the rest of the device */
+};
+
+/* CRC-32 as crc32_ieee(), pass 0 to start and the previous result to continue, see devfs_crc32.c */
+uint32_t devfs_crc32(uint32_t crc, const void *data, size_t length);
+
+/* read() and write() calls of one I/O priority class, from entry to return */
+struct blkdev_ioprio_stats_t {
+    uint32_t requests;
+    uint32_t waits;             /* Requests that queued behind another, once or more */
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+struct blkdev_stats_t {
+    uint32_t cache_hits;        /* Sector lookups served from the cache */
+    uint32_t cache_misses;      /* Sector lookups that read the device */
+    uint32_t cache_evictions;   /* Cached sectors given up to make room */
+    uint32_t cache_flushes;     /* Dirty sectors written back */
+    uint64_t flush_bytes;       /* Bytes programmed by write-backs */
+    uint64_t flush_saved_bytes; /* Clean bytes of dirty sectors that write-backs skipped */
+    uint64_t cached_rdbytes;    /* Bytes copied out of the cache */
+    uint64_t cached_wrbytes;    /* Bytes copied into the cache */
+    uint64_t direct_rdbytes;    /* Bytes read by multi-sector transfers */
+    uint64_t direct_wrbytes;    /* Bytes written by multi-sector transfers */
+    uint32_t bounces;           /* Multi-sector transfers that needed a bounce page */
+    uint32_t driver_reads;      /* Calls to devfs_blkdev_ops read */
+    uint32_t driver_writes;     /* Calls to devfs_blkdev_ops write */
+    uint64_t driver_time_us;    /* Time spent in driver read and write calls */
+    uint64_t erased_rdbytes;    /* Bytes of known erased blocks returned without reading the device */
+    uint32_t queue_merges;      /* Write-backs merged into the driver call of another */
+    uint32_t queue_expired;     /* Write-backs forced by the deadline */
+    uint64_t compare_skipped_bytes; /* Compare mode: bytes written that matched the device and weren't programmed */
+    uint64_t compare_changed_bytes; /* Compare mode: bytes written that differed and were programmed */
+    uint32_t stream_erases;     /* Erase blocks erased for stream mode writers */
+    uint32_t readaheads;        /* Sectors read into the cache ahead of use, SEQUENTIAL and WILLNEED */
+    uint32_t shadow_bytes;      /* RAM held by the shadow of a shadowed device, 0 until it is loaded */
+    uint32_t transfer_splits;   /* Reads and writes cut at maxtransfer to let other requests in */
+    struct blkdev_ioprio_stats_t ioprio[BLKDEV_IOPRIO_CLASSES];  /* Indexed by BLKDEV_IOPRIO_* */
+};
+
+struct blkdev_ftl_stats_t {
+    uint32_t host_writes;       /* Sectors written to the FTL */
+    uint32_t flash_writes;      /* Sectors programmed, garbage collection copies included */
+    uint32_t gc_runs;           /* Erase blocks reclaimed */
+    uint32_t gc_copies;         /* Valid sectors moved out of reclaimed blocks */
+    uint32_t wl_moves;          /* Reclaims done only to even out wear */
+    uint32_t erases;            /* Erase operations issued */
+    uint32_t min_erases;        /* Lowest erase count of any block */
+    uint32_t max_erases;        /* Highest erase count of any block */
+};
 
 /* MTD ioctl commands */
 
@@ -46,6 +216,7 @@ struct mtddev_geometry_t {
     unsigned int blocksize;     /* Size of one read/write block. */
     unsigned int erasesize;     /* Size of one erase blocks -- must be a multiple of blocksize. */
     unsigned int neraseblocks;  /* Number of erase blocks */
+    unsigned int erasevalue;    /* Byte value of erased memory, 0xFF unless the driver says otherwise */
 };
 
 struct mtddev_erase_t {
@@ -53,7 +224,53 @@ struct mtddev_erase_t {
     unsigned int neraseblocks; /* Number of erase blocks */
 };
 
+struct mtddev_blankcheck_t {
+    unsigned int seraseblock;  /* Start of erase block */
+    unsigned int neraseblocks; /* Number of erase blocks */
+    unsigned int nblank;       /* Out: number of leading erase blocks found blank */
+};
+
+struct mtddev_erase_ranges_t {
+    const struct mtddev_erase_t *ranges;    /* Ranges erased in order, copied by MTDIOC_ERASE_ASYNC */
+    unsigned int nranges;
+    /*
+     * Async only, may be NULL: called once the request is finished, from
+     * the devfs work queue, or with -ECANCELED from the thread unregistering
+     * the device. No device lock is held, so it may do I/O on the device
+     * stack, but it must not wait for the device's erases to finish.
+     */
+    void (*done)(int result, void *arg);
+    void *arg;
+};
+
+struct mtddev_preerase_t {
+    unsigned int seraseblock;  /* Start of the region about to be rewritten */
+    unsigned int neraseblocks; /* Number of erase blocks in the region */
+    unsigned int nahead;       /* Erase blocks to keep erased ahead of the writer, 0 for the default */
+};
+
+struct mtddev_wear_t {
+    unsigned int seraseblock;  /* Start of erase block */
+    unsigned int neraseblocks; /* Number of erase blocks */
+    uint32_t *erases;          /* Out: erase count of each block */
+};
+
+struct mtddev_sim_stats_t {
+    uint64_t time_us;          /* Time the device spent busy, by its timing model */
+    uint64_t read_bytes;
+    uint64_t program_bytes;
+    uint32_t erases;           /* Erase blocks erased */
+    uint32_t program_faults;   /* Programs that tried to turn a 0 bit back into a 1 */
+};
+
 #define MTDIOC_GEOMETRY         _IOC(_MTDIOCBASE, 0x0001)
 #define MTDIOC_ERASE            _IOC(_MTDIOCBASE, 0x0002)
+#define MTDIOC_BLANKCHECK       _IOC(_MTDIOCBASE, 0x0003) /* arg: struct mtddev_blankcheck_t * */
+#define MTDIOC_ERASE_RANGES     _IOC(_MTDIOCBASE, 0x0004) /* arg: struct mtddev_erase_ranges_t * */
+#define MTDIOC_ERASE_ASYNC      _IOC(_MTDIOCBASE, 0x0005) /* arg: struct mtddev_erase_ranges_t * */
+#define MTDIOC_ERASE_WAIT       _IOC(_MTDIOCBASE, 0x0006) /* Wait for queued erases, returns the first failure */
+#define MTDIOC_PREERASE         _IOC(_MTDIOCBASE, 0x0007) /* arg: struct mtddev_preerase_t *, NULL to stop */
+#define MTDIOC_WEAR             _IOC(_MTDIOCBASE, 0x0008) /* arg: struct mtddev_wear_t * */
+#define MTDIOC_SIM_STATS        _IOC(_MTDIOCBASE, 0x0009) /* arg: struct mtddev_sim_stats_t *, simulated devices only */
 
 #endif/*__DEVFS_DEV_H__*/
@@ -20,9 +20,11 @@ struct devfs_inode_ops {
     int (*open)(struct devfs_file_t *file);
     int (*read)(struct devfs_file_t *file, void *dest, size_t nbytes);
     int (*write)(struct devfs_file_t *file, const void *src, size_t nbytes);
-    int (*lseek)(struct devfs_file_t *file, off_t off, int whence);
+    int (*lseek)(struct devfs_file_t *file, off_t off, int whence);         /* The new position */
     int (*ioctl)(struct devfs_file_t *file, unsigned int cmd, unsigned long arg);
     int (*close)(struct devfs_file_t *file);
+    int (*copy)(struct devfs_file_t *in, struct devfs_file_t *out, size_t nbytes);     /* Both files have these ops */
+    int (*lseek64)(struct devfs_file_t *file, devfs_off_t off, int whence); /* Moves file->offset, 0 on success */
 };
 
 struct devfs_inode_t {
@@ -39,16 +41,19 @@ struct devfs_inode_t {
 
 struct blkdev_geometry_t {
     uint32_t sectorsize;
-    uint32_t nsectors;
+    blkdev_sector_t nsectors;
+    uint32_t alignment;     /* Buffer alignment the driver needs, 0 if any buffer will do */
 };
 
 struct devfs_blkdev_ops {
     int (*open)(struct devfs_inode_t *inode);
-    int (*read)(struct devfs_inode_t *inode, void *dst, uint32_t ssector, uint32_t nsectors);
-    int (*write)(struct devfs_inode_t *inode, const void *src, uint32_t ssector, uint32_t nsectors);
+    int (*read)(struct devfs_inode_t *inode, void *dst, blkdev_sector_t ssector, uint32_t nsectors);
+    int (*write)(struct devfs_inode_t *inode, const void *src, blkdev_sector_t ssector, uint32_t nsectors);
     int (*ioctl)(struct devfs_inode_t *inode, unsigned int cmd, unsigned long arg);
     int (*geometry)(struct devfs_inode_t *inode, struct blkdev_geometry_t *geometry);
     int (*close)(struct devfs_inode_t *inode);
+    /* Optional on-chip copy of sectors that don't overlap, 0 or a negative errno, -ENOTSUP to decline */
+    int (*copy)(struct devfs_inode_t *inode, blkdev_sector_t dsector, blkdev_sector_t ssector, uint32_t nsectors);
 };
 
 int devfs_inode_init(void);
@@ -13,6 +13,12 @@
 #define smp_load_acquire(p)			READ_ONCE(*(p))
 #endif
 
+#ifndef container_of
+#include <stddef.h>
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
 /*
  * These are non-NULL pointers that will result in page faults
  * under normal circumstances, used to verify that nobody uses
@@ -7,6 +7,7 @@
 #ifndef __DEVFS_OS_H__
 #define __DEVFS_OS_H__
 
+#include <zephyr/kernel.h>
 #include <zephyr/sys/printk.h>
 #include <zephyr/sys/mutex.h>
 
@@ -25,6 +26,25 @@ void* devfs_malloc(size_t size);
 
 void  devfs_free(void *mem);
 
+void* devfs_malloc_aligned(size_t align, size_t size);
+
+unsigned int devfs_cycles(void);
+
+unsigned int devfs_cycles_to_us(unsigned int cycles);
+
+unsigned int devfs_uptime_ms(void);
+
+void devfs_yield(void);
+
+/* Thread priorities, a lower value is more urgent */
+typedef k_tid_t devfs_thread_t;
+
+devfs_thread_t devfs_thread_self(void);
+
+int devfs_thread_priority_get(devfs_thread_t thread);
+
+void devfs_thread_priority_set(devfs_thread_t thread, int priority);
+
 #define DEVFS_FOREVER   0xFFFFFFFF
 
 typedef struct k_mutex devfs_mutex_t;
@@ -47,4 +67,17 @@ int devfs_sem_give(devfs_sem_t *sem);
 
 int devfs_sem_free(devfs_sem_t *sem);
 
+/* Work items run one at a time on the devfs worker thread */
+typedef struct k_work devfs_work_t;
+
+typedef void (*devfs_work_handler_t)(devfs_work_t *work);
+
+int devfs_work_init(devfs_work_t *work, devfs_work_handler_t handler);
+
+int devfs_work_submit(devfs_work_t *work);
+
+int devfs_work_flush(devfs_work_t *work);
+
+int devfs_work_cancel(devfs_work_t *work);
+
 #endif/*__DEVFS_OS_H__*/
@@ -7,8 +7,10 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/flash.h>
 #include <zephyr/zephyr.h>
+#include <stdio.h>
 
 #include "devfs.h"
+#include "devfs_os.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(devfs_blkdev_flash);
@@ -18,57 +20,240 @@ LOG_MODULE_REGISTER(devfs_blkdev_flash);
 #endif
 
 #define FLASH_DEV_NAME  "flash"
+#define FLASH_FTL_NAME  "ftl"
 
-static int devfs_blkdev_flash_read(struct devfs_inode_t *inode, void *dst, uint32_t ssector, uint32_t nsectors)
+/* Logical sector size exposed by the block layer, 0 for the write block size */
+#ifndef CONFIG_DEVFS_BLKDEV_FLASH_SECTOR_SIZE
+#define CONFIG_DEVFS_BLKDEV_FLASH_SECTOR_SIZE   0
+#endif
+
+/* Bytes of write-backs merged into one flash write, 0 for no write-back queue */
+#ifndef CONFIG_DEVFS_BLKDEV_FLASH_MERGE_SIZE
+#define CONFIG_DEVFS_BLKDEV_FLASH_MERGE_SIZE    0
+#endif
+
+/* Longest a dirty sector waits in the write-back queue, 0 for no limit */
+#ifndef CONFIG_DEVFS_BLKDEV_FLASH_DEADLINE_MS
+#define CONFIG_DEVFS_BLKDEV_FLASH_DEADLINE_MS   0
+#endif
+
+/* Program only the write blocks whose data changes */
+#ifndef CONFIG_DEVFS_BLKDEV_FLASH_COMPARE
+#define CONFIG_DEVFS_BLKDEV_FLASH_COMPARE       0
+#endif
+
+/* Bytes a read or write moves per hold of the device lock, 0 for no limit */
+#ifndef CONFIG_DEVFS_BLKDEV_FLASH_MAX_TRANSFER
+#define CONFIG_DEVFS_BLKDEV_FLASH_MAX_TRANSFER  0
+#endif
+
+/* Keep partitions no larger than CONFIG_DEVFS_BLKDEV_SHADOW_MAX whole in RAM */
+#ifndef CONFIG_DEVFS_BLKDEV_FLASH_SHADOW
+#define CONFIG_DEVFS_BLKDEV_FLASH_SHADOW        0
+#endif
+
+/* Flash from this offset on is handed to the FTL block device */
+#ifndef CONFIG_DEVFS_BLKDEV_FLASH_FTL_OFFSET
+#define CONFIG_DEVFS_BLKDEV_FLASH_FTL_OFFSET    0
+#endif
+
+/*
+ * Flash pages may differ in size, e.g. 16 KiB sectors followed by 128 KiB
+ * ones. The layout is kept as runs of equally sized pages, searched by
+ * offset, and MTD users see erase blocks of the largest page size, each
+ * erased as the pages it covers.
+ */
+struct devfs_blkdev_flash_region_t {
+    off_t offset;           /* Start of the first page of the run */
+    uint32_t index;         /* Index of the first page of the run */
+    uint32_t npages;
+    uint32_t pagesize;
+};
+
+struct devfs_blkdev_flash_t {
+    const struct device *dev;
+    char name[DEVFS_NAME_MAX + 1];
+    uint32_t blocksize;     /* Write block size, the driver sector size */
+    uint32_t erasesize;     /* Erase block size seen by MTD users, 0 if pages don't line up with it */
+    uint32_t erasevalue;
+    uint32_t npages;
+    uint64_t size;
+
+    uint32_t nregions;
+    struct devfs_blkdev_flash_region_t *regions;
+};
+
+struct devfs_blkdev_flash_scan_t {
+    struct devfs_blkdev_flash_t *disk;
+    size_t pagesize;        /* Size of the previous page */
+};
+
+static int devfs_blkdev_flash_read(struct devfs_inode_t *inode, void *dst, blkdev_sector_t ssector, uint32_t nsectors)
 {
-    const struct device *dev = (const struct device *)inode->private_data;
-    size_t block_size = flash_get_write_block_size(dev);
+    struct devfs_blkdev_flash_t *disk = (struct devfs_blkdev_flash_t *)inode->private_data;
     int retval = 0;
 
-    retval = flash_read(dev, ssector * block_size, dst, nsectors * block_size);
+    retval = flash_read(disk->dev, (off_t)(ssector * disk->blocksize), dst, nsectors * disk->blocksize);
     if (retval < 0) {
-        LOG_ERR("read ssector[%d] nsectors[%d] block_size[%d] fail[%d]", ssector, nsectors, block_size, retval);
+        LOG_ERR("read ssector[%d] nsectors[%d] block_size[%d] fail[%d]", (int)ssector, nsectors, disk->blocksize, retval);
         return retval;
     }
 
-    return (nsectors * block_size);
+    return (nsectors * disk->blocksize);
 }
 
-static int devfs_blkdev_flash_write(struct devfs_inode_t *inode, const void *src, uint32_t ssector, uint32_t nsectors)
+static int devfs_blkdev_flash_write(struct devfs_inode_t *inode, const void *src, blkdev_sector_t ssector, uint32_t nsectors)
 {
-    const struct device *dev = (const struct device *)inode->private_data;
-    size_t block_size = flash_get_write_block_size(dev);
+    struct devfs_blkdev_flash_t *disk = (struct devfs_blkdev_flash_t *)inode->private_data;
     int retval = 0;
 
-    retval = flash_write(dev, ssector * block_size, src, nsectors * block_size);
+    retval = flash_write(disk->dev, (off_t)(ssector * disk->blocksize), src, nsectors * disk->blocksize);
     if (retval < 0) {
-        LOG_ERR("write ssector[%d] nsectors[%d] block_size[%d] fail[%d]", ssector, nsectors, block_size, retval);
+        LOG_ERR("write ssector[%d] nsectors[%d] block_size[%d] fail[%d]", (int)ssector, nsectors, disk->blocksize, retval);
         return retval;
     }
 
-    return (nsectors * block_size);
+    return (nsectors * disk->blocksize);
 }
 
 static int devfs_blkdev_flash_erase(struct devfs_inode_t *inode, uint32_t seraseblock, uint32_t neraseblocks)
 {
-    const struct device *dev = (const struct device *)inode->private_data;
-    struct flash_pages_info pages_info;
+    struct devfs_blkdev_flash_t *disk = (struct devfs_blkdev_flash_t *)inode->private_data;
     int retval = 0;
 
-    flash_get_page_info_by_idx(dev, 0, &pages_info);
+    if ((disk->erasesize == 0) ||
+        ((uint64_t)seraseblock + neraseblocks > disk->size / disk->erasesize)) {
+        return -EINVAL;
+    }
 
-    retval = flash_erase(dev, seraseblock * pages_info.size, neraseblocks * pages_info.size);
+    retval = flash_erase(disk->dev, (off_t)seraseblock * disk->erasesize, (size_t)neraseblocks * disk->erasesize);
     if (retval < 0) {
-        LOG_ERR("erase seraseblock[%d] neraseblocks[%d] page_size[%d] fail[%d]", seraseblock, neraseblocks, pages_info.size, retval);
+        LOG_ERR("erase seraseblock[%d] neraseblocks[%d] erase_size[%d] fail[%d]", seraseblock, neraseblocks, disk->erasesize, retval);
         return retval;
     }
 
     return 0;
 }
 
+/* Find the page holding offset by a binary search of the page runs */
+static int devfs_blkdev_flash_page(struct devfs_blkdev_flash_t *disk, off_t offset, struct flash_pages_info *info)
+{
+    const struct devfs_blkdev_flash_region_t *region = NULL;
+    uint32_t lo = 0;
+    uint32_t hi = disk->nregions;
+    uint32_t page = 0;
+
+    if ((offset < 0) || ((uint64_t)offset >= disk->size)) {
+        return -EINVAL;
+    }
+
+    /* Last run starting at or before offset */
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (disk->regions[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    region = &disk->regions[lo];
+    page = (uint32_t)((offset - region->offset) / region->pagesize);
+
+    info->start_offset = region->offset + (off_t)page * region->pagesize;
+    info->size         = region->pagesize;
+    info->index        = region->index + page;
+
+    return 0;
+}
+
+static bool devfs_blkdev_flash_scan(const struct flash_pages_info *info, void *data)
+{
+    struct devfs_blkdev_flash_scan_t *scan = (struct devfs_blkdev_flash_scan_t *)data;
+    struct devfs_blkdev_flash_t *disk = scan->disk;
+
+    if ((disk->nregions > 0) && (info->size == scan->pagesize)) {
+        if (disk->regions) {
+            disk->regions[disk->nregions - 1].npages++;
+        }
+    } else {
+        if (disk->regions) {
+            disk->regions[disk->nregions].offset   = info->start_offset;
+            disk->regions[disk->nregions].index    = info->index;
+            disk->regions[disk->nregions].npages   = 1;
+            disk->regions[disk->nregions].pagesize = info->size;
+        }
+
+        disk->nregions++;
+        scan->pagesize = info->size;
+    }
+
+    disk->npages++;
+    disk->size += info->size;
+
+    return true;
+}
+
+/* Cache the write block size and index the page layout of the device */
+static int devfs_blkdev_flash_probe(struct devfs_blkdev_flash_t *disk, const struct device *dev)
+{
+    struct devfs_blkdev_flash_scan_t scan = { disk, 0 };
+    uint32_t nregions = 0;
+
+    disk->dev        = dev;
+    disk->blocksize  = flash_get_write_block_size(dev);
+    disk->erasevalue = flash_get_parameters(dev)->erase_value;
+
+    /* The slot may hold what an earlier device left when it failed */
+    disk->regions  = NULL;
+    disk->nregions = 0;
+    disk->npages   = 0;
+    disk->size     = 0;
+
+    /* Count the runs first, then fill them in */
+    flash_page_foreach(dev, devfs_blkdev_flash_scan, &scan);
+    if (disk->nregions == 0) {
+        return -ENODEV;
+    }
+
+    nregions = disk->nregions;
+
+    disk->regions = devfs_malloc(nregions * sizeof(struct devfs_blkdev_flash_region_t));
+    if (disk->regions == NULL) {
+        return -ENOMEM;
+    }
+
+    disk->nregions = 0;
+    disk->npages   = 0;
+    disk->size     = 0;
+
+    flash_page_foreach(dev, devfs_blkdev_flash_scan, &scan);
+
+    disk->erasesize = 0;
+    for (uint32_t i = 0; i < disk->nregions; i++) {
+        disk->erasesize = MAX(disk->erasesize, disk->regions[i].pagesize);
+    }
+
+    /* Every erase block must be a whole number of pages */
+    for (uint32_t i = 0; i < disk->nregions; i++) {
+        if ((disk->erasesize % disk->regions[i].pagesize) ||
+            (disk->regions[i].offset % disk->regions[i].pagesize)) {
+            LOG_WRN("%s: pages don't line up with %u byte erase blocks, erase unsupported", dev->name, disk->erasesize);
+            disk->erasesize = 0;
+            break;
+        }
+    }
+
+    LOG_INF("%s: block_size[%u] pages[%u] in %u runs, erase_size[%u] size[%llu]", dev->name, disk->blocksize,
+            disk->npages, disk->nregions, disk->erasesize, (unsigned long long)disk->size);
+
+    return 0;
+}
+
 static int devfs_blkdev_flash_ioctl(struct devfs_inode_t *inode, unsigned int cmd, unsigned long arg)
 {
-    const struct device *dev = (const struct device *)inode->private_data;
+    struct devfs_blkdev_flash_t *disk = (struct devfs_blkdev_flash_t *)inode->private_data;
     int retval = 0;
 
     switch(cmd) {
@@ -76,7 +261,7 @@ static int devfs_blkdev_flash_ioctl(struct devfs_inode_t *inode, unsigned int cm
     case BIOC_JEDEC_ID: {
         uint8_t *id = (uint8_t *)arg;
 
-        retval = flash_read_jedec_id(dev, id);
+        retval = flash_read_jedec_id(disk->dev, id);
 
         break;
     }
@@ -84,24 +269,21 @@ static int devfs_blkdev_flash_ioctl(struct devfs_inode_t *inode, unsigned int cm
 
     case MTDIOC_GEOMETRY: {
         struct mtddev_geometry_t *geometry = (struct mtddev_geometry_t *)arg;
-        size_t block_size = flash_get_write_block_size(dev);
-        size_t page_count = flash_get_page_count(dev);
-        struct flash_pages_info pages_info;
 
         if (geometry == NULL) {
             retval = -EINVAL;
             break;
         }
 
-        flash_get_page_info_by_idx(dev, 0, &pages_info);
-
-        geometry->blocksize = block_size;
-        geometry->erasesize = pages_info.size;
-        geometry->neraseblocks = page_count;
+        if (disk->erasesize == 0) {
+            retval = -ENOTTY;
+            break;
+        }
 
-        LOG_INF("block_size[%d] page_size[%d] page_count[%d]", block_size, pages_info.size, page_count);
-        LOG_INF("mtddev geometry: blocksize[%u] erasesize[%u] neraseblocks[%u]",
-                geometry->blocksize, geometry->erasesize, geometry->neraseblocks);
+        geometry->blocksize    = disk->blocksize;
+        geometry->erasesize    = disk->erasesize;
+        geometry->neraseblocks = (unsigned int)(disk->size / disk->erasesize);
+        geometry->erasevalue   = disk->erasevalue;
 
         break;
     }
@@ -129,18 +311,10 @@ static int devfs_blkdev_flash_ioctl(struct devfs_inode_t *inode, unsigned int cm
 
 static int devfs_blkdev_flash_geometry(struct devfs_inode_t *inode, struct blkdev_geometry_t *geometry)
 {
-    const struct device *dev = (const struct device *)inode->private_data;
-    size_t block_size = flash_get_write_block_size(dev);
-    size_t page_count = flash_get_page_count(dev);
-    struct flash_pages_info pages_info;
-
-    flash_get_page_info_by_idx(dev, 0, &pages_info);
+    struct devfs_blkdev_flash_t *disk = (struct devfs_blkdev_flash_t *)inode->private_data;
 
-    geometry->sectorsize = block_size;
-    geometry->nsectors   = (pages_info.size / block_size) * page_count;
-
-    LOG_INF("block_size[%d] page_size[%d] page_count[%d]", block_size, pages_info.size, page_count);
-    LOG_INF("blkdev geometry: sectorsize[%u] nsectors[%u]", geometry->sectorsize, geometry->nsectors);
+    geometry->sectorsize = disk->blocksize;
+    geometry->nsectors   = (blkdev_sector_t)(disk->size / disk->blocksize);
 
     return 0;
 }
@@ -152,29 +326,209 @@ static const struct devfs_blkdev_ops devfs_blkdev_flash_ops = {
     .geometry = devfs_blkdev_flash_geometry,
 };
 
-static const struct device *flash = DEVICE_DT_GET_OR_NULL(DT_CHOSEN(zephyr_flash_controller));
+/*
+ * Flash devices known to the devicetree: the chosen flash controller, then
+ * the controllers of the SoC flash banks, SPI NOR chips and, with
+ * CONFIG_DEVFS_BLKDEV_FLASH_PARTITIONS, the devices holding
+ * fixed-partitions. Each is named after its entry in the table, "flash"
+ * for the first and "flash1", "flash2" and so on for the others, so a chip
+ * that fails to probe leaves its name unused rather than passing it on to
+ * the next one. Each has its own block device, cache and lock, so I/O to
+ * different chips doesn't serialize. A device may be listed more than
+ * once; it is registered once, under its first entry.
+ */
+#define FLASH_CONTROLLER(node)          DEVICE_DT_GET(node),
+#define FLASH_CONTROLLER_OF_BANK(node)  DEVICE_DT_GET(DT_PARENT(node)),
+#define FLASH_CONTROLLER_OF_PART(node)  DEVICE_DT_GET(DT_MTD_FROM_FIXED_PARTITION(node)),
+#define FLASH_CONTROLLERS_OF_PARTS(node) DT_FOREACH_CHILD(node, FLASH_CONTROLLER_OF_PART)
+
+static const struct device *const flash_controllers[] = {
+#if DT_HAS_CHOSEN(zephyr_flash_controller)
+    DEVICE_DT_GET(DT_CHOSEN(zephyr_flash_controller)),
+#endif
+    DT_FOREACH_STATUS_OKAY(soc_nv_flash, FLASH_CONTROLLER_OF_BANK)
+#if defined(CONFIG_SPI_NOR)
+    DT_FOREACH_STATUS_OKAY(jedec_spi_nor, FLASH_CONTROLLER)
+#endif
+#if defined(CONFIG_DEVFS_BLKDEV_FLASH_PARTITIONS)
+    DT_FOREACH_STATUS_OKAY(fixed_partitions, FLASH_CONTROLLERS_OF_PARTS)
+#endif
+};
+
+static struct devfs_blkdev_flash_t flash_disks[ARRAY_SIZE(flash_controllers)];
+static int flash_ndisks;
+
+#if defined(CONFIG_DEVFS_BLKDEV_FLASH_PARTITIONS)
+/* Devicetree fixed-partitions, named by their label or "<flash>p<n>" */
+#define FLASH_PARTITION(node)                                       \
+    {                                                               \
+        .mtd = DEVICE_DT_GET(DT_MTD_FROM_FIXED_PARTITION(node)),    \
+        .partition = {                                              \
+            .name   = DT_PROP_OR(node, label, NULL),                \
+            .offset = DT_REG_ADDR(node),                            \
+            .size   = DT_REG_SIZE(node),                            \
+        },                                                          \
+    },
+
+#define FLASH_PARTITIONS(node)  DT_FOREACH_CHILD(node, FLASH_PARTITION)
+
+static const struct {
+    const struct device *mtd;
+    struct blkdev_partition_t partition;
+} flash_partitions[] = {
+    DT_FOREACH_STATUS_OKAY(fixed_partitions, FLASH_PARTITIONS)
+};
+
+static int devfs_blkdev_flash_partitions(struct devfs_blkdev_flash_t *disk, const struct blkdev_config_t *config)
+{
+    struct blkdev_partition_t partition;
+    struct blkdev_config_t pconfig = *config;
+    char name[DEVFS_NAME_MAX + 1];
+    int index = 0;
+    int rc = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(flash_partitions); i++) {
+        if (flash_partitions[i].mtd != disk->dev) {
+            continue;
+        }
+
+        partition = flash_partitions[i].partition;
+        index++;
+
+        if (partition.name == NULL) {
+            snprintf(name, sizeof(name), "%sp%d", disk->name, index);
+            partition.name = name;
+        }
+
+        pconfig.shadow = CONFIG_DEVFS_BLKDEV_FLASH_SHADOW && (partition.size <= DEVFS_BLKDEV_SHADOW_MAX);
+
+        rc = devfs_blkdev_partition_register(disk->name, &partition, 1, &pconfig);
+        if (rc < 0) {
+            LOG_ERR("devfs_blkdev_partition_register(%s) fail[%d]", partition.name, rc);
+            return rc;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+/* Register entry index of the table, unless an earlier entry already registered its device */
+static int devfs_blkdev_flash_add(int index, const struct blkdev_config_t *config)
+{
+    const struct device *dev = flash_controllers[index];
+    struct devfs_blkdev_flash_t *disk = NULL;
+    int rc = 0;
+
+    for (int i = 0; i < flash_ndisks; i++) {
+        if (flash_disks[i].dev == dev) {
+            return 0;
+        }
+    }
+
+    if (!device_is_ready(dev)) {
+        LOG_ERR("flash device %s isn't ready", dev->name);
+        return -ENXIO;
+    }
+
+    disk = &flash_disks[flash_ndisks];
+
+    if (index == 0) {
+        snprintf(disk->name, sizeof(disk->name), "%s", FLASH_DEV_NAME);
+    } else {
+        snprintf(disk->name, sizeof(disk->name), "%s%d", FLASH_DEV_NAME, index);
+    }
+
+    rc = devfs_blkdev_flash_probe(disk, dev);
+    if (rc < 0) {
+        LOG_ERR("%s: page layout fail[%d]", dev->name, rc);
+        return rc;
+    }
+
+    rc = devfs_blkdev_register_with_config(disk->name, &devfs_blkdev_flash_ops, disk, config);
+    if (rc < 0) {
+        LOG_ERR("devfs_blkdev_register(%s) fail[%d]", disk->name, rc);
+        devfs_free(disk->regions);
+        disk->regions = NULL;
+        return rc;
+    }
+
+    flash_ndisks++;
+
+    LOG_INF("devfs_blkdev_register(%s) OK, device %s", disk->name, dev->name);
+
+#if defined(CONFIG_DEVFS_BLKDEV_FLASH_PARTITIONS)
+    rc = devfs_blkdev_flash_partitions(disk, config);
+    if (rc < 0) {
+        return rc;
+    }
+#endif
+
+    return 0;
+}
 
 static int devfs_blkdev_flash_init(const struct device *unused)
 {
     ARG_UNUSED(unused);
 
+    struct blkdev_config_t config = {
+        .sectorsize = CONFIG_DEVFS_BLKDEV_FLASH_SECTOR_SIZE,
+        .mergesize = CONFIG_DEVFS_BLKDEV_FLASH_MERGE_SIZE,
+        .deadline_ms = CONFIG_DEVFS_BLKDEV_FLASH_DEADLINE_MS,
+        .compare = CONFIG_DEVFS_BLKDEV_FLASH_COMPARE,
+        .maxtransfer = CONFIG_DEVFS_BLKDEV_FLASH_MAX_TRANSFER,
+    };
+    int retval = 0;
     int rc = 0;
 
-    if (flash == NULL) {
-        LOG_ERR("flash device isn't ready");
+    /* A device that fails doesn't keep the others from registering */
+    for (int i = 0; i < ARRAY_SIZE(flash_controllers); i++) {
+        rc = devfs_blkdev_flash_add(i, &config);
+        if ((rc < 0) && (retval == 0)) {
+            retval = rc;
+        }
+    }
+
+    if (flash_ndisks == 0) {
+        LOG_ERR("no flash device registered");
         return -ENXIO;
     }
-    LOG_INF("flash device %s is ready", flash->name);
 
-    rc = devfs_blkdev_register(FLASH_DEV_NAME, &devfs_blkdev_flash_ops, (void *)flash);
+#if defined(CONFIG_DEVFS_BLKDEV_FLASH_FTL)
+    /* The FTL takes the tail of "flash", the chosen one if any, and of no other chip */
+    struct devfs_blkdev_flash_t *disk = NULL;
+    struct blkdev_ftl_config_t ftl_config = {0};
+    struct flash_pages_info pages_info;
+
+    for (int i = 0; i < flash_ndisks; i++) {
+        if (flash_disks[i].dev == flash_controllers[0]) {
+            disk = &flash_disks[i];
+        }
+    }
+
+    if (disk == NULL) {
+        LOG_ERR("no %s device for the FTL", FLASH_DEV_NAME);
+        return -ENXIO;
+    }
+
+    rc = devfs_blkdev_flash_page(disk, CONFIG_DEVFS_BLKDEV_FLASH_FTL_OFFSET, &pages_info);
+    if ((rc < 0) || (disk->erasesize == 0) || (pages_info.start_offset % disk->erasesize)) {
+        LOG_ERR("FTL offset[%d] isn't an erase block of the flash", CONFIG_DEVFS_BLKDEV_FLASH_FTL_OFFSET);
+        return -EINVAL;
+    }
+
+    ftl_config.seraseblock = pages_info.start_offset / disk->erasesize;
+
+    rc = devfs_blkdev_ftl_register(FLASH_FTL_NAME, disk->name, &ftl_config);
     if (rc < 0) {
-        LOG_ERR("devfs_blkdev_register(%s) fail[%d]", FLASH_DEV_NAME, rc);
+        LOG_ERR("devfs_blkdev_ftl_register(%s) fail[%d]", FLASH_FTL_NAME, rc);
         return rc;
     }
 
-    LOG_INF("devfs_blkdev_register(%s) OK", FLASH_DEV_NAME);
+    LOG_INF("devfs_blkdev_ftl_register(%s) OK", FLASH_FTL_NAME);
+#endif
 
-    return 0;
+    return retval;
 }
 
 SYS_INIT(devfs_blkdev_flash_init, APPLICATION, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
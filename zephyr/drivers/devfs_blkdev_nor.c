@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2022 tangchunhui@coros.com
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/zephyr.h>
+
+#include "devfs.h"
+#include "devfs_os.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(devfs_blkdev_nor);
+
+/*
+ * Simulated NOR flash in RAM. Erasing sets a block to 0xFF and programming
+ * can only clear bits, like the real thing: a program that needs a 0 turned
+ * back into a 1 leaves the AND of old and new data behind and is counted as
+ * a fault. Every operation is charged to a virtual clock by a simple timing
+ * model, a fixed cost per read plus a cost per byte, a cost per program page
+ * touched and a cost per erase block, so erase and caching strategies can
+ * be compared without hardware. Erases are counted per block for wear.
+ */
+
+#define NOR_DEV_NAME    "nor0"
+#define NOR_FTL_NAME    "norftl"
+
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_WRITE_SIZE
+#define CONFIG_DEVFS_BLKDEV_NOR_WRITE_SIZE      4
+#endif
+
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_PAGE_SIZE
+#define CONFIG_DEVFS_BLKDEV_NOR_PAGE_SIZE       256
+#endif
+
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_ERASE_SIZE
+#define CONFIG_DEVFS_BLKDEV_NOR_ERASE_SIZE      4096
+#endif
+
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_BLOCKS
+#define CONFIG_DEVFS_BLKDEV_NOR_BLOCKS          32
+#endif
+
+/* Logical sector size exposed by the block layer, 0 for the write size */
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_SECTOR_SIZE
+#define CONFIG_DEVFS_BLKDEV_NOR_SECTOR_SIZE     0
+#endif
+
+/* Program only the program units whose data changes */
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_COMPARE
+#define CONFIG_DEVFS_BLKDEV_NOR_COMPARE         0
+#endif
+
+/* Bytes a read or write moves per hold of the device lock, 0 for no limit */
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_MAX_TRANSFER
+#define CONFIG_DEVFS_BLKDEV_NOR_MAX_TRANSFER    0
+#endif
+
+/* Timing model, defaults are those of a common serial NOR part */
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_READ_SETUP_NS
+#define CONFIG_DEVFS_BLKDEV_NOR_READ_SETUP_NS   1000
+#endif
+
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_READ_BYTE_NS
+#define CONFIG_DEVFS_BLKDEV_NOR_READ_BYTE_NS    20
+#endif
+
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_PROGRAM_PAGE_US
+#define CONFIG_DEVFS_BLKDEV_NOR_PROGRAM_PAGE_US 700
+#endif
+
+#ifndef CONFIG_DEVFS_BLKDEV_NOR_ERASE_BLOCK_US
+#define CONFIG_DEVFS_BLKDEV_NOR_ERASE_BLOCK_US  45000
+#endif
+
+struct devfs_blkdev_nor_t {
+    uint8_t *data;
+    uint32_t *erases;       /* Erase count of each block */
+    uint64_t time_ns;       /* Virtual clock */
+    struct mtddev_sim_stats_t stats;
+    struct k_mutex mutex;
+};
+
+static struct devfs_blkdev_nor_t nor;
+
+/* Charge an operation to the virtual clock, and to the real one if asked to */
+static void devfs_blkdev_nor_charge(struct devfs_blkdev_nor_t *disk, uint64_t ns)
+{
+    disk->time_ns += ns;
+
+#if defined(CONFIG_DEVFS_BLKDEV_NOR_REALTIME)
+    k_busy_wait((uint32_t)((ns + 999) / 1000));
+#endif
+}
+
+static int devfs_blkdev_nor_read(struct devfs_inode_t *inode, void *dst, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_nor_t *disk = (struct devfs_blkdev_nor_t *)inode->private_data;
+    uint32_t offset = (uint32_t)ssector * CONFIG_DEVFS_BLKDEV_NOR_WRITE_SIZE;
+    uint32_t length = nsectors * CONFIG_DEVFS_BLKDEV_NOR_WRITE_SIZE;
+
+    k_mutex_lock(&disk->mutex, K_FOREVER);
+
+    memcpy(dst, &disk->data[offset], length);
+
+    disk->stats.read_bytes += length;
+    devfs_blkdev_nor_charge(disk, CONFIG_DEVFS_BLKDEV_NOR_READ_SETUP_NS +
+                                  (uint64_t)length * CONFIG_DEVFS_BLKDEV_NOR_READ_BYTE_NS);
+
+    k_mutex_unlock(&disk->mutex);
+
+    return length;
+}
+
+static int devfs_blkdev_nor_write(struct devfs_inode_t *inode, const void *src, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_nor_t *disk = (struct devfs_blkdev_nor_t *)inode->private_data;
+    uint32_t offset = (uint32_t)ssector * CONFIG_DEVFS_BLKDEV_NOR_WRITE_SIZE;
+    uint32_t length = nsectors * CONFIG_DEVFS_BLKDEV_NOR_WRITE_SIZE;
+    const uint8_t *buffer = src;
+    uint32_t npages = 0;
+    bool fault = false;
+
+    k_mutex_lock(&disk->mutex, K_FOREVER);
+
+    for (uint32_t i = 0; i < length; i++) {
+        if (buffer[i] & ~disk->data[offset + i]) {
+            fault = true;
+        }
+
+        disk->data[offset + i] &= buffer[i];
+    }
+
+    if (fault) {
+        LOG_WRN("program over unerased bits, offset[%u] length[%u]", offset, length);
+        disk->stats.program_faults++;
+    }
+
+    npages = (offset + length - 1) / CONFIG_DEVFS_BLKDEV_NOR_PAGE_SIZE - offset / CONFIG_DEVFS_BLKDEV_NOR_PAGE_SIZE + 1;
+
+    disk->stats.program_bytes += length;
+    devfs_blkdev_nor_charge(disk, (uint64_t)npages * CONFIG_DEVFS_BLKDEV_NOR_PROGRAM_PAGE_US * 1000);
+
+    k_mutex_unlock(&disk->mutex);
+
+    return fault ? -EIO : length;
+}
+
+static int devfs_blkdev_nor_ioctl(struct devfs_inode_t *inode, unsigned int cmd, unsigned long arg)
+{
+    struct devfs_blkdev_nor_t *disk = (struct devfs_blkdev_nor_t *)inode->private_data;
+    int retval = 0;
+
+    switch(cmd) {
+    case MTDIOC_GEOMETRY: {
+        struct mtddev_geometry_t *geometry = (struct mtddev_geometry_t *)arg;
+
+        if (geometry == NULL) {
+            retval = -EINVAL;
+            break;
+        }
+
+        geometry->blocksize = CONFIG_DEVFS_BLKDEV_NOR_WRITE_SIZE;
+        geometry->erasesize = CONFIG_DEVFS_BLKDEV_NOR_ERASE_SIZE;
+        geometry->neraseblocks = CONFIG_DEVFS_BLKDEV_NOR_BLOCKS;
+        geometry->erasevalue = 0xFF;
+
+        break;
+    }
+
+    case MTDIOC_ERASE: {
+        struct mtddev_erase_t *erase = (struct mtddev_erase_t *)arg;
+
+        if ((erase == NULL) ||
+            (erase->seraseblock >= CONFIG_DEVFS_BLKDEV_NOR_BLOCKS) ||
+            (erase->neraseblocks > CONFIG_DEVFS_BLKDEV_NOR_BLOCKS - erase->seraseblock)) {
+            retval = -EINVAL;
+            break;
+        }
+
+        k_mutex_lock(&disk->mutex, K_FOREVER);
+
+        memset(&disk->data[erase->seraseblock * CONFIG_DEVFS_BLKDEV_NOR_ERASE_SIZE], 0xFF,
+               erase->neraseblocks * CONFIG_DEVFS_BLKDEV_NOR_ERASE_SIZE);
+
+        for (uint32_t i = 0; i < erase->neraseblocks; i++) {
+            disk->erases[erase->seraseblock + i]++;
+        }
+
+        disk->stats.erases += erase->neraseblocks;
+        devfs_blkdev_nor_charge(disk, (uint64_t)erase->neraseblocks * CONFIG_DEVFS_BLKDEV_NOR_ERASE_BLOCK_US * 1000);
+
+        k_mutex_unlock(&disk->mutex);
+
+        break;
+    }
+
+    case MTDIOC_WEAR: {
+        struct mtddev_wear_t *wear = (struct mtddev_wear_t *)arg;
+
+        if ((wear == NULL) || (wear->erases == NULL) ||
+            (wear->seraseblock >= CONFIG_DEVFS_BLKDEV_NOR_BLOCKS) ||
+            (wear->neraseblocks > CONFIG_DEVFS_BLKDEV_NOR_BLOCKS - wear->seraseblock)) {
+            retval = -EINVAL;
+            break;
+        }
+
+        k_mutex_lock(&disk->mutex, K_FOREVER);
+        memcpy(wear->erases, &disk->erases[wear->seraseblock], wear->neraseblocks * sizeof(uint32_t));
+        k_mutex_unlock(&disk->mutex);
+
+        break;
+    }
+
+    case MTDIOC_SIM_STATS: {
+        struct mtddev_sim_stats_t *stats = (struct mtddev_sim_stats_t *)arg;
+
+        if (stats == NULL) {
+            retval = -EINVAL;
+            break;
+        }
+
+        k_mutex_lock(&disk->mutex, K_FOREVER);
+        disk->stats.time_us = disk->time_ns / 1000;
+        memcpy(stats, &disk->stats, sizeof(struct mtddev_sim_stats_t));
+        k_mutex_unlock(&disk->mutex);
+
+        break;
+    }
+
+    default:
+        retval = -ENOTTY;
+        break;
+    }
+
+    return retval;
+}
+
+static int devfs_blkdev_nor_geometry(struct devfs_inode_t *inode, struct blkdev_geometry_t *geometry)
+{
+    geometry->sectorsize = CONFIG_DEVFS_BLKDEV_NOR_WRITE_SIZE;
+    geometry->nsectors   = (CONFIG_DEVFS_BLKDEV_NOR_ERASE_SIZE / CONFIG_DEVFS_BLKDEV_NOR_WRITE_SIZE) *
+                           CONFIG_DEVFS_BLKDEV_NOR_BLOCKS;
+    geometry->alignment  = 0;
+
+    return 0;
+}
+
+static const struct devfs_blkdev_ops devfs_blkdev_nor_ops = {
+    .read     = devfs_blkdev_nor_read,
+    .write    = devfs_blkdev_nor_write,
+    .ioctl    = devfs_blkdev_nor_ioctl,
+    .geometry = devfs_blkdev_nor_geometry,
+};
+
+static int devfs_blkdev_nor_init(const struct device *unused)
+{
+    ARG_UNUSED(unused);
+
+    struct blkdev_config_t config = {
+        .sectorsize = CONFIG_DEVFS_BLKDEV_NOR_SECTOR_SIZE,
+        .compare = CONFIG_DEVFS_BLKDEV_NOR_COMPARE,
+        .maxtransfer = CONFIG_DEVFS_BLKDEV_NOR_MAX_TRANSFER,
+    };
+    size_t size = (size_t)CONFIG_DEVFS_BLKDEV_NOR_ERASE_SIZE * CONFIG_DEVFS_BLKDEV_NOR_BLOCKS;
+    int rc = 0;
+
+    nor.data = devfs_malloc_aligned(DEVFS_DMA_ALIGN, size);
+    nor.erases = devfs_malloc(CONFIG_DEVFS_BLKDEV_NOR_BLOCKS * sizeof(uint32_t));
+    if ((nor.data == NULL) || (nor.erases == NULL)) {
+        LOG_ERR("malloc size[%zu] fail", size);
+        return -ENOMEM;
+    }
+
+    /* Shipped erased */
+    memset(nor.data, 0xFF, size);
+    memset(nor.erases, 0x00, CONFIG_DEVFS_BLKDEV_NOR_BLOCKS * sizeof(uint32_t));
+    k_mutex_init(&nor.mutex);
+
+    rc = devfs_blkdev_register_with_config(NOR_DEV_NAME, &devfs_blkdev_nor_ops, &nor, &config);
+    if (rc < 0) {
+        LOG_ERR("devfs_blkdev_register(%s) fail[%d]", NOR_DEV_NAME, rc);
+        return rc;
+    }
+
+    LOG_INF("devfs_blkdev_register(%s) OK", NOR_DEV_NAME);
+
+#if defined(CONFIG_DEVFS_BLKDEV_NOR_FTL)
+    rc = devfs_blkdev_ftl_register(NOR_FTL_NAME, NOR_DEV_NAME, NULL);
+    if (rc < 0) {
+        LOG_ERR("devfs_blkdev_ftl_register(%s) fail[%d]", NOR_FTL_NAME, rc);
+        return rc;
+    }
+
+    LOG_INF("devfs_blkdev_ftl_register(%s) OK", NOR_FTL_NAME);
+#endif
+
+    return 0;
+}
+
+SYS_INIT(devfs_blkdev_nor_init, APPLICATION, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2022 tangchunhui@coros.com
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/zephyr.h>
+
+#include "devfs.h"
+#include "devfs_os.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(devfs_blkdev_ram);
+
+/*
+ * RAM disk: a block device with no erase and no program constraints. With
+ * the latencies left at 0 it costs a memcpy per transfer, which makes it the
+ * baseline for measuring the block layer itself.
+ */
+
+#define RAM_DEV_NAME    "ram0"
+
+#ifndef CONFIG_DEVFS_BLKDEV_RAM_SECTOR_SIZE
+#define CONFIG_DEVFS_BLKDEV_RAM_SECTOR_SIZE     512
+#endif
+
+#ifndef CONFIG_DEVFS_BLKDEV_RAM_SECTORS
+#define CONFIG_DEVFS_BLKDEV_RAM_SECTORS         128
+#endif
+
+/* Busy wait added to every driver call, emulating a slower device */
+#ifndef CONFIG_DEVFS_BLKDEV_RAM_READ_LATENCY_US
+#define CONFIG_DEVFS_BLKDEV_RAM_READ_LATENCY_US     0
+#endif
+
+#ifndef CONFIG_DEVFS_BLKDEV_RAM_WRITE_LATENCY_US
+#define CONFIG_DEVFS_BLKDEV_RAM_WRITE_LATENCY_US    0
+#endif
+
+#if defined(CONFIG_DEVFS_BLKDEV_RAM_MMAP)
+/* Host side, see devfs_blkdev_ram_native.c */
+void *devfs_blkdev_ram_native_map(const char *path, size_t size);
+#endif
+
+struct devfs_blkdev_ram_t {
+    uint8_t *data;
+    uint32_t sectorsize;
+    uint32_t nsectors;
+};
+
+static struct devfs_blkdev_ram_t ram = {
+    .sectorsize = CONFIG_DEVFS_BLKDEV_RAM_SECTOR_SIZE,
+    .nsectors   = CONFIG_DEVFS_BLKDEV_RAM_SECTORS,
+};
+
+static int devfs_blkdev_ram_read(struct devfs_inode_t *inode, void *dst, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_ram_t *disk = (struct devfs_blkdev_ram_t *)inode->private_data;
+
+    if (CONFIG_DEVFS_BLKDEV_RAM_READ_LATENCY_US > 0) {
+        k_busy_wait(CONFIG_DEVFS_BLKDEV_RAM_READ_LATENCY_US);
+    }
+
+    memcpy(dst, &disk->data[(size_t)ssector * disk->sectorsize], nsectors * disk->sectorsize);
+
+    return (nsectors * disk->sectorsize);
+}
+
+static int devfs_blkdev_ram_write(struct devfs_inode_t *inode, const void *src, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_ram_t *disk = (struct devfs_blkdev_ram_t *)inode->private_data;
+
+    if (CONFIG_DEVFS_BLKDEV_RAM_WRITE_LATENCY_US > 0) {
+        k_busy_wait(CONFIG_DEVFS_BLKDEV_RAM_WRITE_LATENCY_US);
+    }
+
+    memcpy(&disk->data[(size_t)ssector * disk->sectorsize], src, nsectors * disk->sectorsize);
+
+    return (nsectors * disk->sectorsize);
+}
+
+/* On-chip copy for devfs_copy(): one memcpy, no bounce through the block layer */
+static int devfs_blkdev_ram_copy(struct devfs_inode_t *inode, blkdev_sector_t dsector, blkdev_sector_t ssector, uint32_t nsectors)
+{
+    struct devfs_blkdev_ram_t *disk = (struct devfs_blkdev_ram_t *)inode->private_data;
+
+    if (CONFIG_DEVFS_BLKDEV_RAM_WRITE_LATENCY_US > 0) {
+        k_busy_wait(CONFIG_DEVFS_BLKDEV_RAM_WRITE_LATENCY_US);
+    }
+
+    memcpy(&disk->data[(size_t)dsector * disk->sectorsize], &disk->data[(size_t)ssector * disk->sectorsize],
+           (size_t)nsectors * disk->sectorsize);
+
+    return 0;
+}
+
+static int devfs_blkdev_ram_ioctl(struct devfs_inode_t *inode, unsigned int cmd, unsigned long arg)
+{
+    return -ENOTTY;
+}
+
+static int devfs_blkdev_ram_geometry(struct devfs_inode_t *inode, struct blkdev_geometry_t *geometry)
+{
+    struct devfs_blkdev_ram_t *disk = (struct devfs_blkdev_ram_t *)inode->private_data;
+
+    geometry->sectorsize = disk->sectorsize;
+    geometry->nsectors   = disk->nsectors;
+    geometry->alignment  = 0;
+
+    return 0;
+}
+
+static const struct devfs_blkdev_ops devfs_blkdev_ram_ops = {
+    .read     = devfs_blkdev_ram_read,
+    .write    = devfs_blkdev_ram_write,
+    .ioctl    = devfs_blkdev_ram_ioctl,
+    .geometry = devfs_blkdev_ram_geometry,
+    .copy     = devfs_blkdev_ram_copy,
+};
+
+static int devfs_blkdev_ram_init(const struct device *unused)
+{
+    ARG_UNUSED(unused);
+
+    size_t size = (size_t)ram.sectorsize * ram.nsectors;
+    int rc = 0;
+
+#if defined(CONFIG_DEVFS_BLKDEV_RAM_MMAP)
+    ram.data = devfs_blkdev_ram_native_map(CONFIG_DEVFS_BLKDEV_RAM_FILE, size);
+    if (ram.data == NULL) {
+        LOG_ERR("mmap %s size[%zu] fail", CONFIG_DEVFS_BLKDEV_RAM_FILE, size);
+        return -EIO;
+    }
+#else
+    ram.data = devfs_malloc_aligned(DEVFS_DMA_ALIGN, size);
+    if (ram.data == NULL) {
+        LOG_ERR("malloc size[%zu] fail", size);
+        return -ENOMEM;
+    }
+
+    memset(ram.data, 0x00, size);
+#endif
+
+    rc = devfs_blkdev_register(RAM_DEV_NAME, &devfs_blkdev_ram_ops, &ram);
+    if (rc < 0) {
+        LOG_ERR("devfs_blkdev_register(%s) fail[%d]", RAM_DEV_NAME, rc);
+        return rc;
+    }
+
+    LOG_INF("devfs_blkdev_register(%s) OK, sectorsize[%u] nsectors[%u]", RAM_DEV_NAME, ram.sectorsize, ram.nsectors);
+
+    return 0;
+}
+
+SYS_INIT(devfs_blkdev_ram_init, APPLICATION, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2022 tangchunhui@coros.com
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Host side of the RAM disk on native boards: built against the host C
+ * library, so it must not include any Zephyr header.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Map the file at path as the disk, creating it or growing it with zeros */
+void *devfs_blkdev_ram_native_map(const char *path, size_t size)
+{
+    void *mem = NULL;
+    int fd = 0;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (mem == MAP_FAILED) ? NULL : mem;
+}
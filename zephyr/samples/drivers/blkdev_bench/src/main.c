@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2022 tangchunhui@coros.com
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "devfs.h"
+
+#define BENCH_NAME      CONFIG_BLKDEV_BENCH_DEVICE
+#define BENCH_OFFSET    CONFIG_BLKDEV_BENCH_OFFSET
+#define BENCH_SIZE      CONFIG_BLKDEV_BENCH_SIZE
+#define BENCH_CHUNK     CONFIG_BLKDEV_BENCH_CHUNK
+#define BENCH_RANDOM_COUNT  CONFIG_BLKDEV_BENCH_RANDOM_COUNT
+#define BENCH_RANDOM_SIZE   CONFIG_BLKDEV_BENCH_RANDOM_SIZE
+#define BENCH_FTL_WRITES    CONFIG_BLKDEV_BENCH_FTL_WRITES
+#define BENCH_LATENCY_COUNT CONFIG_BLKDEV_BENCH_LATENCY_COUNT
+#define BENCH_BULK_SIZE     CONFIG_BLKDEV_BENCH_BULK_SIZE
+
+int ioctl(int fd, unsigned long request, ...);
+
+static uint8_t buffer[BENCH_CHUNK] __aligned(4);
+
+static uint8_t bulk[BENCH_BULK_SIZE] __aligned(4);
+static uint32_t latency[BENCH_LATENCY_COUNT];
+static volatile bool bulk_stop;
+static struct k_thread bulk_thread;
+static K_THREAD_STACK_DEFINE(bulk_stack, 2048);
+
+static int bench_erase(int fd)
+{
+    struct mtddev_geometry_t geometry = {0};
+    struct mtddev_erase_t erase;
+    int retval = 0;
+
+    retval = ioctl(fd, MTDIOC_GEOMETRY, &geometry);
+    if (retval < 0) {
+        /* Not an MTD device, nothing to erase */
+        return 0;
+    }
+
+    erase.seraseblock  = BENCH_OFFSET / geometry.erasesize;
+    erase.neraseblocks = (BENCH_SIZE + geometry.erasesize - 1) / geometry.erasesize;
+
+    return ioctl(fd, MTDIOC_ERASE, &erase);
+}
+
+static int bench_pass(int fd, bool write_pass)
+{
+    int64_t start = 0;
+    int retval = 0;
+
+    retval = lseek(fd, BENCH_OFFSET, SEEK_SET);
+    if (retval != BENCH_OFFSET) {
+        printk("lseek(%d, %u, SEEK_SET) fail[%d]. \r\n", fd, BENCH_OFFSET, retval);
+        return -EIO;
+    }
+
+    start = k_uptime_get();
+
+    for (size_t done = 0; done < BENCH_SIZE; done += BENCH_CHUNK) {
+        if (write_pass) {
+            memset(buffer, (uint8_t)(done / BENCH_CHUNK), sizeof(buffer));
+            retval = write(fd, buffer, sizeof(buffer));
+        } else {
+            retval = read(fd, buffer, sizeof(buffer));
+        }
+
+        if (retval != sizeof(buffer)) {
+            printk("%s(%d, %p, %zu) fail[%d]. \r\n", write_pass ? "write" : "read", fd, buffer, sizeof(buffer), retval);
+            return -EIO;
+        }
+    }
+
+    if (write_pass) {
+        ioctl(fd, BIOC_FLUSH, 0);
+    }
+
+    return (int)(k_uptime_get() - start);
+}
+
+static int bench_random_pass(int fd)
+{
+    uint32_t seed = 0x12345678;
+    int64_t start = 0;
+    off_t offset = 0;
+    int retval = 0;
+
+    start = k_uptime_get();
+
+    for (int i = 0; i < BENCH_RANDOM_COUNT; i++) {
+        seed = seed * 1103515245 + 12345;
+        offset = BENCH_OFFSET + (seed % (BENCH_SIZE - BENCH_RANDOM_SIZE));
+
+        retval = lseek(fd, offset, SEEK_SET);
+        if (retval != offset) {
+            printk("lseek(%d, %ld, SEEK_SET) fail[%d]. \r\n", fd, (long)offset, retval);
+            return -EIO;
+        }
+
+        retval = read(fd, buffer, BENCH_RANDOM_SIZE);
+        if (retval != BENCH_RANDOM_SIZE) {
+            printk("read(%d, %p, %d) fail[%d]. \r\n", fd, buffer, BENCH_RANDOM_SIZE, retval);
+            return -EIO;
+        }
+    }
+
+    return (int)(k_uptime_get() - start);
+}
+
+/* Rewrite random sectors of an FTL device and report write amplification and wear */
+static void bench_ftl(int fd)
+{
+    struct blkdev_geometry_t geometry = {0};
+    struct blkdev_ftl_stats_t before = {0};
+    struct blkdev_ftl_stats_t after = {0};
+    uint32_t seed = 0x87654321;
+    uint32_t nsectors = 0;
+    uint32_t host = 0;
+    uint32_t flash = 0;
+    int64_t start = 0;
+    off_t offset = 0;
+    int ms = 0;
+    int retval = 0;
+
+    if ((ioctl(fd, BIOC_FTL_STATS, &before) < 0) ||
+        (ioctl(fd, BIOC_GEOMETRY, &geometry) < 0)) {
+        /* Not an FTL device */
+        return;
+    }
+
+    nsectors = BENCH_SIZE / geometry.sectorsize;
+
+    start = k_uptime_get();
+
+    for (int i = 0; i < BENCH_FTL_WRITES; i++) {
+        seed = seed * 1103515245 + 12345;
+        offset = BENCH_OFFSET + (off_t)(seed % nsectors) * geometry.sectorsize;
+
+        memset(buffer, (uint8_t)i, geometry.sectorsize);
+
+        retval = lseek(fd, offset, SEEK_SET);
+        if (retval == offset) {
+            retval = write(fd, buffer, geometry.sectorsize);
+        }
+
+        if (retval != geometry.sectorsize) {
+            printk("ftl rewrite at %ld fail[%d]. \r\n", (long)offset, retval);
+            return;
+        }
+    }
+
+    ioctl(fd, BIOC_FLUSH, 0);
+
+    ms = (int)(k_uptime_get() - start);
+
+    ioctl(fd, BIOC_FTL_STATS, &after);
+
+    host  = after.host_writes - before.host_writes;
+    flash = after.flash_writes - before.flash_writes;
+
+    printk("ftl: %u random sector rewrites in %d ms (%d KiB/s). \r\n",
+           BENCH_FTL_WRITES, ms, (BENCH_FTL_WRITES * geometry.sectorsize / 1024) * 1000 / MAX(ms, 1));
+    printk("ftl: write amplification %u.%02u, %u erases, %u gc copies, %u wear moves, erase count %u..%u. \r\n",
+           flash / MAX(host, 1), (flash % MAX(host, 1)) * 100 / MAX(host, 1),
+           after.erases - before.erases, after.gc_copies - before.gc_copies,
+           after.wl_moves - before.wl_moves, after.min_erases, after.max_erases);
+}
+
+/* Busy time of a simulated device by its own timing model, -1 for real devices */
+static int64_t bench_device_us(int fd)
+{
+    struct mtddev_sim_stats_t stats = {0};
+
+    if (ioctl(fd, MTDIOC_SIM_STATS, &stats) < 0) {
+        return -1;
+    }
+
+    return (int64_t)stats.time_us;
+}
+
+/* Erase counts of every block of an MTD device that keeps them */
+static void bench_wear(int fd)
+{
+    struct mtddev_geometry_t geometry = {0};
+    struct mtddev_wear_t wear = {0};
+    uint32_t erases[32];
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+    uint64_t total = 0;
+
+    if (ioctl(fd, MTDIOC_GEOMETRY, &geometry) < 0) {
+        return;
+    }
+
+    wear.erases = erases;
+
+    for (wear.seraseblock = 0; wear.seraseblock < geometry.neraseblocks; wear.seraseblock += wear.neraseblocks) {
+        wear.neraseblocks = MIN(ARRAY_SIZE(erases), geometry.neraseblocks - wear.seraseblock);
+
+        if (ioctl(fd, MTDIOC_WEAR, &wear) < 0) {
+            return;
+        }
+
+        for (int i = 0; i < wear.neraseblocks; i++) {
+            min = MIN(min, erases[i]);
+            max = MAX(max, erases[i]);
+            total += erases[i];
+        }
+    }
+
+    printk("wear: %u blocks, %u erases, erase count %u..%u. \r\n",
+           geometry.neraseblocks, (uint32_t)total, min, max);
+}
+
+/* Lower priority thread rewriting the region in BENCH_BULK_SIZE writes, like a DFU download */
+static void bench_bulk_writer(void *p1, void *p2, void *p3)
+{
+    int fd = 0;
+    int retval = 0;
+
+    fd = open(BENCH_NAME, O_RDWR);
+    if (fd < 0) {
+        printk("bulk: open(%s) fail. \r\n", BENCH_NAME);
+        return;
+    }
+
+    ioctl(fd, BIOC_IOPRIO, BLKDEV_IOPRIO_LOW);
+
+    while (!bulk_stop) {
+        /* Each pass erases the blocks again as it reaches them; fails harmlessly without erase blocks */
+        ioctl(fd, BIOC_STREAM, 0);
+        ioctl(fd, BIOC_STREAM, 1);
+
+        lseek(fd, BENCH_OFFSET, SEEK_SET);
+
+        for (size_t done = 0; (done + BENCH_BULK_SIZE <= BENCH_SIZE) && !bulk_stop; done += BENCH_BULK_SIZE) {
+            memset(bulk, (uint8_t)(done / BENCH_BULK_SIZE), sizeof(bulk));
+
+            retval = write(fd, bulk, sizeof(bulk));
+            if (retval != sizeof(bulk)) {
+                printk("bulk: write fail[%d]. \r\n", retval);
+                bulk_stop = true;
+            }
+        }
+    }
+
+    close(fd);
+}
+
+/* Average and worst latency of a class between two BIOC_STATS snapshots */
+static void bench_class(const char *name, const struct blkdev_ioprio_stats_t *before, const struct blkdev_ioprio_stats_t *after)
+{
+    uint32_t requests = after->requests - before->requests;
+
+    printk("latency: %s class, %u requests, %u waited, avg %u us, max %u us. \r\n", name, requests,
+           after->waits - before->waits, (uint32_t)((after->total_us - before->total_us) / MAX(requests, 1)),
+           after->max_us);
+}
+
+/*
+ * Small random reads of a higher priority thread while a bulk writer keeps
+ * the device busy, the reads in the HIGH I/O class and the writes in LOW.
+ */
+static void bench_latency(int fd)
+{
+    struct blkdev_stats_t before = {0};
+    struct blkdev_stats_t after = {0};
+    uint32_t seed = 0x2468ace0;
+    uint32_t start = 0;
+    uint32_t value = 0;
+    off_t offset = 0;
+    int retval = 0;
+    int i = 0;
+    int j = 0;
+
+    ioctl(fd, BIOC_IOPRIO, BLKDEV_IOPRIO_HIGH);
+    ioctl(fd, BIOC_STATS, &before);
+
+    bulk_stop = false;
+    k_thread_create(&bulk_thread, bulk_stack, K_THREAD_STACK_SIZEOF(bulk_stack), bench_bulk_writer,
+                    NULL, NULL, NULL, k_thread_priority_get(k_current_get()) + 1, 0, K_NO_WAIT);
+
+    for (i = 0; i < BENCH_LATENCY_COUNT; i++) {
+        k_msleep(1);
+
+        seed = seed * 1103515245 + 12345;
+        offset = BENCH_OFFSET + (seed % (BENCH_SIZE - BENCH_RANDOM_SIZE));
+
+        start = k_cycle_get_32();
+
+        retval = lseek(fd, offset, SEEK_SET);
+        if (retval == offset) {
+            retval = read(fd, buffer, BENCH_RANDOM_SIZE);
+        }
+
+        latency[i] = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+        if ((retval != BENCH_RANDOM_SIZE) || bulk_stop) {
+            printk("latency: read at %ld fail[%d]. \r\n", (long)offset, retval);
+            break;
+        }
+    }
+
+    bulk_stop = true;
+    k_thread_join(&bulk_thread, K_FOREVER);
+
+    ioctl(fd, BIOC_IOPRIO, BLKDEV_IOPRIO_NORMAL);
+
+    if (i < BENCH_LATENCY_COUNT) {
+        return;
+    }
+
+    ioctl(fd, BIOC_STATS, &after);
+
+    /* Insertion sort, the samples are few */
+    for (i = 1; i < BENCH_LATENCY_COUNT; i++) {
+        value = latency[i];
+        for (j = i; (j > 0) && (latency[j - 1] > value); j--) {
+            latency[j] = latency[j - 1];
+        }
+        latency[j] = value;
+    }
+
+    printk("latency: %u reads of %u bytes under %u byte writes, p50 %u us, p99 %u us, max %u us, %u splits. \r\n",
+           BENCH_LATENCY_COUNT, BENCH_RANDOM_SIZE, BENCH_BULK_SIZE,
+           latency[BENCH_LATENCY_COUNT / 2], latency[BENCH_LATENCY_COUNT * 99 / 100], latency[BENCH_LATENCY_COUNT - 1],
+           after.transfer_splits - before.transfer_splits);
+
+    bench_class("high", &before.ioprio[BLKDEV_IOPRIO_HIGH], &after.ioprio[BLKDEV_IOPRIO_HIGH]);
+    bench_class("low", &before.ioprio[BLKDEV_IOPRIO_LOW], &after.ioprio[BLKDEV_IOPRIO_LOW]);
+}
+
+static void bench_geometry(int fd)
+{
+    struct blkdev_geometry_t geometry = {0};
+
+    if (ioctl(fd, BIOC_GEOMETRY, &geometry) == 0) {
+        printk("sectorsize[%u] nsectors[%u]. \r\n", geometry.sectorsize, (uint32_t)geometry.nsectors);
+    }
+}
+
+/* Write the same data again without erasing, for devices in compare mode */
+static void bench_rewrite(int fd, bool direct)
+{
+    struct blkdev_stats_t before = {0};
+    struct blkdev_stats_t after = {0};
+    int wrms = 0;
+
+    if ((ioctl(fd, BIOC_STATS, &before) < 0) || (before.compare_changed_bytes == 0)) {
+        /* Compare mode is off, the data would be programmed twice */
+        return;
+    }
+
+    wrms = bench_pass(fd, true);
+    if ((wrms < 0) || (ioctl(fd, BIOC_STATS, &after) < 0)) {
+        return;
+    }
+
+    printk("%s: rewrite of unchanged data %d ms, %u bytes skipped, %u bytes programmed. \r\n",
+           direct ? "O_DIRECT" : "cached", wrms,
+           (uint32_t)(after.compare_skipped_bytes - before.compare_skipped_bytes),
+           (uint32_t)(after.compare_changed_bytes - before.compare_changed_bytes));
+}
+
+/* Copy the bench range behind itself with BIOC_COPY and compare the checksums of both */
+static void bench_copy(int fd)
+{
+    struct blkdev_geometry_t geometry = {0};
+    struct mtddev_geometry_t mtdgeometry = {0};
+    struct mtddev_erase_t erase;
+    struct blkdev_copy_t copy = {0};
+    struct blkdev_checksum_t src = {0};
+    struct blkdev_checksum_t dst = {0};
+    uint64_t offset = BENCH_OFFSET + BENCH_SIZE;
+    int64_t start = 0;
+    int retval = 0;
+
+    if (ioctl(fd, MTDIOC_GEOMETRY, &mtdgeometry) == 0) {
+        /* The copy lands on whole erase blocks, erased first */
+        offset = (offset + mtdgeometry.erasesize - 1) / mtdgeometry.erasesize * mtdgeometry.erasesize;
+    }
+
+    if ((ioctl(fd, BIOC_GEOMETRY, &geometry) < 0) ||
+        ((uint64_t)geometry.sectorsize * geometry.nsectors < offset + BENCH_SIZE)) {
+        printk("copy: no room behind the bench range. \r\n");
+        return;
+    }
+
+    if (mtdgeometry.erasesize > 0) {
+        erase.seraseblock  = offset / mtdgeometry.erasesize;
+        erase.neraseblocks = (BENCH_SIZE + mtdgeometry.erasesize - 1) / mtdgeometry.erasesize;
+
+        retval = ioctl(fd, MTDIOC_ERASE, &erase);
+        if (retval < 0) {
+            printk("copy: erase fail[%d]. \r\n", retval);
+            return;
+        }
+    }
+
+    copy.src    = BENCH_OFFSET;
+    copy.dst    = offset;
+    copy.length = BENCH_SIZE;
+
+    start = k_uptime_get();
+
+    retval = ioctl(fd, BIOC_COPY, &copy);
+    if ((retval < 0) || (copy.copied != BENCH_SIZE)) {
+        printk("copy: BIOC_COPY fail[%d], %u bytes copied. \r\n", retval, (uint32_t)copy.copied);
+        return;
+    }
+
+    ioctl(fd, BIOC_FLUSH, 0);
+
+    retval = (int)(k_uptime_get() - start);
+
+    src.offset = BENCH_OFFSET;
+    src.length = BENCH_SIZE;
+    dst.offset = offset;
+    dst.length = BENCH_SIZE;
+
+    if ((ioctl(fd, BIOC_CHECKSUM, &src) < 0) || (ioctl(fd, BIOC_CHECKSUM, &dst) < 0)) {
+        printk("copy: BIOC_CHECKSUM fail. \r\n");
+        return;
+    }
+
+    printk("copy: %u bytes in %d ms (%d KiB/s), crc %08x %s %08x. \r\n", BENCH_SIZE, retval,
+           (BENCH_SIZE * 1000 / 1024) / MAX(retval, 1), src.crc, (src.crc == dst.crc) ? "==" : "MISMATCH", dst.crc);
+}
+
+static void bench_run(int fd, bool direct)
+{
+    int64_t devus[3] = {0};
+    int wrms = 0;
+    int rdms = 0;
+    int retval = 0;
+
+    retval = ioctl(fd, BIOC_DIRECT, direct);
+    if (retval < 0) {
+        printk("ioctl BIOC_DIRECT(%d) fail[%d]. \r\n", direct, retval);
+        return;
+    }
+
+    devus[0] = bench_device_us(fd);
+
+    retval = bench_erase(fd);
+    if (retval < 0) {
+        printk("erase fail[%d]. \r\n", retval);
+        return;
+    }
+
+    wrms = bench_pass(fd, true);
+    devus[1] = bench_device_us(fd);
+    rdms = bench_pass(fd, false);
+    devus[2] = bench_device_us(fd);
+    if ((wrms < 0) || (rdms < 0)) {
+        return;
+    }
+
+    printk("%s: %u bytes in %u byte chunks, write %d ms (%d KiB/s), read %d ms (%d KiB/s). \r\n",
+           direct ? "O_DIRECT" : "cached", BENCH_SIZE, BENCH_CHUNK,
+           wrms, (BENCH_SIZE * 1000 / 1024) / MAX(wrms, 1),
+           rdms, (BENCH_SIZE * 1000 / 1024) / MAX(rdms, 1));
+
+    if (devus[0] >= 0) {
+        /* Erases included, as the device would spend them */
+        printk("%s: device time, write %d ms (%d KiB/s), read %d ms (%d KiB/s). \r\n",
+               direct ? "O_DIRECT" : "cached",
+               (int)((devus[1] - devus[0]) / 1000), (int)((int64_t)BENCH_SIZE * 1000 / 1024 * 1000 / MAX(devus[1] - devus[0], 1)),
+               (int)((devus[2] - devus[1]) / 1000), (int)((int64_t)BENCH_SIZE * 1000 / 1024 * 1000 / MAX(devus[2] - devus[1], 1)));
+    }
+
+    bench_rewrite(fd, direct);
+
+    if (!direct) {
+        rdms = bench_random_pass(fd);
+        if (rdms < 0) {
+            return;
+        }
+
+        printk("random: %u reads of %u bytes in %d ms (%d reads/s). \r\n",
+               BENCH_RANDOM_COUNT, BENCH_RANDOM_SIZE, rdms, BENCH_RANDOM_COUNT * 1000 / MAX(rdms, 1));
+    }
+}
+
+void main(void)
+{
+    int fd = 0;
+
+    fd = open(BENCH_NAME, O_RDWR);
+    if (fd < 0) {
+        printk("open(%s) fail. \r\n", BENCH_NAME);
+        return;
+    }
+    printk("open(%s) OK. \r\n", BENCH_NAME);
+
+    bench_geometry(fd);
+
+    bench_run(fd, false);
+    bench_run(fd, true);
+
+    bench_copy(fd);
+
+    bench_latency(fd);
+
+    bench_ftl(fd);
+    bench_wear(fd);
+
+    close(fd);
+    printk("close(%s) OK \r\n", BENCH_NAME);
+}
@@ -11,19 +11,26 @@
 
 #include "devfs.h"
 
-#define FLASH_NAME	"/dev/flash"
-
 #define K(s)    (s * 1024)
 
+#if defined(CONFIG_DEVFS_BLKDEV_FLASH_PARTITIONS)
+#define FLASH_NAME	"/dev/storage"  /* storage partition, nothing to skip */
+#define SKIP_SIZE	0
+#else
+#define FLASH_NAME	"/dev/flash"
+#define SKIP_SIZE	K(128)          /* skip code partition */
+#endif
+
 int ioctl(int fd, unsigned long request, ...);
 
 void main(void)
 {
     struct mtddev_geometry_t mtddev_geometry = {0};
     struct blkdev_geometry_t blkdev_geometry = {0};
+    struct blkdev_checksum_t checksum = {0};
     bool need_erase = true;
-    off_t skipsize = K(128); /* skip code partition */
-    size_t chipsize = 0;
+    off_t skipsize = SKIP_SIZE;
+    uint64_t chipsize = 0;
     int flash = 0;
     int retval = 0;
 
@@ -47,10 +54,10 @@ void main(void)
             close(flash);
             return;
         } else {
-            chipsize = blkdev_geometry.sectorsize * blkdev_geometry.nsectors;
+            chipsize = (uint64_t)blkdev_geometry.sectorsize * blkdev_geometry.nsectors;
         }
     } else {
-        chipsize = mtddev_geometry.erasesize * mtddev_geometry.neraseblocks;
+        chipsize = (uint64_t)mtddev_geometry.erasesize * mtddev_geometry.neraseblocks;
     }
 
     retval = lseek(flash, skipsize, SEEK_SET);
@@ -60,29 +67,40 @@ void main(void)
         printk("lseek(%d, %u, SEEK_SET) offset[%d] OK. \r\n", flash, skipsize, retval);
     }
 
-    for (uint32_t offset = skipsize; offset < chipsize; offset += sizeof(uint32_t)) {
-        if (need_erase) {
-            if ((offset % mtddev_geometry.erasesize) == 0) {
-                struct mtddev_erase_t erase;
+    if (need_erase) {
+        struct mtddev_blankcheck_t blankcheck;
 
-                erase.seraseblock  = offset / mtddev_geometry.erasesize;
-                erase.neraseblocks = 1;
+        blankcheck.seraseblock  = skipsize / mtddev_geometry.erasesize;
+        blankcheck.neraseblocks = (unsigned int)((chipsize - skipsize) / mtddev_geometry.erasesize);
 
-                retval = ioctl(flash, MTDIOC_ERASE, &erase);
-                if (retval < 0) {
-                    printk("ioctl MTDIOC_ERASE(%u, %u) fail[%d]. \r\n", erase.seraseblock, erase.neraseblocks, retval);
-                } else {
-                    printk("ioctl MTDIOC_ERASE(%u, %u) OK. \r\n", erase.seraseblock, erase.neraseblocks);
-                }
+        retval = ioctl(flash, MTDIOC_BLANKCHECK, &blankcheck);
+        if (retval < 0) {
+            printk("ioctl MTDIOC_BLANKCHECK(%u, %u) fail[%d]. \r\n", blankcheck.seraseblock, blankcheck.neraseblocks, retval);
+        } else {
+            printk("ioctl MTDIOC_BLANKCHECK(%u, %u) nblank[%u] OK. \r\n", blankcheck.seraseblock, blankcheck.neraseblocks, blankcheck.nblank);
+        }
 
-                k_sleep(K_MSEC(100));
-            }
+        /* Erase blocks as the writes below reach them, no erase calls of our own */
+        retval = ioctl(flash, BIOC_STREAM, 1);
+        if (retval < 0) {
+            printk("ioctl BIOC_STREAM fail[%d]. \r\n", retval);
+        } else {
+            printk("ioctl BIOC_STREAM OK. \r\n");
         }
+    }
 
+    for (uint32_t offset = skipsize; offset < chipsize; offset += sizeof(uint32_t)) {
         retval = write(flash, &offset, sizeof(offset));
         if (retval != sizeof(offset)) {
             printk("write(%d, %p, %d) fail[%d]. \r\n", flash, &offset, sizeof(offset), retval);
         }
+
+        checksum.crc = devfs_crc32(checksum.crc, &offset, sizeof(offset));
+    }
+
+    if (need_erase) {
+        /* Programs the last partial sector */
+        ioctl(flash, BIOC_STREAM, 0);
     }
 
     retval = lseek(flash, skipsize, SEEK_SET);
@@ -113,6 +131,17 @@ void main(void)
         }
     }
 
+    /* The whole image again in one call, summed inside the block layer */
+    checksum.offset = skipsize;
+    checksum.length = chipsize - skipsize;
+
+    retval = ioctl(flash, BIOC_VERIFY, &checksum);
+    if (retval < 0) {
+        printk("ioctl BIOC_VERIFY crc[0x%08x] fail[%d]. \r\n", checksum.crc, retval);
+    } else {
+        printk("ioctl BIOC_VERIFY crc[0x%08x] OK. \r\n", checksum.crc);
+    }
+
     close(flash);
     printk("close(%s) OK \r\n", FLASH_NAME);
 }